@@ -7,6 +7,7 @@
 
 #include "internal.h"
 #include "builder.h"
+#include "slab.h"
 
 #define MSG_INC	4096
 #define MAX_STACK_BUF	4096
@@ -111,9 +112,14 @@ builder_assure(opoErr err, opoBuilder builder, size_t size) {
 	int	off = builder->cur - builder->head;
 	
 	if (builder->own) {
-	    builder->head = (uint8_t*)realloc(builder->head, new_size);
+	    builder->head = slab_realloc(builder->head, new_size);
 	} else {
-	    builder->head = (uint8_t*)malloc(new_size);
+	    uint8_t	*head = builder->head;
+
+	    if (NULL != (builder->head = slab_alloc(new_size))) {
+		memcpy(builder->head, head, off);
+	    }
+	    builder->own = true;
 	}
 	if (NULL == builder->head) {
 	    return opo_err_set(err, OPO_ERR_MEMORY, "memory allocation failed for size %lu", (unsigned long)new_size);
@@ -160,7 +166,7 @@ opo_builder_init(opoErr err, opoBuilder builder, uint8_t *buf, size_t size) {
 	if (size < MIN_MSG_BUF) {
 	    size = MIN_MSG_BUF;
 	}
-	if (NULL == (builder->head = (uint8_t*)malloc(size))) {
+	if (NULL == (builder->head = slab_alloc(size))) {
 	    return opo_err_set(err, OPO_ERR_MEMORY, "memory allocation failed for size %lu", (unsigned long)size);
 	}
 	builder->own = true;
@@ -180,7 +186,7 @@ opo_builder_init(opoErr err, opoBuilder builder, uint8_t *buf, size_t size) {
 void
 opo_builder_cleanup(opoBuilder builder) {
     if (builder->own) {
-	free(builder->head);
+	slab_free(builder->head);
     }
 }
 
@@ -200,8 +206,36 @@ opo_builder_length(opoBuilder builder) {
     return builder->cur - builder->head;
 }
 
+// The builder no longer has a buffer once the message is taken.
+static void
+builder_reset(opoBuilder builder) {
+    builder->head = NULL;
+    builder->cur = NULL;
+    builder->end = NULL;
+}
+
+// Kept freeable with free() as it always was. The builder's own buffer is
+// pooled so the message is copied out of it.
 opoVal
 opo_builder_take(opoBuilder builder) {
+    size_t	size;
+    uint8_t	*msg;
+
+    opo_builder_finish(builder);
+    size = opo_msg_bsize(builder->head);
+    if (NULL != (msg = (uint8_t*)malloc(size))) {
+	memcpy(msg, builder->head, size);
+    }
+    if (builder->own) {
+	slab_free(builder->head);
+    }
+    builder_reset(builder);
+    
+    return msg;
+}
+
+opoVal
+opo_builder_take_pooled(opoBuilder builder) {
     uint8_t	*msg;
 
     opo_builder_finish(builder);
@@ -210,13 +244,11 @@ opo_builder_take(opoBuilder builder) {
     } else {
 	size_t	size = opo_msg_bsize(builder->head);
 
-	if (NULL != (msg = (uint8_t*)malloc(size))) {
+	if (NULL != (msg = slab_alloc(size))) {
 	    memcpy(msg, builder->head, size);
 	}
     }
-    builder->head = NULL;
-    builder->cur = NULL;
-    builder->end = NULL;
+    builder_reset(builder);
     
     return msg;
 }
@@ -29,6 +29,7 @@ extern "C" {
     extern opoErrCode	opo_builder_finish(opoBuilder builder);
     extern size_t	opo_builder_length(opoBuilder builder);
     extern opoMsg	opo_builder_take(opoBuilder builder);
+    extern opoMsg	opo_builder_take_pooled(opoBuilder builder);
 
     extern opoErrCode	opo_builder_push_object(opoErr err, opoBuilder builder, const char *key, int klen);
     extern opoErrCode	opo_builder_push_array(opoErr err, opoBuilder builder, const char *key, int klen);
@@ -0,0 +1,350 @@
+// Copyright 2017 by Peter Ohler, All Rights Reserved
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "cache.h"
+#include "slab.h"
+
+#define MIN_BUCKETS	64
+#define MAX_BUCKETS	(1 << 20)
+#define BYTES_PER_BUCKET	1024
+
+struct _CacheEntry {
+    CacheEntry		next; // in the hash bucket
+    CacheEntry		tag_next; // in the tag bucket
+    CacheEntry		ring_next; // clock ring
+    CacheEntry		ring_prev;
+    uint64_t		hash;
+    uint64_t		fill_id; // id of the query expected to fill the entry, zero if none
+    int64_t		tag;
+    double		expires;
+    uint8_t		*resp;
+    size_t		size; // of resp
+    bool		referenced;
+    size_t		klen;
+    uint8_t		key[]; // query without the id
+};
+
+Cache
+cache_create(size_t max, double ttl) {
+    Cache	c = (Cache)malloc(sizeof(struct _Cache));
+    size_t	cnt = MIN_BUCKETS;
+
+    if (NULL == c) {
+	return NULL;
+    }
+    while (cnt < MAX_BUCKETS && cnt * BYTES_PER_BUCKET < max) {
+	cnt *= 2;
+    }
+    if (NULL == (c->buckets = (CacheEntry*)calloc(cnt, sizeof(CacheEntry))) ||
+	NULL == (c->tags = (CacheEntry*)calloc(cnt, sizeof(CacheEntry)))) {
+	free(c->buckets);
+	free(c);
+	return NULL;
+    }
+    pthread_mutex_init(&c->lock, NULL);
+    c->mask = cnt - 1;
+    c->hand = NULL;
+    c->bytes = 0;
+    c->max = max;
+    c->ttl = ttl;
+    atomic_init(&c->hits, 0);
+
+    return c;
+}
+
+void
+cache_destroy(Cache c) {
+    if (NULL == c) {
+	return;
+    }
+    for (size_t i = 0; i <= c->mask; i++) {
+	CacheEntry	e;
+
+	while (NULL != (e = c->buckets[i])) {
+	    c->buckets[i] = e->next;
+	    slab_free(e->resp);
+	    free(e);
+	}
+    }
+    pthread_mutex_destroy(&c->lock);
+    free(c->buckets);
+    free(c->tags);
+    free(c);
+}
+
+static uint64_t
+mix(uint64_t h, uint64_t w) {
+    h = (h ^ w) * 0xff51afd7ed558ccdULL;
+
+    return h ^ (h >> 32);
+}
+
+// Eight bytes at a time. Queries are short so this beats anything fancier.
+uint64_t
+cache_hash(opoMsg query) {
+    size_t		len = opo_msg_bsize(query) - 8;
+    const uint8_t	*b = query + 8;
+    uint64_t		h = 0x9e3779b97f4a7c15ULL ^ len;
+    uint64_t		w;
+
+    for (; 8 <= len; b += 8, len -= 8) {
+	memcpy(&w, b, 8);
+	h = mix(h, w);
+    }
+    if (0 < len) {
+	w = 0;
+	memcpy(&w, b, len);
+	h = mix(h, w);
+    }
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+
+    return (0 == h) ? 1 : h;
+}
+
+bool
+cache_is_write(opoMsg query) {
+    opoVal	top = opo_msg_val(query);
+
+    return (NULL != opo_val_get(top, "insert") ||
+	    NULL != opo_val_get(top, "update") ||
+	    NULL != opo_val_get(top, "delete"));
+}
+
+// The ref of the record a query is limited to or CACHE_NO_REF.
+static int64_t
+query_tag(opoMsg query) {
+    struct _opoErr	err = OPO_ERR_INIT;
+    opoVal		where = opo_val_get(opo_msg_val(query), "where");
+
+    if (NULL == where || OPO_VAL_INT != opo_val_type(where)) {
+	return CACHE_NO_REF;
+    }
+    return opo_val_int(&err, where);
+}
+
+// The hash only picks out candidates. The query bytes must match as well.
+static CacheEntry
+find(Cache c, uint64_t hash, opoMsg query) {
+    CacheEntry		e = c->buckets[hash & c->mask];
+    const uint8_t	*key = query + 8;
+    size_t		klen = opo_msg_bsize(query) - 8;
+
+    for (; NULL != e; e = e->next) {
+	if (e->hash == hash && e->klen == klen && 0 == memcmp(e->key, key, klen)) {
+	    break;
+	}
+    }
+    return e;
+}
+
+// The id of the query being waited on is unique so it is enough to pick out
+// the entry.
+static CacheEntry
+find_filling(Cache c, uint64_t hash, uint64_t id) {
+    CacheEntry	e = c->buckets[hash & c->mask];
+
+    for (; NULL != e && (e->hash != hash || e->fill_id != id); e = e->next) {
+    }
+    return e;
+}
+
+static size_t
+tag_index(Cache c, int64_t tag) {
+    return (size_t)(((uint64_t)tag * 0x9e3779b97f4a7c15ULL) >> 32) & c->mask;
+}
+
+static void
+drop(Cache c, CacheEntry e) {
+    CacheEntry	*ep;
+
+    for (ep = c->buckets + (e->hash & c->mask); *ep != e; ep = &(*ep)->next) {
+    }
+    *ep = e->next;
+    for (ep = c->tags + tag_index(c, e->tag); *ep != e; ep = &(*ep)->tag_next) {
+    }
+    *ep = e->tag_next;
+    if (e->ring_next == e) {
+	c->hand = NULL;
+    } else {
+	e->ring_prev->ring_next = e->ring_next;
+	e->ring_next->ring_prev = e->ring_prev;
+	if (c->hand == e) {
+	    c->hand = e->ring_next;
+	}
+    }
+    c->bytes -= sizeof(struct _CacheEntry) + e->klen + e->size;
+    slab_free(e->resp);
+    free(e);
+}
+
+// Entries referenced since the hand last passed get another lap. Entries
+// waiting to be filled are passed over. If the hand gets back to the first
+// of those without clearing a reference everything left is waiting so the
+// budget is left exceeded until some are filled.
+static void
+evict(Cache c) {
+    CacheEntry	kept = NULL;
+
+    while (c->max < c->bytes && NULL != c->hand && c->hand != kept) {
+	CacheEntry	e = c->hand;
+
+	if (0 != e->fill_id) {
+	    if (NULL == kept) {
+		kept = e;
+	    }
+	    c->hand = e->ring_next;
+	} else if (e->referenced) {
+	    e->referenced = false;
+	    kept = NULL;
+	    c->hand = e->ring_next;
+	} else {
+	    drop(c, e);
+	}
+    }
+}
+
+uint8_t*
+cache_get(Cache c, uint64_t hash, opoMsg query, double now) {
+    CacheEntry	e;
+    uint8_t	*resp = NULL;
+
+    pthread_mutex_lock(&c->lock);
+    if (NULL != (e = find(c, hash, query)) && NULL != e->resp && now < e->expires &&
+	NULL != (resp = slab_alloc(e->size))) {
+	memcpy(resp, e->resp, e->size);
+	e->referenced = true;
+    }
+    pthread_mutex_unlock(&c->lock);
+    if (NULL != resp) {
+	atomic_fetch_add(&c->hits, 1);
+    }
+    return resp;
+}
+
+void
+cache_expect(Cache c, uint64_t hash, opoMsg query, uint64_t id) {
+    int64_t	tag = query_tag(query);
+    size_t	klen = opo_msg_bsize(query) - 8;
+    CacheEntry	e;
+
+    pthread_mutex_lock(&c->lock);
+    if (NULL != (e = find(c, hash, query))) {
+	e->fill_id = id;
+    } else {
+	if (NULL == (e = (CacheEntry)malloc(sizeof(struct _CacheEntry) + klen))) {
+	    pthread_mutex_unlock(&c->lock);
+	    return;
+	}
+	size_t	ti = tag_index(c, tag);
+
+	e->hash = hash;
+	e->fill_id = id; // before evicting so the new entry is kept
+	e->tag = tag;
+	e->expires = 0.0;
+	e->resp = NULL;
+	e->size = 0;
+	e->referenced = false;
+	e->klen = klen;
+	memcpy(e->key, query + 8, klen);
+	e->next = c->buckets[hash & c->mask];
+	c->buckets[hash & c->mask] = e;
+	e->tag_next = c->tags[ti];
+	c->tags[ti] = e;
+	// Behind the hand so it is the last the clock gets to.
+	if (NULL == c->hand) {
+	    e->ring_next = e;
+	    e->ring_prev = e;
+	    c->hand = e;
+	} else {
+	    e->ring_next = c->hand;
+	    e->ring_prev = c->hand->ring_prev;
+	    e->ring_prev->ring_next = e;
+	    c->hand->ring_prev = e;
+	}
+	c->bytes += sizeof(struct _CacheEntry) + klen;
+	evict(c);
+    }
+    pthread_mutex_unlock(&c->lock);
+}
+
+void
+cache_fill(Cache c, uint64_t hash, uint64_t id, opoMsg resp, double now) {
+    struct _opoErr	err = OPO_ERR_INIT;
+
+    // Errors are not worth keeping.
+    if (0 != opo_val_int(&err, opo_val_get(opo_msg_val(resp), "code"))) {
+	return;
+    }
+    size_t	size = opo_msg_bsize(resp);
+    uint8_t	*copy = slab_alloc(size);
+    CacheEntry	e;
+
+    if (NULL == copy) {
+	return;
+    }
+    memcpy(copy, resp, size);
+    pthread_mutex_lock(&c->lock);
+    if (NULL != (e = find_filling(c, hash, id))) {
+	slab_free(e->resp);
+	c->bytes += size - e->size;
+	e->resp = copy;
+	e->size = size;
+	e->expires = now + c->ttl;
+	e->fill_id = 0;
+	e->referenced = true;
+	copy = NULL;
+	evict(c);
+    }
+    pthread_mutex_unlock(&c->lock);
+    slab_free(copy);
+}
+
+void
+cache_forget(Cache c, uint64_t hash, uint64_t id) {
+    CacheEntry	e;
+
+    pthread_mutex_lock(&c->lock);
+    if (NULL != (e = find_filling(c, hash, id))) {
+	e->fill_id = 0;
+    }
+    pthread_mutex_unlock(&c->lock);
+}
+
+static void
+drop_tag(Cache c, int64_t tag) {
+    CacheEntry	e = c->tags[tag_index(c, tag)];
+
+    while (NULL != e) {
+	CacheEntry	next = e->tag_next;
+
+	if (e->tag == tag) {
+	    drop(c, e);
+	}
+	e = next;
+    }
+}
+
+void
+cache_invalidate(Cache c, opoMsg query) {
+    bool	insert = NULL != opo_val_get(opo_msg_val(query), "insert");
+    int64_t	tag = query_tag(query);
+
+    pthread_mutex_lock(&c->lock);
+    if (insert) {
+	// A new record can only show up in queries that are not limited to
+	// an existing one.
+	drop_tag(c, CACHE_NO_REF);
+    } else if (CACHE_NO_REF != tag) {
+	drop_tag(c, tag);
+	drop_tag(c, CACHE_NO_REF);
+    } else {
+	while (NULL != c->hand) {
+	    drop(c, c->hand);
+	}
+    }
+    pthread_mutex_unlock(&c->lock);
+}
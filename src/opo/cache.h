@@ -0,0 +1,61 @@
+// Copyright 2017 by Peter Ohler, All Rights Reserved
+
+#ifndef __OPO_CACHE_H__
+#define __OPO_CACHE_H__
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "val.h"
+
+#define CACHE_NO_REF	0 // tag for queries that are not a lookup of a single record
+
+typedef struct _CacheEntry	*CacheEntry;
+
+// Responses to read queries keyed by the query without its id and found by
+// a hash of the same bytes. An entry is added when a read is sent and filled
+// when its response arrives so a write that invalidates the entry in between
+// keeps the older response out. An entry waiting to be filled is not
+// evicted. Entries are tagged with the record ref the query looks up, if any, so
+// a write to a record only drops the entries that could have changed.
+// Eviction is CLOCK over all entries once the byte budget is exceeded.
+typedef struct _Cache {
+    pthread_mutex_t	lock;
+    CacheEntry		*buckets; // by hash
+    CacheEntry		*tags; // by tag
+    size_t		mask;
+    CacheEntry		hand; // next entry the clock looks at
+    size_t		bytes;
+    size_t		max;
+    double		ttl;
+    atomic_ullong	hits;
+} *Cache;
+
+extern Cache	cache_create(size_t max, double ttl);
+extern void	cache_destroy(Cache c);
+
+// Returns a non-zero hash of the query, skipping the id.
+extern uint64_t	cache_hash(opoMsg query);
+
+// Returns true if the query is an insert, update, or delete.
+extern bool	cache_is_write(opoMsg query);
+
+// Returns a copy of a live cached response, allocated with slab_alloc(), or
+// NULL if there is none.
+extern uint8_t*	cache_get(Cache c, uint64_t hash, opoMsg query, double now);
+
+// Notes that the query with the hash and id has been sent.
+extern void	cache_expect(Cache c, uint64_t hash, opoMsg query, uint64_t id);
+
+// Stores the response if the query with the id is still the one expected.
+extern void	cache_fill(Cache c, uint64_t hash, uint64_t id, opoMsg resp, double now);
+
+// Stops waiting on the query with the id as no response is coming.
+extern void	cache_forget(Cache c, uint64_t hash, uint64_t id);
+
+// Drops the entries a write query could make stale.
+extern void	cache_invalidate(Cache c, opoMsg query);
+
+#endif /* __OPO_CACHE_H__ */
@@ -2,6 +2,7 @@
 
 #include <errno.h>
 #include <fcntl.h>
+#include <math.h>
 #include <netdb.h>
 #include <netinet/tcp.h>
 #include <poll.h>
@@ -11,16 +12,32 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
 #include <sys/socket.h>
 #include <sys/time.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/un.h>
 #include <time.h>
 #include <unistd.h>
 
+#include "cache.h"
+#include "flight.h"
+#include "multiget.h"
+#include "multiput.h"
 #include "client.h"
+#include "client_int.h"
 #include "dtime.h"
+#include "future_int.h"
 #include "opo.h"
-#include "queue.h"
+#include "park.h"
+#include "reactor.h"
+#include "receiver.h"
+#include "sender.h"
+#include "slab.h"
+#include "wheel.h"
 
 #define MIN_SLEEP	(1.0 / (double)CLOCKS_PER_SEC)
 // lower gives faster response but burns more CPU. This is a reasonable compromise.
@@ -28,50 +45,123 @@
 #define NOT_WAITING	0
 #define WAITING		1
 #define NOTIFIED	2
+#define SEND_BUF_SIZE	65536
+#define RTT_DECAY	1.0 // seconds for the weight of an old response time to fall to 1/e
+#define WHEEL_TICK	0.01 // deadline resolution in seconds
+#define IDLE_POLL	0.1 // longest the receiving thread waits before checking deadlines
+#define RECV_BUF_SIZE	262144
+#define CACHE_LINE	64
+#define BATCH_MAX	256 // queries reserved and appended together
+#define CACHE_TTL	0.5 // default seconds a cached response is served
+#define CACHED_REF	0x8000000000000000ULL // set in refs of responses from the cache
+#define MULTIGET_MAX	64 // default most fetches in a multi-get
+#define MULTIPUT_MAX	65536 // default most bytes of records in a multi-insert
+#define UNIX_PREFIX	"unix:" // host form for a unix domain socket path
 
 typedef enum {
     Q_CLEAR	= 0,
     Q_SENT	= 's',
     Q_READY	= 'r',
     Q_TAKEN	= 'd',
+    Q_CLAIMED	= 'c', // a response, time out, or cancel is completing it
 } QueryState;
 
+// Each query takes a full cache line so producers filling adjacent slots
+// and the receiving thread do not false share.
 typedef struct _Query {
+    _Alignas(CACHE_LINE) atomic_ullong	seq; // id allowed to claim the slot next
     uint64_t		id;
     opoQueryCallback	cb;
     void		*ctx;
     double		when;
     atomic_char		state;
+    bool		follower; // joined a flight instead of being sent
+    bool		shared; // the response belongs to the flight
+    float		timeout; // seconds after when to give up, zero for never
     opoMsg		resp;
+    union {
+	uint64_t	cache_hash; // zero if the response is not to be cached
+	uint64_t	lead; // id of the flight a follower joined, zero if none
+	Flight		flight; // once shared
+    };
 } *Query;
 
+// Deadline timer for the query in the slot with the same index. The id is
+// kept as a canceled query leaves its timer in the wheel.
+typedef struct _Deadline {
+    struct _Timer	timer; // must be first
+    uint64_t		id;
+} *Deadline;
+
+// Cell in the ready ring used for unordered dispatch.
+typedef struct _Ready {
+    atomic_ullong	seq;
+    Query		q;
+} *Ready;
+
 struct _opoClient {
     volatile bool	active;
     int			sock;
     double		timeout;
     pthread_t		recv_thread;
-    atomic_ullong	next_id;
+    opoReactor		reactor; // when set the reactor receives instead of recv_thread
+    bool		embedded; // no receiving thread, the caller pumps
+    bool		inline_callbacks; // call back from the receiving thread
+    struct _Watch	watch;
+    _Alignas(CACHE_LINE) atomic_ullong	next_id;
     opoStatusCallback	status_callback;
     opoQueryCallback	query_callback;
     void		*query_ctx;
 
-    struct _Queue	async_queue;
     atomic_int_fast64_t	pending;
+    atomic_int_fast64_t	ready;
+    atomic_int_fast64_t	abandoned; // late responses expected for timed out or canceled queries
+    _Atomic double	rtt; // peak EWMA of the response time in seconds
+    double		rtt_at; // when rtt was last updated
+    struct _Sender	sender;
+    struct _Receiver	receiver;
 
+    // The query with a given id is always in slot id % pending_max.
     Query		q;
     Query		end;
     size_t		pending_max;
-    volatile Query	head;
-    volatile Query	tail;
-    Query		on_deck;
+    bool		unordered;
+    _Alignas(CACHE_LINE) atomic_ullong	head_id; // next id to process when ordered
+
+    // Responses in arrival order when unordered.
+    Ready		ready_q;
+    _Alignas(CACHE_LINE) atomic_ullong	ready_head;
+    _Alignas(CACHE_LINE) atomic_ullong	ready_tail;
+
+    // Deadlines are only touched by the receiving side. The timer for a
+    // query is at the same index as its slot.
+    struct _Wheel	wheel;
+    Deadline		deadlines;
+    unsigned long long	wheel_id; // next id to add to the wheel
+    uint8_t		lost[128]; // response given to queries that time out
+    uint8_t		canceled[128]; // response given to canceled queries
+
+    Cache		cache; // NULL unless caching responses
+    Flights		flights; // NULL unless coalescing identical reads
+    Multiget		multiget; // NULL unless gathering fetches
+    Multiput		multiput; // NULL unless bundling inserts
+    atomic_ullong	cached_id; // for refs of responses served from the cache
+
+    struct _Park	ready_park; // processing threads wait here for responses
+    Park		notify; // also woken when a response is ready if not NULL
+    struct _Park	room_park; // submitters wait here when the window is full
 
-    atomic_flag		head_lock;
-    atomic_flag		tail_lock;
-    atomic_flag		take_lock;
+    // Made readable when room frees up after a try query found none.
+    int			room_rsock;
+    int			room_wsock;
+    atomic_bool		room_wanted;
+    atomic_bool		room_signaled;
 
-    atomic_int		waiting;
-    int			rsock;
-    int			wsock;
+    // Made readable so the receiving thread polls for writable when bytes
+    // are left in the send buffer after it started waiting.
+    int			kick_rsock;
+    int			kick_wsock;
+    atomic_bool		kicked;
 };
 
 static void
@@ -79,6 +169,179 @@ query_set_state(Query q, QueryState state) {
     atomic_store(&q->state, state);
 }
 
+static Query
+pending_slot(opoClient client, uint64_t id) {
+    return client->q + (id % client->pending_max);
+}
+
+// Exactly one of the response, the deadline, or a cancel gets to complete a
+// query.
+static bool
+claim_sent(Query q) {
+    char	state = Q_SENT;
+
+    return atomic_compare_exchange_strong(&q->state, &state, Q_CLAIMED);
+}
+
+// Called when a query leaves the window.
+static void
+room_freed(opoClient client) {
+    park_wake(&client->room_park);
+    if (atomic_load(&client->room_wanted) && atomic_exchange(&client->room_wanted, false)) {
+	uint64_t	one = 1;
+
+	atomic_store(&client->room_signaled, true);
+	if (write(client->room_wsock, &one, sizeof(one))) {}
+    }
+}
+
+static void
+room_drain(opoClient client) {
+    if (atomic_load(&client->room_signaled) && atomic_exchange(&client->room_signaled, false)) {
+	uint64_t	buf[8];
+
+	while (0 < read(client->room_rsock, buf, sizeof(buf))) {
+	}
+    }
+}
+
+// Blocks until room frees up or the give_up time passes.
+static void
+room_wait(opoClient client, double give_up, int *spins) {
+    if (park_spin(&client->room_park, spins)) {
+	return;
+    }
+    unsigned int	key = park_prepare(&client->room_park);
+    double		now = dtime();
+
+    park_wait(&client->room_park, key, (give_up < now + 0.1) ? give_up - now : 0.1);
+    park_done(&client->room_park);
+}
+
+// The window is the ring of query slots which are not free until the
+// response has been processed.
+static bool
+has_room(opoClient client) {
+    unsigned long long	id = atomic_load(&client->next_id);
+
+    return atomic_load(&pending_slot(client, id)->seq) == id;
+}
+
+static opoRef
+no_room(opoErr err, opoClient client) {
+    atomic_store(&client->room_wanted, true);
+    // A query may have completed between the check and setting the flag so
+    // make sure the caller is not left waiting for a signal that never comes.
+    if (has_room(client)) {
+	room_freed(client);
+    }
+    opo_err_set(err, EAGAIN, "query window full");
+
+    return 0;
+}
+
+// Claims the slot for the next id without a lock. An id is only taken once
+// its slot has been released by the query from the previous lap around the
+// ring so there are never gaps in the ids the processing side waits on.
+static Query
+reserve_slot(opoErr err, opoClient client, bool wait) {
+    unsigned long long	id = atomic_load(&client->next_id);
+    unsigned long long	seq;
+    double		give_up = 0.0;
+    int			spins = 0;
+    Query		q;
+
+    while (true) {
+	q = pending_slot(client, id);
+	seq = atomic_load(&q->seq);
+	if (seq == id) {
+	    if (atomic_compare_exchange_weak(&client->next_id, &id, id + 1)) {
+		q->id = id;
+		return q;
+	    }
+	    continue;
+	}
+	if (seq < id) { // still in use so the ring is full
+	    if (!wait) {
+		return NULL;
+	    }
+	    if (0.0 >= client->timeout) {
+		opo_err_set(err, EAGAIN, "write failed, busy");
+		return NULL;
+	    }
+	    if (0.0 == give_up) {
+		give_up = dtime() + client->timeout;
+	    } else if (give_up < dtime()) {
+		opo_err_set(err, EAGAIN, "write failed, busy");
+		return NULL;
+	    }
+	    room_wait(client, give_up, &spins);
+	}
+	id = atomic_load(&client->next_id);
+    }
+    return NULL;
+}
+
+// Claims the slots for n consecutive ids with a single update of next_id.
+// Returns the first id or zero if there is no room.
+static unsigned long long
+reserve_slots(opoErr err, opoClient client, int n, bool wait) {
+    unsigned long long	id = atomic_load(&client->next_id);
+    unsigned long long	seq;
+    double		give_up = 0.0;
+    int			spins = 0;
+    int			k;
+
+    while (true) {
+	for (k = 0, seq = id; k < n; k++) {
+	    if ((seq = atomic_load(&pending_slot(client, id + k)->seq)) != id + k) {
+		break;
+	    }
+	}
+	if (k == n) {
+	    if (atomic_compare_exchange_weak(&client->next_id, &id, id + n)) {
+		for (k = 0; k < n; k++) {
+		    pending_slot(client, id + k)->id = id + k;
+		}
+		return id;
+	    }
+	    continue;
+	}
+	if (seq < id + k) { // still in use so the ring is full
+	    if (!wait) {
+		return 0;
+	    }
+	    if (0.0 >= client->timeout) {
+		opo_err_set(err, EAGAIN, "write failed, busy");
+		return 0;
+	    }
+	    if (0.0 == give_up) {
+		give_up = dtime() + client->timeout;
+	    } else if (give_up < dtime()) {
+		opo_err_set(err, EAGAIN, "write failed, busy");
+		return 0;
+	    }
+	    room_wait(client, give_up, &spins);
+	}
+	id = atomic_load(&client->next_id);
+    }
+    return 0;
+}
+
+// Must be called after the response has been processed.
+static void
+release_slot(opoClient client, Query q) {
+    uint64_t	id = q->id;
+
+    q->id = 0;
+    q->resp = NULL;
+    q->follower = false;
+    q->shared = false;
+    query_set_state(q, Q_CLEAR);
+    atomic_store(&q->seq, id + client->pending_max); // must be last modification to query
+    room_freed(client);
+}
+
 static void
 status_callback(opoClient client, bool connected, opoErrCode code, const char *fmt, ...) {
     char	buf[256];
@@ -90,68 +353,119 @@ status_callback(opoClient client, bool connected, opoErrCode code, const char *f
     va_end(ap);
 }
 
+// The ready ring is a bounded multi-producer multi-consumer queue where each
+// cell carries a sequence number. It can not overflow as at most
+// pending_max queries are ready at one time.
 static void
-wait_for_ready(opoClient client, double timeout) {
-    if (0 == client->rsock) {
-	dsleep(timeout);
-	return;
+ready_push(opoClient client, Query q) {
+    unsigned long long	pos = atomic_load(&client->ready_tail);
+    Ready		r;
+
+    while (true) {
+	r = client->ready_q + (pos % client->pending_max);
+	if (atomic_load(&r->seq) == pos) {
+	    if (atomic_compare_exchange_weak(&client->ready_tail, &pos, pos + 1)) {
+		break;
+	    }
+	} else {
+	    pos = atomic_load(&client->ready_tail);
+	}
     }
-    atomic_fetch_add(&client->waiting, 1);
+    r->q = q;
+    atomic_store(&r->seq, pos + 1);
+}
 
-    struct pollfd	pa;
-    
-    pa.fd = client->rsock;
-    pa.events = POLLIN;
-    pa.revents = 0;
-    if (1 == poll(&pa, 1, (int)(timeout / 1000.0))) {
-	if (0 != (pa.revents & POLLIN)) {
-	    char	buf[8];
-	    
-	    while (0 < read(client->rsock, buf, sizeof(buf))) {
+static Query
+ready_pop(opoClient client) {
+    unsigned long long	pos = atomic_load(&client->ready_head);
+    unsigned long long	seq;
+    Ready		r;
+    Query		q;
+
+    while (true) {
+	r = client->ready_q + (pos % client->pending_max);
+	seq = atomic_load(&r->seq);
+	if (seq == pos + 1) {
+	    if (atomic_compare_exchange_weak(&client->ready_head, &pos, pos + 1)) {
+		break;
 	    }
+	} else if (seq < pos + 1) { // empty
+	    return NULL;
+	} else {
+	    pos = atomic_load(&client->ready_head);
 	}
     }
-    atomic_fetch_sub(&client->waiting, 1);
+    q = r->q;
+    atomic_store(&r->seq, pos + client->pending_max);
+
+    return q;
 }
 
-static void
-wake_ready(opoClient client) {
-    if (0 == client->wsock || 0 >= atomic_load(&client->waiting)) {
-	return;
+// Claims the query with the next id if its response has arrived. Any number
+// of threads can compete and exactly one wins each id.
+static Query
+claim_ordered(opoClient client) {
+    unsigned long long	id = atomic_load(&client->head_id);
+    Query		q;
+
+    while (true) {
+	q = pending_slot(client, id);
+	// A canceled query releases its slot at once so skip over it.
+	if (id < atomic_load(&q->seq)) {
+	    atomic_compare_exchange_weak(&client->head_id, &id, id + 1);
+	    continue;
+	}
+	if (Q_READY != atomic_load(&q->state) || q->id != id) {
+	    return NULL;
+	}
+	if (atomic_compare_exchange_weak(&client->head_id, &id, id + 1)) {
+	    return q;
+	}
     }
-    if (write(client->wsock, ".", 1)) {}
 }
 
+static Query
+claim_ready(opoClient client) {
+    return client->unordered ? ready_pop(client) : claim_ordered(client);
+}
+
+// A negative timeout waits until a response is ready.
 static Query
 take_next_ready(opoClient client, double timeout) {
-    while (atomic_flag_test_and_set(&client->head_lock)) {
-	dsleep(RETRY_SECS);
-    }
-    if (Q_READY != atomic_load(&client->head->state)) {
-	if (0.0 < timeout) {
-	    double	give_up = dtime() + timeout;
+    double	give_up = 0.0;
+    double	now;
+    Query	q;
 
-	    while (Q_READY != atomic_load(&client->head->state)) {
-		if (give_up < dtime()) {
-		    atomic_flag_clear(&client->head_lock);
-		    return NULL;
-		}
-		wait_for_ready(client, 0.01);
+    for (int spins = 0; NULL == (q = claim_ready(client)); ) {
+	if (0.0 == timeout) {
+	    return NULL;
+	}
+	if (park_spin(&client->ready_park, &spins)) {
+	    continue;
+	}
+	now = dtime();
+	if (0.0 < timeout) {
+	    if (0.0 == give_up) {
+		give_up = now + timeout;
+	    }
+	    if (give_up <= now) {
+		return NULL;
 	    }
 	} else {
-	    atomic_flag_clear(&client->head_lock);
-	    return NULL;
+	    give_up = now + 1.0;
 	}
-    }
-    Query	q = client->head;
-    
-    client->head++;
-    if (client->end <= client->head) {
-	client->head = client->q;
-    }
-    atomic_flag_clear(&client->head_lock);
+	unsigned int	key = park_prepare(&client->ready_park);
 
+	if (NULL == (q = claim_ready(client))) {
+	    park_wait(&client->ready_park, key, give_up - now);
+	}
+	park_done(&client->ready_park);
+	if (NULL != q) {
+	    break;
+	}
+    }
     query_set_state(q, Q_TAKEN);
+    atomic_fetch_sub(&client->ready, 1);
 
     return q;
 }
@@ -175,422 +489,1533 @@ get_addr_info(opoErr err, const char *host, int port) {
     return res;
 }
 
-// Find the pending query with the id by starting with on_dec and work towards
-// the tail.
-static Query
-pending_find(opoClient client, uint64_t id) {
-    Query	q = client->on_deck;
-    bool	looped = false;
+// Jumps up to a slower response time at once but decays toward faster ones
+// so a server that stalls is avoided right away and trusted again slowly.
+// Only the receiving side updates the average.
+static void
+observe_rtt(opoClient client, double when) {
+    double	now = dtime();
+    double	rtt = now - when;
+    double	avg = atomic_load_explicit(&client->rtt, memory_order_relaxed);
 
-    do {
-	if (q->id == id) {
-	    return q;
-	}
-	q++;
-	if (client->end <= q) {
-	    if (looped) { // safety check in case the tail was missed
-		break;
-	    }
-	    q = client->q;
-	    looped = true;
-	}
-    } while (q != client->tail);
+    if (avg < rtt) {
+	avg = rtt;
+    } else {
+	double	w = exp((client->rtt_at - now) / RTT_DECAY);
 
-    return NULL;
+	avg = avg * w + rtt * (1.0 - w);
+    }
+    client->rtt_at = now;
+    atomic_store_explicit(&client->rtt, avg, memory_order_relaxed);
 }
 
+// The lost and canceled responses are not from the receiver.
 static void
-process_msg(opoClient client, opoMsg msg) {
-    uint64_t	id = opo_msg_id(msg);
-    Query	q = client->on_deck;;
-
-    if (id != client->on_deck->id) {
-	if (NULL == (q = pending_find(client, id))) {
-	    status_callback(client, true, OPO_ERR_NOT_FOUND, "Pending query %llu not found.", (unsigned long long)id);
-	    free((uint8_t*)msg);
-	    return;
-	}
-	while (q != client->on_deck) {
-	    if (NULL != client->on_deck->cb) {
-		uint8_t			lost_msg[1024];
-		struct _opoBuilder	b;
-		struct _opoErr		err = OPO_ERR_INIT;
-	    
-		opo_builder_init(&err, &b, lost_msg, sizeof(lost_msg));
-		opo_builder_push_object(&err, &b, NULL, 0);
-		opo_builder_push_int(&err, &b, OPO_ERR_LOST, "code", 4);
-		opo_builder_push_string(&err, &b, "no response", -1, "error", 5);
-		opo_builder_finish(&b);
-		opo_msg_set_id(b.head, id);
-		client->on_deck->resp = opo_builder_take(&b);
-		query_set_state(client->on_deck, Q_READY);
-	    }
-	    client->on_deck++;
-	    if (client->end <= client->on_deck) {
-		client->on_deck = client->q;
-	    }
-	}
-    }
-    if (Q_SENT != atomic_load(&q->state)) {
-	status_callback(client, true, OPO_ERR_TOO_MANY, "Duplicate response to query %llu.", (unsigned long long)id);
-	free((uint8_t*)msg);
-	return;
+release_resp(opoClient client, opoMsg msg) {
+    if (msg != client->lost && msg != client->canceled) {
+	receiver_release(&client->receiver, msg);
     }
-    q->resp = msg;
-    query_set_state(q, Q_READY);
-    client->on_deck++;
-    if (client->end <= client->on_deck) {
-	client->on_deck = client->q;
+}
+
+// Releases the response given to a query. A response shared through a
+// flight is released by the last of the queries to finish with it.
+static void
+release_query_resp(opoClient client, Query q) {
+    Flight	f;
+
+    if (!q->shared) {
+	release_resp(client, q->resp);
+    } else if (1 == atomic_fetch_sub(&(f = q->flight)->refs, 1)) {
+	receiver_release(&client->receiver, f->resp);
+	flights_release(client->flights, f);
     }
-    wake_ready(client);
 }
 
-void*
-recv_loop(void *ctx) {
-    opoClient		client = (opoClient)ctx;
-    struct pollfd	pa[1];
-    int			i;
-    uint8_t		buf[4096];
-    uint8_t		*msg = NULL;
-    ssize_t		msize = 0;
-    ssize_t		mcnt = 0;
-    ssize_t		bcnt = 0;
-    ssize_t		cnt;
-    size_t		size;
+// Completes a future from the receiving side, bypassing
+// opo_client_process(). The response is copied since messages in the
+// receive ring hold up the ring until released and the future may keep its
+// response indefinitely. Responses already on the heap are handed over by
+// complete_query() instead. A coalesced response carries the id of the query
+// that was sent so the copy is given the future's own.
+static void
+future_done(opoRef ref, opoMsg msg, void *ctx) {
+    opoFuture	future = (opoFuture)ctx;
+    opoClient	client = future->client;
 
-    while (client->active) {
-	pa->fd = client->sock;
-	pa->events = POLLIN;
-	pa->revents = 0;
-	if (0 > (i = poll(pa, 1, 100))) {
-	    if (EAGAIN == errno) {
-		continue;
-	    }
-	    // Either a signal or something bad like out of memory. Might as well exit.
-	    if (NULL != client->status_callback) {
-		client->status_callback(client, false, errno, "connection polling error");
-	    }
-	    break;
-	}
-	if (0 == i) { // nothing to read or write
-	    continue;
-	}
-	if (0 != (pa->revents & POLLIN)) {
-	    if (NULL == msg) {
-		if (0 > (cnt = recv(client->sock, buf + bcnt, sizeof(buf) - bcnt, 0))) {
-		    if (client->active && NULL != client->status_callback) {
-			client->status_callback(client, false, errno, "read failed");
-		    }
-		} else if (0 == cnt) {
-		    if (client->active && 0 < client->sock && NULL != client->status_callback) {
-			client->status_callback(client, false, OPO_ERR_READ, "connection closed");
-		    }
-		    close(client->sock);
-		    client->sock = 0;
-		} else { // read something
-		    bcnt += cnt;
-		    while (13 <= bcnt) { // need 8 bytes for id, 1 for type, and 4 for length of val
-			size = opo_msg_bsize((opoMsg)buf);
-			if (NULL == (msg = (uint8_t*)malloc(size))) {
-			    if (NULL != client->status_callback) {
-				char	err_msg[256];
-
-				sprintf(err_msg, "failed to allocate memory for message of size %lu.", (unsigned long)size);
-				client->status_callback(client, true, OPO_ERR_MEMORY, err_msg);
-			    }
-			    break;
-			}
-			if (size <= bcnt) {
-			    memcpy(msg, buf, size);
-			    if (size < bcnt) {
-				memmove(buf, buf + size, bcnt - size);
-			    }
-			    if (NULL == client->query_callback) {
-				process_msg(client, msg);
-			    } else {
-				queue_push(&client->async_queue, msg);
-			    }
-			    msg = NULL;
-			    msize = 0;
-			    mcnt = 0;
-			    bcnt -= size;
-			} else {
-			    memcpy(msg, buf, bcnt);
-			    msize = size;
-			    mcnt = bcnt;
-			    bcnt = 0;
-			}
-		    }
-		}
-	    } else { // msg has been allocated
-		if (0 > (cnt = recv(client->sock, msg + mcnt, msize - mcnt, 0))) {
-		    if (NULL != client->status_callback) {
-			char	err_msg[256];
-
-			sprintf(err_msg, "read failed. %s.", strerror(errno));
-			client->status_callback(client, false, errno, err_msg);
-		    }
-		    close(client->sock);
-		    client->sock = 0;
-		} else {
-		    mcnt += cnt;
-		    if (msize == mcnt) {
-			if (NULL == client->query_callback) {
-			    process_msg(client, msg);
-			} else {
-			    queue_push(&client->async_queue, msg);
-			}
-			msg = NULL;
-			msize = 0;
-			mcnt = 0;
-		    }
-		}
-	    }
-	}
-	if (0 != (pa->revents & (POLLERR | POLLHUP | POLLNVAL))) {
-	    if (0 == bcnt && NULL == msg) {
-		if (client->active && NULL != client->status_callback) {
-		    client->status_callback(client, false, OPO_ERR_OK, "connection closed");
-		}
-		client->sock = 0;
-	    } else if (0 != (pa->revents & (POLLHUP | POLLNVAL))) {
-		if (NULL != client->status_callback) {
-		    client->status_callback(client, false, OPO_ERR_READ, "closed with outstanding responses");
-		}
-		client->sock = 0;
-	    } else {
-		if (NULL != client->status_callback) {
-		    char	err_msg[256];
+    if (msg == client->lost) {
+	future_set(future, NULL, OPO_ERR_LOST);
+    } else if (msg == client->canceled) {
+	future_set(future, NULL, client_connected(client) ? OPO_ERR_CANCELED : OPO_ERR_READ);
+    } else {
+	size_t	size = opo_msg_bsize(msg);
+	uint8_t	*resp = slab_alloc(size);
 
-		    sprintf(err_msg, "socket error. %s.", strerror(errno));
-		    client->status_callback(client, false, errno, err_msg);
-		}
-		close(client->sock);
-		client->sock = 0;
-	    }
+	if (NULL != resp) {
+	    memcpy(resp, msg, size);
+	    opo_msg_set_id(resp, ref);
 	}
+	future_set(future, resp, (NULL == resp) ? OPO_ERR_MEMORY : OPO_ERR_OK);
     }
-    return NULL;
 }
 
-opoClient
-opo_client_connect(opoErr err, const char *host, int port, opoClientOptions options) {
-    struct addrinfo	*res = get_addr_info(err, host, port);
-    int			sock;
-    int			optval = 1;
-
-    if (NULL == res) {
-	return NULL;
+// Hands a response to a query. Returns true if the callback was made
+// inline.
+static bool
+complete_query(opoClient client, Query q, opoMsg msg) {
+    wheel_remove(&client->wheel, &client->deadlines[q - client->q].timer);
+    q->resp = msg;
+    if (future_done == q->cb && !q->shared &&
+	msg != client->lost && msg != client->canceled &&
+	!receiver_in_ring(&client->receiver, msg)) {
+	// A response that spilled out of the ring or was built for a
+	// gathered fetch or bundled insert is given to the future as is.
+	atomic_fetch_sub(&client->pending, 1);
+	future_set((opoFuture)q->ctx, msg, OPO_ERR_OK);
+	q->resp = NULL;
+	release_slot(client, q);
+	return true;
     }
-    if (0 > (sock = socket(res->ai_family, res->ai_socktype, res->ai_protocol))) {
-	opo_err_no(err, "error creating socket to %s:%d", host, port);
-	return NULL;
+    if (client->inline_callbacks || future_done == q->cb) {
+	atomic_fetch_sub(&client->pending, 1);
+	if (NULL != q->cb) {
+	    q->cb(q->id, msg, q->ctx);
+	}
+	release_query_resp(client, q);
+	release_slot(client, q);
+	return true;
     }
-    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &optval, sizeof(optval));
-    //setsockopt(sock, SOL_SOCKET, SO_KEEPALIVE, &optval, sizeof(optval));
-    fcntl(sock, F_SETFL, O_NONBLOCK);
+    atomic_fetch_sub(&client->pending, 1);
+    atomic_fetch_add(&client->ready, 1);
+    query_set_state(q, Q_READY);
+    if (client->unordered) {
+	ready_push(client, q);
+    }
+    park_wake(&client->ready_park);
+    if (NULL != client->notify) {
+	park_wake(client->notify);
+    }
+    return false;
+}
 
-    double	giveup = dtime() + 2.0;
+static bool
+take_abandoned(opoClient client) {
+    int_fast64_t	cnt = atomic_load(&client->abandoned);
 
-    while (0 > connect(sock, res->ai_addr, res->ai_addrlen)) {
-	if (EISCONN == errno) {
-	    break;
-	}
-	if (giveup < dtime()) {
-	    opo_err_no(err, "error connecting socket to %s:%d", host, port);
-	    close(sock);
-	    return NULL;
+    while (0 < cnt) {
+	if (atomic_compare_exchange_weak(&client->abandoned, &cnt, cnt - 1)) {
+	    return true;
 	}
-	usleep(1000);
     }
-    opoClient	client = (opoClient)malloc(sizeof(struct _opoClient));
+    return false;
+}
 
-    if (NULL == client) {
-	opo_err_set(err, OPO_ERR_MEMORY, "failed to allocate memory for a opoClient.");
+// Hands the response to the query that was sent and to the queries that
+// joined it. When more than one is still waiting they all share the one
+// response. Returns the number of callbacks made inline.
+static int
+land_flight(opoClient client, Flight f, Query q, opoMsg msg) {
+    bool	sent = q->id == f->id && claim_sent(q);
+    int		cnt = 0;
+    int		called = 0;
+
+    // Claimed first so the count of holders is known before any of them
+    // can finish with the response.
+    for (int i = 0; i < f->cnt; i++) {
+	uint64_t	id = f->followers[i];
+	Query		fq = pending_slot(client, id);
+
+	// The seq only matches while the slot belongs to the query.
+	if (atomic_load(&fq->seq) == id && fq->id == id && claim_sent(fq)) {
+	    f->followers[cnt++] = id;
+	}
+    }
+    if (sent) {
+	observe_rtt(client, q->when);
+	if (0 != q->cache_hash) {
+	    cache_fill(client->cache, q->cache_hash, f->id, msg, dtime());
+	}
     } else {
-	int	stat;
-	int	pending_max = 4096;
-	
-	client->sock = sock;
-	atomic_init(&client->pending, 0);
-	
-	if (NULL == options) {
-	    client->timeout = 2.0;
-	    client->status_callback = NULL;
-	    client->query_callback = NULL;
-	    client->query_ctx = NULL;
-	} else {
-	    client->timeout = options->timeout;
-	    client->status_callback = options->status_callback;
-	    pending_max = options->pending_max;
-	    if (pending_max < 1) {
-		pending_max = 1;
-	    }
-	    client->query_callback = options->query_callback;
-	    client->query_ctx = options->query_ctx;
+	// Timed out or canceled so the response was counted as abandoned.
+	take_abandoned(client);
+    }
+    if (0 == cnt) {
+	flights_release(client->flights, f);
+	if (!sent) {
+	    receiver_release(&client->receiver, msg);
+	    return 0;
+	}
+	return complete_query(client, q, msg) ? 1 : 0;
+    }
+    f->resp = msg;
+    atomic_store(&f->refs, cnt + (sent ? 1 : 0));
+    if (sent) {
+	q->shared = true;
+	q->flight = f;
+	if (complete_query(client, q, msg)) {
+	    called++;
 	}
-	queue_init(&client->async_queue, 1024);
+    }
+    // The flight may be released once the last query is completed.
+    for (int i = 0, n = cnt; i < n; i++) {
+	Query	fq = pending_slot(client, f->followers[i]);
 
-	client->q = (Query)malloc(sizeof(struct _Query) * pending_max);
-	client->end = client->q + pending_max;
-	client->pending_max = pending_max;
-	memset(client->q, 0, sizeof(struct _Query) * pending_max);
-	client->head = client->q;
-	client->tail = client->q;
-	client->on_deck = client->q;
+	fq->shared = true;
+	fq->flight = f;
+	if (complete_query(client, fq, msg)) {
+	    called++;
+	}
+    }
+    return called;
+}
 
-	atomic_init(&client->next_id, 1);
-	atomic_flag_clear(&client->head_lock);
-	atomic_flag_clear(&client->tail_lock);
-	atomic_flag_clear(&client->take_lock);
-	atomic_init(&client->waiting, 0);
+// Hands each fetch in a gather a response of its own built from the
+// response to the gathered query. Returns the number of callbacks made
+// inline.
+static int
+land_gather(opoClient client, Gather g, opoMsg msg) {
+    int	called = 0;
 
-	int	fd[2];
+    for (int i = 0; i < g->cnt; i++) {
+	uint64_t	id = g->ids[i];
+	Query		q = pending_slot(client, id);
+	uint8_t		*resp;
 
-	if (0 == pipe(fd)) {
-	    fcntl(fd[0], F_SETFL, O_NONBLOCK);
-	    fcntl(fd[1], F_SETFL, O_NONBLOCK);
-	    client->rsock = fd[0];
-	    client->wsock = fd[1];
+	// The seq only matches while the slot belongs to the fetch.
+	if (atomic_load(&q->seq) != id || q->id != id || !claim_sent(q)) {
+	    continue;
 	}
-	client->active = true; // outside the thread create to avoid race condition on immediate close
-	if (0 != (stat = pthread_create(&client->recv_thread, NULL, recv_loop, client))) {
-	    client->active = false;
-	    opo_err_set(err, stat, "failed create receiving thread. %s", strerror(stat));
+	if (NULL == (resp = multiget_response(msg, g->refs[i]))) {
+	    resp = client->lost;
+	} else {
+	    opo_msg_set_id(resp, id);
 	}
-	if (0 < client->sock && NULL != client->status_callback) {
-	    status_callback(client, true, OPO_ERR_OK, "connected to %s:%d", host, port);
+	if (complete_query(client, q, resp)) {
+	    called++;
 	}
     }
-    return client;
+    receiver_release(&client->receiver, msg);
+    multiget_release(client->multiget, g);
+
+    return called;
 }
 
-void
-opo_client_close(opoClient client) {
-    client->active = false;
-    if (0 < client->sock) {
-	close(client->sock);
+// Hands each insert in a bundle a response with the ref from the same
+// position in the response to the bundle. Returns the number of callbacks
+// made inline.
+static int
+land_bundle(opoClient client, Bundle b, opoMsg msg) {
+    opoVal	end = NULL;
+    opoVal	ref = multiput_refs(msg, &end);
+    int		called = 0;
+
+    for (int i = 0; i < b->cnt; i++, ref = (NULL == ref) ? NULL : opo_val_next(ref)) {
+	uint64_t	id = b->ids[i];
+	Query		q = pending_slot(client, id);
+	uint8_t		*resp;
+
+	if (NULL != ref && end <= ref) {
+	    ref = NULL;
+	}
+	// The seq only matches while the slot belongs to the insert.
+	if (atomic_load(&q->seq) != id || q->id != id || !claim_sent(q)) {
+	    continue;
+	}
+	if (NULL == (resp = multiput_response(msg, ref))) {
+	    resp = client->lost;
+	} else {
+	    opo_msg_set_id(resp, id);
+	}
+	if (complete_query(client, q, resp)) {
+	    called++;
+	}
+    }
+    receiver_release(&client->receiver, msg);
+    multiput_release(client->multiput, b);
+
+    return called;
+}
+
+// Returns the number of callbacks made inline.
+static int
+process_msg(opoClient client, opoMsg msg) {
+    uint64_t	id = opo_msg_id(msg);
+    Query	q = pending_slot(client, id);
+    Gather	g;
+    Bundle	b;
+    Flight	f;
+
+    if (NULL != client->multiget && NULL != (g = multiget_land(client->multiget, id))) {
+	return land_gather(client, g, msg);
+    }
+    if (NULL != client->multiput && NULL != (b = multiput_land(client->multiput, id))) {
+	return land_bundle(client, b, msg);
+    }
+    if (NULL != client->flights && NULL != (f = flights_land(client->flights, id))) {
+	return land_flight(client, f, q, msg);
+    }
+    // Responses can arrive in any order. A slot is only reused after its
+    // query has been processed so if the slot is still waiting the id must
+    // match.
+    if (q->id != id || !claim_sent(q)) {
+	// Late responses to queries that timed out or were canceled are
+	// expected. The slot may already be on a later query so only the
+	// count of them is known.
+	if (id < atomic_load(&client->next_id) && take_abandoned(client)) {
+	    receiver_release(&client->receiver, msg);
+	    return 0;
+	}
+	if (q->id == id) {
+	    status_callback(client, true, OPO_ERR_TOO_MANY, "Duplicate response to query %llu.", (unsigned long long)id);
+	} else {
+	    status_callback(client, true, OPO_ERR_NOT_FOUND, "Pending query %llu not found.", (unsigned long long)id);
+	}
+	receiver_release(&client->receiver, msg);
+	return 0;
+    }
+    observe_rtt(client, q->when);
+    if (0 != q->cache_hash) {
+	cache_fill(client->cache, q->cache_hash, id, msg, dtime());
+    }
+
+    return complete_query(client, q, msg) ? 1 : 0;
+}
+
+// Adds queries sent since the last check to the wheel. Slots are claimed in
+// id order but filled in by the submitting threads so stop at the first one
+// that is not sent yet and pick it up next time.
+static void
+track_deadlines(opoClient client) {
+    unsigned long long	end = atomic_load(&client->next_id);
+
+    for (; client->wheel_id < end; client->wheel_id++) {
+	Query			q = pending_slot(client, client->wheel_id);
+	unsigned long long	seq = atomic_load(&q->seq);
+	char			state = atomic_load(&q->state);
+
+	if (seq != client->wheel_id) { // done and released already
+	    continue;
+	}
+	if (Q_CLEAR == state) {
+	    break;
+	}
+	if (Q_SENT == state && 0.0 < q->timeout) {
+	    Deadline	d = client->deadlines + (q - client->q);
+
+	    d->id = client->wheel_id;
+	    wheel_add(&client->wheel, &d->timer, q->when + q->timeout);
+	}
+    }
+}
+
+// A query given up on before its response arrives. Only queries that were
+// sent get a response later. A flight that lost its sent query can no
+// longer be joined but those that joined it still get the late response.
+static void
+abandon(opoClient client, Query q) {
+    if (q->follower) {
+	// Gathered fetches and bundled inserts have no lead.
+	if (0 != q->lead) {
+	    flights_leave(client->flights, q->lead, q->id);
+	}
+	return;
+    }
+    if (0 != q->cache_hash) {
+	// Otherwise the entry waits forever and can not be evicted.
+	cache_forget(client->cache, q->cache_hash, q->id);
+    }
+    atomic_fetch_add(&client->abandoned, 1);
+    if (NULL != client->flights) {
+	flights_seal(client->flights, q->id);
+    }
+}
+
+// A gather or bundle whose first query timed out is no longer waited on. The
+// other queries in it time out on their own and a late response is released
+// like any other for an abandoned query.
+static void
+drop_batch(opoClient client, uint64_t id) {
+    Gather	g;
+    Bundle	b;
+
+    if (NULL != client->multiget && NULL != (g = multiget_land(client->multiget, id))) {
+	atomic_fetch_add(&client->abandoned, 1);
+	multiget_release(client->multiget, g);
+    } else if (NULL != client->multiput && NULL != (b = multiput_land(client->multiput, id))) {
+	atomic_fetch_add(&client->abandoned, 1);
+	multiput_release(client->multiput, b);
+    }
+}
+
+typedef struct _Expiry {
+    opoClient	client;
+    int		called;
+} *Expiry;
+
+static void
+expire_query(Timer t, void *ctx) {
+    Expiry	ex = (Expiry)ctx;
+    Deadline	d = (Deadline)t;
+    Query	q = ex->client->q + (d - ex->client->deadlines);
+
+    // The slot may have moved on to another query if this one was canceled.
+    if (atomic_load(&q->seq) == d->id && claim_sent(q)) {
+	abandon(ex->client, q);
+	if (q->follower) {
+	    drop_batch(ex->client, q->id);
+	}
+	if (complete_query(ex->client, q, ex->client->lost)) {
+	    ex->called++;
+	}
+    }
+}
+
+// Times out queries that are past their deadline. Returns the number of
+// callbacks made inline.
+static int
+check_deadlines(opoClient client) {
+    struct _Expiry	ex = { .client = client, .called = 0 };
+
+    track_deadlines(client);
+    if (0 < client->wheel.cnt) {
+	wheel_advance(&client->wheel, dtime(), expire_query, &ex);
+    }
+    return ex.called;
+}
+
+// Returns the earliest time a deadline, the open gather, or the open bundle
+// is due, zero if there are none.
+static double
+next_due(opoClient client) {
+    double	due = wheel_next(&client->wheel);
+    double	d;
+
+    if (NULL != client->multiget && 0.0 < (d = multiget_next(client->multiget)) && (0.0 >= due || d < due)) {
+	due = d;
+    }
+    if (NULL != client->multiput && 0.0 < (d = multiput_next(client->multiput)) && (0.0 >= due || d < due)) {
+	due = d;
+    }
+    return due;
+}
+
+// A reactor only calls the handler with no events every REACTOR_TICK so it
+// is asked to call sooner when a deadline or window ends before then.
+static void
+wake_for(opoClient client, double when) {
+    if (NULL != client->reactor && 0.0 < when) {
+	reactor_wake_at(&client->watch, when);
+    }
+}
+
+// Seconds until deadlines should be checked again.
+static double
+deadline_wait(opoClient client) {
+    double	next = wheel_next(&client->wheel);
+    double	wait = IDLE_POLL;
+
+    if (0.0 < next && (next -= dtime()) < wait) {
+	wait = (0.0 < next) ? next : 0.0;
+    }
+    // Gathers and bundles can be opened while waiting so look at least once
+    // a window.
+    if (NULL != client->multiget && client->multiget->window < wait) {
+	wait = client->multiget->window;
+    }
+    if (NULL != client->multiput && client->multiput->window < wait) {
+	wait = client->multiput->window;
+    }
+    return wait;
+}
+
+// Flushes the send buffer, waiting for the write to complete if wait is
+// true. Otherwise whatever the socket does not take is left for the reactor
+// or receiving thread which the sender wakes with send_left().
+static void
+flush_sent(opoErr err, opoClient client, bool wait) {
+    if (wait) {
+	sender_flush(err, &client->sender, client->sock, client->timeout);
+    } else {
+	sender_try_flush(err, &client->sender, client->sock);
+    }
+}
+
+// Appends a query to the send buffer, waiting for room if needed, and
+// flushes it, waiting for the write to complete if wait is true.
+static void
+send_query(opoErr err, opoClient client, opoVal query, size_t size, bool wait) {
+    if (OPO_ERR_OK == sender_append(err, &client->sender, client->sock, query, size, client->timeout, true)) {
+	flush_sent(err, client, wait);
+    }
+}
+
+// Appends a query only if there is room in the send buffer right now.
+static bool
+try_send_query(opoErr err, opoClient client, opoVal query, size_t size) {
+    if (OPO_ERR_OK != sender_append(err, &client->sender, client->sock, query, size, client->timeout, false)) {
+	return false;
+    }
+    flush_sent(err, client, false);
+
+    return true;
+}
+
+// Gives back the slot of a query that was never sent. There is no response
+// to wait for and no callback is made.
+static void
+unsend(opoClient client, Query q) {
+    // Set first in case the deadline gets to it.
+    q->follower = true;
+    if (claim_sent(q)) {
+	atomic_fetch_sub(&client->pending, 1);
+	release_slot(client, q);
+    }
+}
+
+// Sends the query for a gather that has been moved to the sent table. If
+// the query can not be built the fetches are left to time out.
+static void
+send_gather(opoErr err, opoClient client, Gather g, bool wait) {
+    uint8_t	*query = multiget_query(err, client->multiget, g);
+
+    if (NULL == query) {
+	multiget_release(client->multiget, multiget_land(client->multiget, g->id));
+	return;
+    }
+    send_query(err, client, query, opo_msg_bsize(query), wait);
+    slab_free(query);
+}
+
+// Sends the query for a bundle that has been moved to the sent table. If
+// the query can not be built the inserts are left to time out.
+static void
+send_bundle(opoErr err, opoClient client, Bundle b, bool wait) {
+    uint8_t	*query = multiput_query(err, b);
+
+    if (NULL == query) {
+	multiput_release(client->multiput, multiput_land(client->multiput, b->id));
+	return;
+    }
+    send_query(err, client, query, opo_msg_bsize(query), wait);
+    slab_free(query);
+}
+
+// Sends the open gather and bundle if their windows have passed. Always
+// returns zero, the number of callbacks made.
+static int
+send_due(opoClient client) {
+    struct _opoErr	err = OPO_ERR_INIT;
+    double		now;
+    Gather		g;
+    Bundle		b;
+
+    if (NULL == client->multiget && NULL == client->multiput) {
+	return 0;
+    }
+    now = dtime();
+    if (NULL != client->multiget && NULL != (g = multiget_due(client->multiget, now))) {
+	send_gather(&err, client, g, false);
+    }
+    if (NULL != client->multiput && NULL != (b = multiput_due(client->multiput, now, false))) {
+	send_bundle(&err, client, b, false);
+    }
+    if (OPO_ERR_OK != err.code && NULL != client->status_callback) {
+	client->status_callback(client, true, err.code, err.msg);
+    }
+    return 0;
+}
+
+// Stops watching the socket and forgets it, closing it if requested.
+static void
+drop_sock(opoClient client, bool close_it) {
+    if (NULL != client->reactor) {
+	reactor_remove(&client->watch);
+    }
+    if (close_it) {
+	close(client->sock);
+    }
+    client->sock = 0;
+}
+
+// Handles poll events on the socket. Called from the client's own receiving
+// thread, from a reactor thread, or from opo_client_pump(). Returns the number
+// of callbacks made inline.
+static int
+handle_events(opoClient client, short revents) {
+    opoMsg	msg;
+    ssize_t	cnt;
+    int		called = 0;
+
+    if (0 != (revents & POLLOUT)) {
+	struct _opoErr	err = OPO_ERR_INIT;
+
+	if (OPO_ERR_OK != sender_try_flush(&err, &client->sender, client->sock) && NULL != client->status_callback) {
+	    client->status_callback(client, true, err.code, err.msg);
+	}
+	if (NULL != client->reactor) {
+	    reactor_want_write(&client->watch, false);
+	    // Something may have been appended after the flush.
+	    if (sender_pending(&client->sender)) {
+		reactor_want_write(&client->watch, true);
+	    }
+	}
+    }
+    if (0 != (revents & POLLIN)) {
+	if (0 > (cnt = receiver_recv(&client->receiver, client->sock))) {
+	    if (EAGAIN != errno && EINTR != errno && client->active && NULL != client->status_callback) {
+		client->status_callback(client, false, errno, "read failed");
+	    }
+	} else if (0 == cnt) {
+	    if (client->active && 0 < client->sock && NULL != client->status_callback) {
+		client->status_callback(client, false, OPO_ERR_READ, "connection closed");
+	    }
+	    drop_sock(client, true);
+	}
+	// Messages are delivered as pointers into the receive ring and
+	// the space is reclaimed when they are released.
+	struct _opoErr	err = OPO_ERR_INIT;
+
+	while (NULL != (msg = receiver_next(&err, &client->receiver))) {
+	    called += process_msg(client, msg);
+	}
+	if (OPO_ERR_OK != err.code && NULL != client->status_callback) {
+	    client->status_callback(client, true, err.code, err.msg);
+	}
+    }
+    if (0 != (revents & (POLLERR | POLLHUP | POLLNVAL)) && 0 < client->sock) {
+	if (!receiver_partial(&client->receiver)) {
+	    if (client->active && NULL != client->status_callback) {
+		client->status_callback(client, false, OPO_ERR_OK, "connection closed");
+	    }
+	    drop_sock(client, false);
+	} else if (0 != (revents & (POLLHUP | POLLNVAL))) {
+	    if (NULL != client->status_callback) {
+		client->status_callback(client, false, OPO_ERR_READ, "closed with outstanding responses");
+	    }
+	    drop_sock(client, false);
+	} else {
+	    if (NULL != client->status_callback) {
+		char	err_msg[256];
+
+		sprintf(err_msg, "socket error. %s.", strerror(errno));
+		client->status_callback(client, false, errno, err_msg);
+	    }
+	    drop_sock(client, true);
+	}
+    }
+    return called + check_deadlines(client) + send_due(client);
+}
+
+static void
+reactor_handler(void *ctx, short events) {
+    opoClient	client = (opoClient)ctx;
+
+    handle_events(client, events);
+    // Whatever is still ahead is asked for again as the reactor forgets
+    // requests once it calls the handlers.
+    wake_for(client, next_due(client));
+}
+
+// Called by the sender when bytes are left in the send buffer that no
+// thread is writing. The reactor or the receiving thread waits for the
+// socket to be writable and flushes them. The receiving thread flushes on
+// its own when it left them.
+static void
+send_left(void *ctx) {
+    opoClient	client = (opoClient)ctx;
+
+    if (NULL != client->reactor) {
+	reactor_want_write(&client->watch, true);
+    } else if (!pthread_equal(pthread_self(), client->recv_thread) &&
+	       !atomic_load(&client->kicked) && !atomic_exchange(&client->kicked, true)) {
+	uint64_t	one = 1;
+
+	if (write(client->kick_wsock, &one, sizeof(one))) {}
+    }
+}
+
+void*
+recv_loop(void *ctx) {
+    opoClient		client = (opoClient)ctx;
+    struct pollfd	pa[2];
+    int			i;
+
+    while (client->active) {
+	pa->fd = client->sock;
+	pa->events = POLLIN;
+	if (sender_pending(&client->sender)) {
+	    // A try query left part of a batch behind when the socket was full.
+	    pa->events |= POLLOUT;
+	}
+	pa->revents = 0;
+	pa[1].fd = client->kick_rsock;
+	pa[1].events = POLLIN;
+	pa[1].revents = 0;
+	if (0 > (i = poll(pa, 2, (int)ceil(deadline_wait(client) * 1000.0)))) {
+	    if (EAGAIN == errno) {
+		continue;
+	    }
+	    // Either a signal or something bad like out of memory. Might as well exit.
+	    if (NULL != client->status_callback) {
+		client->status_callback(client, false, errno, "connection polling error");
+	    }
+	    break;
+	}
+	if (0 != (pa[1].revents & POLLIN)) {
+	    uint64_t	buf[8];
+
+	    // Cleared before the drain so a kick after it is not lost. The
+	    // send buffer is looked at again on the next pass.
+	    atomic_store(&client->kicked, false);
+	    while (0 < read(client->kick_rsock, buf, sizeof(buf))) {
+	    }
+	}
+	// Called even when there is nothing to read or write to check
+	// deadlines.
+	handle_events(client, pa->revents);
+    }
+    return NULL;
+}
+
+// Builds a response for a query that completes without one from the server.
+static void
+build_status(uint8_t *buf, size_t size, opoErrCode code, const char *msg) {
+    struct _opoErr	err = OPO_ERR_INIT;
+    struct _opoBuilder	builder;
+
+    opo_builder_init(&err, &builder, buf, size);
+    opo_builder_push_object(&err, &builder, NULL, -1);
+    opo_builder_push_int(&err, &builder, code, "code", 4);
+    opo_builder_push_string(&err, &builder, msg, -1, "error", 5);
+    opo_builder_finish(&builder);
+}
+
+// Connects a non-blocking socket, retrying for a while in case the server is
+// just starting. The socket is closed on failure.
+static bool
+connect_sock(opoErr err, int sock, const struct sockaddr *addr, socklen_t len, const char *where) {
+    double	giveup = dtime() + 2.0;
+
+    while (0 > connect(sock, addr, len)) {
+	if (EISCONN == errno) {
+	    break;
+	}
+	if (giveup < dtime()) {
+	    opo_err_no(err, "error connecting socket to %s", where);
+	    close(sock);
+	    return false;
+	}
+	usleep(1000);
+    }
+    return true;
+}
+
+// Opens a non-blocking descriptor pair, the same descriptor on Linux, where
+// a write makes the read side readable.
+static void
+open_signal(int *rsock, int *wsock) {
+    *rsock = -1;
+    *wsock = -1;
+#ifdef __linux__
+    *rsock = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    *wsock = *rsock;
+#else
+    int	fd[2];
+
+    if (0 == pipe(fd)) {
+	fcntl(fd[0], F_SETFL, O_NONBLOCK);
+	fcntl(fd[1], F_SETFL, O_NONBLOCK);
+	*rsock = fd[0];
+	*wsock = fd[1];
+    }
+#endif
+}
+
+static void
+close_signal(int rsock, int wsock) {
+    if (0 < wsock && wsock != rsock) {
+	close(wsock);
+    }
+    if (0 < rsock) {
+	close(rsock);
+    }
+}
+
+// Sets up a client on a connected socket. The framing is the same whatever
+// the transport.
+static opoClient
+client_open(opoErr err, int sock, const char *where, opoClientOptions options) {
+    opoClient	client = (opoClient)aligned_alloc(CACHE_LINE, sizeof(struct _opoClient));
+
+    if (NULL == client) {
+	opo_err_set(err, OPO_ERR_MEMORY, "failed to allocate memory for a opoClient.");
+    } else {
+	int	stat;
+	int	pending_max = 4096;
+	int	spin;
+	size_t	send_size = SEND_BUF_SIZE;
+	size_t	recv_size = RECV_BUF_SIZE;
+	
+	client->sock = sock;
+	atomic_init(&client->pending, 0);
+	atomic_init(&client->ready, 0);
+	atomic_init(&client->abandoned, 0);
+	atomic_init(&client->rtt, 0.0);
+	client->rtt_at = 0.0;
+	
+	if (NULL == options) {
+	    client->timeout = 2.0;
+	    client->status_callback = NULL;
+	    client->query_callback = NULL;
+	    client->query_ctx = NULL;
+	    client->unordered = false;
+	    client->reactor = NULL;
+	    client->embedded = false;
+	    client->inline_callbacks = false;
+	    client->cache = NULL;
+	    client->flights = NULL;
+	    client->multiget = NULL;
+	    client->multiput = NULL;
+	    spin = 0;
+	} else {
+	    if (0 < options->send_buffer_size) {
+		send_size = options->send_buffer_size;
+	    }
+	    if (0 < options->recv_buffer_size) {
+		recv_size = options->recv_buffer_size;
+	    }
+	    client->timeout = options->timeout;
+	    client->status_callback = options->status_callback;
+	    pending_max = options->pending_max;
+	    if (pending_max < 1) {
+		pending_max = 1;
+	    }
+	    client->query_callback = options->query_callback;
+	    client->query_ctx = options->query_ctx;
+	    // The query_callback gets responses as they arrive.
+	    client->unordered = options->unordered || NULL != options->query_callback;
+	    client->reactor = options->reactor;
+	    client->embedded = options->embedded;
+	    client->inline_callbacks = options->inline_callbacks;
+	    client->cache = NULL;
+	    // A query_callback takes every response as it is so nothing is
+	    // cached, coalesced, gathered, or bundled.
+	    if (0 < options->cache_size && NULL == client->query_callback) {
+		client->cache = cache_create(options->cache_size, (0.0 < options->cache_ttl) ? options->cache_ttl : CACHE_TTL);
+	    }
+	    client->flights = NULL;
+	    if (options->coalesce && NULL == client->query_callback) {
+		client->flights = flights_create(pending_max);
+	    }
+	    client->multiget = NULL;
+	    if (0.0 < options->multiget_window && NULL == client->query_callback) {
+		client->multiget = multiget_create(options->multiget_window,
+						   (0 < options->multiget_max) ? options->multiget_max : MULTIGET_MAX,
+						   (NULL == options->multiget_select) ? "$" : options->multiget_select,
+						   pending_max);
+	    }
+	    client->multiput = NULL;
+	    if (0.0 < options->multiput_window && NULL == client->query_callback) {
+		client->multiput = multiput_create(options->multiput_window,
+						   (0 < options->multiput_max) ? options->multiput_max : MULTIPUT_MAX,
+						   pending_max);
+	    }
+	    spin = options->spin;
+	}
+	atomic_init(&client->cached_id, 0);
+	park_init(&client->ready_park, spin);
+	client->notify = NULL;
+	park_init(&client->room_park, spin);
+	atomic_init(&client->room_wanted, false);
+	atomic_init(&client->room_signaled, false);
+	open_signal(&client->room_rsock, &client->room_wsock);
+	atomic_init(&client->kicked, false);
+	open_signal(&client->kick_rsock, &client->kick_wsock);
+	sender_init(&client->sender, send_size);
+	receiver_init(&client->receiver, recv_size);
+
+	client->q = (Query)aligned_alloc(CACHE_LINE, sizeof(struct _Query) * pending_max);
+	client->deadlines = (Deadline)calloc(pending_max, sizeof(struct _Deadline));
+	wheel_init(&client->wheel, WHEEL_TICK, dtime());
+	client->wheel_id = 1;
+	build_status(client->lost, sizeof(client->lost), OPO_ERR_LOST, "query timed out");
+	build_status(client->canceled, sizeof(client->canceled), OPO_ERR_CANCELED, "query canceled");
+	client->end = client->q + pending_max;
+	client->pending_max = pending_max;
+	memset(client->q, 0, sizeof(struct _Query) * pending_max);
+	// Ids start at 1 so slot 0 is first used by the pending_max id.
+	for (int i = 0; i < pending_max; i++) {
+	    atomic_init(&client->q[i].seq, (0 == i) ? pending_max : i);
+	}
+	// Responses are processed in id order starting with the first id.
+	atomic_init(&client->head_id, 1);
+	client->ready_q = (Ready)malloc(sizeof(struct _Ready) * pending_max);
+	for (int i = 0; i < pending_max; i++) {
+	    atomic_init(&client->ready_q[i].seq, i);
+	}
+	atomic_init(&client->ready_head, 0);
+	atomic_init(&client->ready_tail, 0);
+
+	atomic_init(&client->next_id, 1);
+	if (!client->embedded) {
+	    client->sender.wake = send_left;
+	    client->sender.wake_ctx = client;
+	}
+	client->active = true; // outside the thread create to avoid race condition on immediate close
+	if (client->embedded) {
+	    // The caller drives the socket with opo_client_pump().
+	} else if (NULL != client->reactor) {
+	    if (OPO_ERR_OK != reactor_add(err, client->reactor, &client->watch, sock, reactor_handler, client)) {
+		client->active = false;
+	    }
+	} else if (0 != (stat = pthread_create(&client->recv_thread, NULL, recv_loop, client))) {
+	    client->active = false;
+	    opo_err_set(err, stat, "failed create receiving thread. %s", strerror(stat));
+	}
+	if (0 < client->sock && NULL != client->status_callback) {
+	    status_callback(client, true, OPO_ERR_OK, "connected to %s", where);
+	}
+    }
+    return client;
+}
+
+opoClient
+opo_client_connect(opoErr err, const char *host, int port, opoClientOptions options) {
+    if (0 == strncmp(host, UNIX_PREFIX, sizeof(UNIX_PREFIX) - 1)) {
+	return opo_client_connect_unix(err, host + sizeof(UNIX_PREFIX) - 1, options);
+    }
+    struct addrinfo	*res = get_addr_info(err, host, port);
+    char		where[300];
+    int			sock;
+    int			optval = 1;
+    bool		ok;
+
+    if (NULL == res) {
+	return NULL;
+    }
+    snprintf(where, sizeof(where), "%s:%d", host, port);
+    if (0 > (sock = socket(res->ai_family, res->ai_socktype, res->ai_protocol))) {
+	opo_err_no(err, "error creating socket to %s", where);
+	freeaddrinfo(res);
+	return NULL;
+    }
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &optval, sizeof(optval));
+    //setsockopt(sock, SOL_SOCKET, SO_KEEPALIVE, &optval, sizeof(optval));
+    fcntl(sock, F_SETFL, O_NONBLOCK);
+    ok = connect_sock(err, sock, res->ai_addr, res->ai_addrlen, where);
+    freeaddrinfo(res);
+    if (!ok) {
+	return NULL;
+    }
+    return client_open(err, sock, where, options);
+}
+
+opoClient
+opo_client_connect_unix(opoErr err, const char *path, opoClientOptions options) {
+    struct sockaddr_un	addr;
+    char		where[sizeof(addr.sun_path) + sizeof(UNIX_PREFIX)];
+    int			sock;
+
+    memset(&addr, 0, sizeof(addr));
+    if (sizeof(addr.sun_path) <= strlen(path)) {
+	opo_err_set(err, OPO_ERR_ARG, "unix socket path '%s' is too long", path);
+	return NULL;
+    }
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    snprintf(where, sizeof(where), "%s%s", UNIX_PREFIX, path);
+    if (0 > (sock = socket(AF_UNIX, SOCK_STREAM, 0))) {
+	opo_err_no(err, "error creating socket to %s", where);
+	return NULL;
+    }
+    fcntl(sock, F_SETFL, O_NONBLOCK);
+    if (!connect_sock(err, sock, (struct sockaddr*)&addr, sizeof(addr), where)) {
+	return NULL;
+    }
+    return client_open(err, sock, where, options);
+}
+
+void
+opo_client_close(opoClient client) {
+    client->active = false;
+    if (NULL != client->reactor) {
+	reactor_remove(&client->watch);
+    }
+    if (0 < client->sock) {
+	close(client->sock);
     }
     if (NULL != client->status_callback) {
 	client->status_callback(client, false, OPO_ERR_OK, "connection closed");
     }
-    pthread_join(client->recv_thread, NULL);
+    if (NULL == client->reactor && !client->embedded) {
+	pthread_join(client->recv_thread, NULL);
+    }
+    sender_cleanup(&client->sender);
+    receiver_cleanup(&client->receiver);
     free(client->q);
     client->q = NULL;
-    if (0 < client->wsock) {
-	close(client->wsock);
+    free(client->deadlines);
+    client->deadlines = NULL;
+    cache_destroy(client->cache);
+    client->cache = NULL;
+    flights_destroy(client->flights);
+    client->flights = NULL;
+    multiget_destroy(client->multiget);
+    client->multiget = NULL;
+    multiput_destroy(client->multiput);
+    client->multiput = NULL;
+    free(client->ready_q);
+    client->ready_q = NULL;
+    park_cleanup(&client->ready_park);
+    park_cleanup(&client->room_park);
+    close_signal(client->room_rsock, client->room_wsock);
+    close_signal(client->kick_rsock, client->kick_wsock);
+    free(client);
+}
+
+// Cached responses are given to the callback right away on the calling
+// thread. Their refs have the top bit set so they never match a query
+// waiting on a response.
+static opoRef
+serve_cached(opoClient client, uint64_t hash, opoVal query, opoQueryCallback cb, void *ctx) {
+    uint8_t	*resp = cache_get(client->cache, hash, query, dtime());
+    opoRef	ref;
+
+    if (NULL == resp) {
+	return 0;
     }
-    if (0 < client->rsock) {
-	close(client->rsock);
+    ref = CACHED_REF | (atomic_fetch_add(&client->cached_id, 1) + 1);
+    opo_msg_set_id(resp, ref);
+    if (NULL != cb) {
+	cb(ref, resp, ctx);
     }
-    free(client);
+    slab_free(resp);
+
+    return ref;
 }
 
-opoRef
-opo_client_query(opoErr err, opoClient client, opoVal query, opoQueryCallback cb, void *ctx) {
+// Returns true if the query is a write, after dropping what it could make
+// stale.
+static bool
+note_write(opoClient client, opoVal query) {
+    if (!cache_is_write(query)) {
+	return false;
+    }
+    if (NULL != client->cache) {
+	cache_invalidate(client->cache, query);
+    }
+    if (NULL != client->flights) {
+	flights_seal_all(client->flights);
+    }
+    return true;
+}
+
+// Adds a fetch to the open gather, first sending the gather if its window
+// has passed and after if it is full. Returns false if the fetch must be
+// sent on its own.
+static bool
+gather_fetch(opoErr err, opoClient client, uint64_t id, int64_t ref, double now, bool wait) {
+    Gather	g;
+
+    if (NULL != (g = multiget_due(client->multiget, now))) {
+	send_gather(err, client, g, wait);
+    }
+    if (!multiget_add(client->multiget, id, ref, now, &g)) {
+	return false;
+    }
+    if (NULL != g) {
+	send_gather(err, client, g, wait);
+    }
+    return true;
+}
+
+// Adds an insert to the open bundle, first sending the bundle if its window
+// has passed and after if it is full. Returns false if the insert must be
+// sent on its own.
+static bool
+bundle_insert(opoErr err, opoClient client, uint64_t id, opoVal record, double now, bool wait) {
+    Bundle	b;
+
+    if (NULL != (b = multiput_due(client->multiput, now, false))) {
+	send_bundle(err, client, b, wait);
+    }
+    if (!multiput_add(client->multiput, id, record, now, &b)) {
+	return false;
+    }
+    if (NULL != b) {
+	send_bundle(err, client, b, wait);
+    }
+    return true;
+}
+
+// Sends the open bundle, if any, so a query sent after it does not pass the
+// inserts in it.
+static void
+send_bundled(opoErr err, opoClient client, bool wait) {
+    Bundle	b;
+
+    if (NULL != (b = multiput_due(client->multiput, 0.0, true))) {
+	send_bundle(err, client, b, wait);
+    }
+}
+
+static opoRef
+submit(opoErr err, opoClient client, opoVal query, opoQueryCallback cb, void *ctx, double timeout, bool wait) {
     size_t	size = opo_msg_bsize(query);
     uint64_t	qid;
+    uint64_t	hash = 0;
+    int64_t	ref = 0;
+    opoVal	record = NULL;
+    bool	gathered;
 
+    if (!wait) {
+	room_drain(client);
+	if (!sender_room(&client->sender, size)) {
+	    return no_room(err, client);
+	}
+    }
     if (NULL != client->query_callback) {
-	qid = atomic_fetch_add(&client->next_id, 1);
-	if (client->pending_max < atomic_fetch_add(&client->pending, 1)) {
-	    // Max reached, wait for some to clear. Busy wait as this must be
-	    // a high frequency set of queries if the limit has been hit.
-	    while (client->pending_max < atomic_load(&client->pending)) {
-		usleep(10);
-	    }
+	// Every response goes to the one callback.
+	cb = client->query_callback;
+	ctx = client->query_ctx;
+    }
+    if ((NULL != client->cache || NULL != client->flights) && !note_write(client, query)) {
+	hash = cache_hash(query);
+	if (NULL != client->cache && 0 != (qid = serve_cached(client, hash, query, cb, ctx))) {
+	    return qid;
+	}
+    }
+    // A try query goes out on its own right away or not at all so it is
+    // not gathered or bundled. The open bundle, if any, still has to go
+    // first.
+    gathered = wait && NULL != client->multiget && multiget_ref(client->multiget, query, &ref);
+    if (NULL != client->multiput && (!wait || NULL == (record = multiput_record(query)))) {
+	send_bundled(err, client, wait);
+    }
+    // When embedded only the caller can free up room.
+    Query	q = reserve_slot(err, client, wait && !client->embedded);
+
+    if (NULL == q) {
+	if (!wait || client->embedded) {
+	    return no_room(err, client);
 	}
-	//opo_msg_set_id((uint8_t*)query, qid);
-	if (size != write(client->sock, query, size)) {
-	    opo_err_no(err, "write failed");
+	return 0;
+    }
+    qid = q->id;
+    q->cb = cb;
+    q->ctx = ctx;
+    q->when = dtime();
+    q->timeout = (0.0 < timeout) ? (float)timeout : 0.0f;
+    // The send of a try query may fail after the entry or flight is
+    // started so it only uses those already there.
+    q->cache_hash = (NULL == client->cache || gathered || !wait) ? 0 : hash;
+    // Set before the slot can be claimed. Cleared if the query is sent
+    // on its own.
+    q->follower = gathered || NULL != record || (0 != hash && NULL != client->flights);
+    atomic_fetch_add(&client->pending, 1);
+    query_set_state(q, Q_SENT);
+    if (0.0 < q->timeout) {
+	wake_for(client, q->when + q->timeout);
+    }
+    opo_msg_set_id((uint8_t*)query, qid);
+    if (gathered) {
+	if (gather_fetch(err, client, qid, ref, q->when, wait)) {
+	    wake_for(client, multiget_next(client->multiget));
+	    return qid;
 	}
-    } else {
-	while (atomic_flag_test_and_set(&client->tail_lock)) {
-	    dsleep(RETRY_SECS);
-	}
-	if (Q_CLEAR != atomic_load(&client->tail->state)) {
-	    if (0.0 < client->timeout) {
-		double	give_up = dtime() + client->timeout;
-
-		while (Q_CLEAR != atomic_load(&client->tail->state)) {
-		    if (give_up < dtime()) {
-			atomic_flag_clear(&client->tail_lock);
-			opo_err_set(err, EAGAIN, "write failed, busy");
-			return 0;
-		    }
-		    dsleep(RETRY_SECS);
-		}
-	    } else {
-		atomic_flag_clear(&client->tail_lock);
-		opo_err_set(err, EAGAIN, "write failed, busy");
-		return 0;
-	    }
+	q->follower = false;
+    } else if (NULL != record) {
+	if (bundle_insert(err, client, qid, record, q->when, wait)) {
+	    wake_for(client, multiput_next(client->multiput));
+	    return qid;
 	}
-	Query	q = client->tail;
-	
-	qid = atomic_fetch_add(&client->next_id, 1);
-	q->id = qid;
-	q->cb = cb;
-	q->ctx = ctx;
-	q->when = dtime();
-	query_set_state(q, Q_SENT);
+	q->follower = false;
+    } else if (q->follower) {
+	if (flights_join(client->flights, hash, query, qid, wait, &q->lead)) {
+	    // The response to the identical query already sent is
+	    // handed to this one as well.
+	    return qid;
+	}
+	q->follower = false;
+    }
+    if (0 != q->cache_hash) {
+	// Before sending so the response always finds the entry.
+	cache_expect(client->cache, hash, query, qid);
+    }
+    // Responses are matched by id so queries from different threads can
+    // reach the wire in any order.
+    if (wait) {
+	send_query(err, client, query, size, wait);
+    } else if (!try_send_query(err, client, query, size)) {
+	// Another thread filled the send buffer after the check above.
+	unsend(client, pending_slot(client, qid));
+	opo_err_clear(err);
+	return no_room(err, client);
+    }
+    return qid;
+}
+
+opoRef
+opo_client_query(opoErr err, opoClient client, opoVal query, opoQueryCallback cb, void *ctx) {
+    return submit(err, client, query, cb, ctx, client->timeout, true);
+}
+
+// Sends up to pending_max queries, at most BATCH_MAX, with one reservation
+// of ids and one append. Returns the number sent.
+static int
+submit_batch(opoErr err, opoClient client, opoVal *queries, int n, opoQueryCallback cb, void **ctxs) {
+    struct iovec	iov[BATCH_MAX];
+    bool		wait = !client->embedded;
+    unsigned long long	id;
+    int			k;
 
-	client->tail++;
-	if (client->end <= client->tail) {
-	    client->tail = client->q;
+    if (NULL != client->cache || NULL != client->flights) {
+	// Batched reads are not cached or coalesced but writes still
+	// make entries stale.
+	for (k = 0; k < n; k++) {
+	    note_write(client, queries[k]);
 	}
-	opo_msg_set_id((uint8_t*)query, q->id);
-	if (size != write(client->sock, query, size)) {
-	    opo_err_no(err, "write failed");
+    }
+    if (NULL != client->multiput) {
+	send_bundled(err, client, wait);
+    }
+    // When embedded only the caller can free up room.
+    if (0 == (id = reserve_slots(err, client, n, wait))) {
+	if (!wait) {
+	    no_room(err, client);
 	}
-	atomic_flag_clear(&client->tail_lock);
+	return 0;
     }
-    return qid;
+    double	now = dtime();
+    float	timeout = (0.0 < client->timeout) ? (float)client->timeout : 0.0f;
+
+    for (k = 0; k < n; k++) {
+	Query	q = pending_slot(client, id + k);
+
+	if (NULL != client->query_callback) {
+	    // Every response goes to the one callback.
+	    q->cb = client->query_callback;
+	    q->ctx = client->query_ctx;
+	} else {
+	    q->cb = cb;
+	    q->ctx = (NULL == ctxs) ? NULL : ctxs[k];
+	}
+	q->when = now;
+	q->timeout = timeout;
+	q->cache_hash = 0;
+    }
+    atomic_fetch_add(&client->pending, n);
+    for (k = 0; k < n; k++) {
+	query_set_state(pending_slot(client, id + k), Q_SENT);
+    }
+    if (0.0 < timeout) {
+	wake_for(client, now + timeout);
+    }
+    for (k = 0; k < n; k++) {
+	opo_msg_set_id((uint8_t*)queries[k], id + k);
+	iov[k].iov_base = (void*)queries[k];
+	iov[k].iov_len = opo_msg_bsize(queries[k]);
+    }
+    // When embedded there is no waiting for room in the send buffer either.
+    if ((k = sender_appendv(err, &client->sender, client->sock, iov, n, client->timeout, wait)) < n && !wait &&
+	EAGAIN == err->code) {
+	for (int i = k; i < n; i++) {
+	    unsend(client, pending_slot(client, id + i));
+	}
+	opo_err_clear(err);
+	no_room(err, client);
+	n = k;
+    }
+    return n;
 }
 
 int
-opo_client_process(opoClient client, int max, double wait) {
-    int	cnt = 0;
+opo_client_query_batch(opoErr err, opoClient client, opoVal *queries, int n, opoQueryCallback cb, void **ctxs) {
+    int	max = ((int)client->pending_max < BATCH_MAX) ? (int)client->pending_max : BATCH_MAX;
+    int	sent = 0;
+    int	cnt;
 
-    if (NULL == client->query_callback) {
-	Query	q;
+    while (sent < n) {
+	cnt = (max < n - sent) ? max : n - sent;
+	if (0 == (cnt = submit_batch(err, client, queries + sent, cnt, cb, (NULL == ctxs) ? NULL : ctxs + sent))) {
+	    break;
+	}
+	sent += cnt;
+	if (OPO_ERR_OK != err->code) {
+	    break;
+	}
+    }
+    if (0 < sent) {
+	if (client->embedded) {
+	    sender_try_flush(err, &client->sender, client->sock);
+	} else {
+	    sender_flush(err, &client->sender, client->sock, client->timeout);
+	}
+    }
+    return sent;
+}
 
-	while (0 >= max || cnt < max) {
-	    if (NULL != (q = take_next_ready(client, wait))) {
-		if (NULL != q->cb) {
-		    q->cb(q->id, q->resp, q->ctx);
-		}
-		free((uint8_t*)q->resp);
-		q->id = 0;
-		q->resp = NULL;
-		query_set_state(q, Q_CLEAR); // must be last modification to query
-		cnt++;
-	    } else if (0.0 <= wait) {
-		break;
-	    }
+opoRef
+opo_client_query_timeout(opoErr err, opoClient client, opoVal query, opoQueryCallback cb, void *ctx, double timeout) {
+    return submit(err, client, query, cb, ctx, timeout, true);
+}
+
+static opoRef
+query_future(opoErr err, opoClient client, opoVal query, double timeout, opoFuture future) {
+    opoRef	ref;
+
+    if (NULL != client->query_callback) {
+	opo_err_set(err, OPO_ERR_ARG, "futures can not be used with a query_callback");
+	return 0;
+    }
+    if (!future_start(err, future, client)) {
+	return 0;
+    }
+    if (0 == (ref = submit(err, client, query, future_done, future, timeout, true))) {
+	future_abort(future);
+	return 0;
+    }
+    future->ref = ref;
+
+    return ref;
+}
+
+opoRef
+opo_client_query_future(opoErr err, opoClient client, opoVal query, opoFuture future) {
+    return query_future(err, client, query, client->timeout, future);
+}
+
+opoMsg
+opo_client_call(opoErr err, opoClient client, opoVal query, double timeout) {
+    struct _opoFuture	future;
+    opoMsg		resp;
+
+    if (0.0 >= timeout) {
+	timeout = client->timeout;
+    }
+    future_init(&future);
+    if (0 == query_future(err, client, query, timeout, &future)) {
+	return NULL;
+    }
+    // The deadline wheel times the query out so waiting longer is only a
+    // backstop for when deadlines are not being checked.
+    if (NULL == (resp = opo_future_wait(err, &future, (0.0 < timeout) ? timeout + IDLE_POLL : 0.0)) && ETIMEDOUT == err->code) {
+	opo_err_clear(err);
+	if (opo_client_cancel(client, future.ref)) {
+	    future.code = OPO_ERR_LOST;
 	}
-    } else {
-	opoMsg	msg;
-	
-	while (0 >= max || cnt < max) {
-	    if (NULL == (msg = queue_pop(&client->async_queue, wait))) {
-		break;
+	resp = opo_future_wait(err, &future, 0.0);
+    }
+    if (NULL != resp) {
+	resp = opo_future_take(&future);
+    }
+    return resp;
+}
+
+opoRef
+opo_client_try_query(opoErr err, opoClient client, opoVal query, opoQueryCallback cb, void *ctx) {
+    return submit(err, client, query, cb, ctx, client->timeout, false);
+}
+
+bool
+opo_client_cancel(opoClient client, opoRef ref) {
+    Query	q = pending_slot(client, ref);
+
+    // The seq only matches while the slot belongs to the query.
+    if (atomic_load(&q->seq) != ref || q->id != ref || !claim_sent(q)) {
+	return false;
+    }
+    abandon(client, q);
+    atomic_fetch_sub(&client->pending, 1);
+    if (NULL != q->cb) {
+	q->cb(ref, client->canceled, q->ctx);
+    }
+    release_slot(client, q);
+
+    return true;
+}
+
+int
+opo_client_writable_fd(opoClient client) {
+    return client->room_rsock;
+}
+
+int
+opo_client_process(opoClient client, int max, double wait) {
+    int		cnt = 0;
+    Query	q;
+
+    while (0 >= max || cnt < max) {
+	if (NULL != (q = take_next_ready(client, wait))) {
+	    if (NULL != q->cb) {
+		q->cb(q->id, q->resp, q->ctx);
 	    }
-	    client->query_callback(opo_msg_id(msg), msg, client->query_ctx);
-	    atomic_fetch_sub(&client->pending, 1);
-	    free((uint8_t*)msg);
+	    release_query_resp(client, q);
+	    release_slot(client, q);
 	    cnt++;
+	} else if (0.0 <= wait) {
+	    break;
 	}
     }
     return cnt;
 }
 
+void
+client_set_notify(opoClient client, Park park) {
+    client->notify = park;
+}
+
+opoClient
+client_connect_addr(opoErr err, const char *addr, opoClientOptions options) {
+    if (0 == strncmp(addr, UNIX_PREFIX, sizeof(UNIX_PREFIX) - 1)) {
+	return opo_client_connect_unix(err, addr + sizeof(UNIX_PREFIX) - 1, options);
+    }
+    const char	*colon = strrchr(addr, ':');
+    char	host[256];
+
+    if (NULL == colon || sizeof(host) <= (size_t)(colon - addr)) {
+	opo_err_set(err, OPO_ERR_ARG, "address '%s' is not of the form host:port", addr);
+	return NULL;
+    }
+    memcpy(host, addr, colon - addr);
+    host[colon - addr] = '\0';
+
+    return opo_client_connect(err, host, atoi(colon + 1), options);
+}
+
+// One pass over all the clients without waiting.
+static int
+process_all(opoClient *clients, int cnt, int max) {
+    static atomic_uint	next = 0;
+    int			start = (int)(atomic_fetch_add(&next, 1) % cnt);
+    int			done = 0;
+
+    for (int i = 0; i < cnt && (0 >= max || done < max); i++) {
+	done += opo_client_process(clients[(start + i) % cnt], (0 < max) ? max - done : 0, 0.0);
+    }
+    return done;
+}
+
+int
+client_group_process(opoClient *clients, int cnt, Park ready, int max, double wait) {
+    double	give_up = 0.0;
+    double	now;
+    int		done = 0;
+    int		spins = 0;
+    int		c;
+
+    while (0 < cnt && (0 >= max || done < max)) {
+	if (0 < (c = process_all(clients, cnt, (0 < max) ? max - done : 0))) {
+	    done += c;
+	    give_up = 0.0;
+	    spins = 0;
+	    continue;
+	}
+	if (0.0 == wait) {
+	    break;
+	}
+	if (park_spin(ready, &spins)) {
+	    continue;
+	}
+	now = dtime();
+	if (0.0 < wait) {
+	    if (0.0 == give_up) {
+		give_up = now + wait;
+	    }
+	    if (give_up <= now) {
+		break;
+	    }
+	} else {
+	    give_up = now + 1.0;
+	}
+	unsigned int	key = park_prepare(ready);
+
+	if (0 < (c = process_all(clients, cnt, (0 < max) ? max - done : 0))) {
+	    done += c;
+	} else {
+	    park_wait(ready, key, give_up - now);
+	}
+	park_done(ready);
+    }
+    return done;
+}
+
+int
+opo_client_fd(opoClient client) {
+    return client->sock;
+}
+
+bool
+client_connected(opoClient client) {
+    return client->active && 0 < client->sock;
+}
+
+bool
+client_gave_up(opoClient client, opoMsg msg) {
+    return msg == client->lost || msg == client->canceled;
+}
+
+bool
+client_pump_wait(opoClient client, double wait) {
+    if (!client->embedded) {
+	return false;
+    }
+    if (0.0 < wait && 0 < client->sock) {
+	struct pollfd	pa = { .fd = client->sock, .events = POLLIN, .revents = 0 };
+	double		limit = deadline_wait(client);
+
+	// Open gathers and bundles are only sent when pumped.
+	if ((NULL != client->multiget || NULL != client->multiput) && limit < wait) {
+	    wait = limit;
+	}
+
+	poll(&pa, 1, (int)(wait * 1000.0));
+    }
+    opo_client_pump(client, 0);
+
+    return true;
+}
+
+int
+opo_client_pump(opoClient client, int budget) {
+    short	events = POLLIN;
+
+    if (0 >= client->sock) {
+	return 0;
+    }
+    if (sender_pending(&client->sender)) {
+	events |= POLLOUT;
+    }
+    // The socket is non-blocking so this reads whatever is available.
+    int	cnt = handle_events(client, events);
+
+    if (0 < budget && budget <= cnt) {
+	return cnt;
+    }
+    return cnt + opo_client_process(client, (0 < budget) ? budget - cnt : 0, 0.0);
+}
+
 int
 opo_client_pending_count(opoClient client) {
-    return (int)((client->tail + client->pending_max - client->on_deck) % client->pending_max);
+    return (int)atomic_load(&client->pending);
 }
 
 int
 opo_client_ready_count(opoClient client) {
-    return (int)((client->on_deck + client->pending_max - client->head) % client->pending_max);
+    return (int)atomic_load(&client->ready);
+}
+
+void
+opo_client_stats(opoClient client, opoClientStats stats) {
+    stats->sent_bytes = (uint64_t)atomic_load(&client->sender.bytes);
+    stats->send_calls = (uint64_t)atomic_load(&client->sender.calls);
+    stats->rtt = atomic_load_explicit(&client->rtt, memory_order_relaxed);
+    stats->cache_hits = (NULL == client->cache) ? 0 : (uint64_t)atomic_load(&client->cache->hits);
+    stats->coalesced = (NULL == client->flights) ? 0 : (uint64_t)atomic_load(&client->flights->joined);
+    stats->multigets = (NULL == client->multiget) ? 0 : (uint64_t)atomic_load(&client->multiget->batches);
+    stats->multiputs = (NULL == client->multiput) ? 0 : (uint64_t)atomic_load(&client->multiput->batches);
+}
+
+double
+client_load(opoClient client) {
+    return atomic_load_explicit(&client->rtt, memory_order_relaxed) * (double)(atomic_load(&client->pending) + 1);
 }
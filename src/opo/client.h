@@ -10,9 +10,11 @@ extern "C" {
 #include <stdint.h>
 #include <stdio.h>
 
+#include "future.h"
 #include "val.h"
 
     typedef struct _opoClient	*opoClient;
+    typedef struct _opoReactor	*opoReactor;
     typedef uint64_t		opoRef;
     typedef void		(*opoQueryCallback)(opoRef ref, opoMsg response, void *ctx);
     typedef void		(*opoStatusCallback)(opoClient client, bool connected, opoErrCode code, const char *msg);
@@ -23,15 +25,54 @@ extern "C" {
 	opoStatusCallback	status_callback;
  	opoQueryCallback	query_callback;
  	void			*query_ctx;
+	size_t			send_buffer_size; // zero for the default
+	size_t			recv_buffer_size; // zero for the default
+	bool			unordered; // process responses as they arrive instead of in send order
+	int			spin; // checks before blocking for a response, zero for the default, negative to block at once
+	opoReactor		reactor; // receive on a shared reactor instead of a thread per client
+	bool			embedded; // no receiving thread, call opo_client_pump() instead
+	bool			inline_callbacks; // call back as soon as a response is read instead of from opo_client_process()
+	size_t			cache_size; // bytes of read responses to cache, zero for no cache
+	double			cache_ttl; // seconds a cached response is served, zero for the default
+	bool			coalesce; // identical reads share the response to the one already pending, callbacks get it with that query's id
+	double			multiget_window; // seconds to gather single record fetches into one query, zero for none
+	int			multiget_max; // most fetches gathered into one query, zero for the default
+	const char		*multiget_select; // select of the fetches gathered, NULL for "$"
+	double			multiput_window; // seconds to bundle inserts into one query, zero for none
+	size_t			multiput_max; // most bytes of records bundled into one query, zero for the default
     } *opoClientOptions;
 
+    typedef struct _opoClientStats {
+	uint64_t		sent_bytes;
+	uint64_t		send_calls; // sent_bytes / send_calls is the batching factor
+	double			rtt; // peak EWMA of the response time in seconds
+	uint64_t		cache_hits; // queries answered from the cache
+	uint64_t		coalesced; // queries that joined one already pending
+	uint64_t		multigets; // queries sent for gathered fetches
+	uint64_t		multiputs; // queries sent for bundled inserts
+    } *opoClientStats;
+
+    extern opoReactor	opo_reactor_create(opoErr err, int thread_cnt);
+    extern void		opo_reactor_destroy(opoReactor reactor);
+
     extern opoClient	opo_client_connect(opoErr err, const char *host, int port, opoClientOptions options);
+    extern opoClient	opo_client_connect_unix(opoErr err, const char *path, opoClientOptions options);
     extern void		opo_client_close(opoClient client);
     extern opoRef	opo_client_query(opoErr err, opoClient client, opoVal query, opoQueryCallback cb, void *ctx);
+    extern opoRef	opo_client_query_timeout(opoErr err, opoClient client, opoVal query, opoQueryCallback cb, void *ctx, double timeout);
+    extern int		opo_client_query_batch(opoErr err, opoClient client, opoVal *queries, int n, opoQueryCallback cb, void **ctxs);
+    extern opoRef	opo_client_try_query(opoErr err, opoClient client, opoVal query, opoQueryCallback cb, void *ctx);
+    extern bool		opo_client_cancel(opoClient client, opoRef ref);
+    extern opoRef	opo_client_query_future(opoErr err, opoClient client, opoVal query, opoFuture future);
+    extern opoMsg	opo_client_call(opoErr err, opoClient client, opoVal query, double timeout);
+    extern int		opo_client_writable_fd(opoClient client);
     extern int		opo_client_process(opoClient client, int max, double wait);
+    extern int		opo_client_fd(opoClient client);
+    extern int		opo_client_pump(opoClient client, int budget);
 
     extern int		opo_client_pending_count(opoClient client);
     extern int		opo_client_ready_count(opoClient client);
+    extern void		opo_client_stats(opoClient client, opoClientStats stats);
 
 #ifdef __cplusplus
 }
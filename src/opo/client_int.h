@@ -0,0 +1,40 @@
+// Copyright 2017 by Peter Ohler, All Rights Reserved
+
+#ifndef __OPO_CLIENT_INT_H__
+#define __OPO_CLIENT_INT_H__
+
+#include "client.h"
+#include "park.h"
+
+// Client functions used by the layers built on top of clients such as the
+// pool. Not part of the public API.
+
+// Sets a park to be woken whenever a response is ready for processing in
+// addition to the client's own. Must be set before any queries are made.
+extern void	client_set_notify(opoClient client, Park park);
+
+// Processes responses for a group of clients that all notify the ready
+// park. The max and wait are the same as for opo_client_process().
+extern int	client_group_process(opoClient *clients, int cnt, Park ready, int max, double wait);
+
+// Connects to an address of the form host:port.
+extern opoClient	client_connect_addr(opoErr err, const char *addr, opoClientOptions options);
+
+// Returns the expected wait for a new query, the response time average
+// scaled by the number of queries already in flight. Zero until a response
+// has been received.
+extern double	client_load(opoClient client);
+
+// Returns true if the client is open and has a socket.
+extern bool	client_connected(opoClient client);
+
+// Returns true if the response was made by the client for a query that
+// timed out or was canceled instead of coming from the server.
+extern bool	client_gave_up(opoClient client, opoMsg msg);
+
+// Pumps an embedded client, first waiting up to wait seconds for something
+// to read. Returns false without doing anything if the client is not
+// embedded.
+extern bool	client_pump_wait(opoClient client, double wait);
+
+#endif /* __OPO_CLIENT_INT_H__ */
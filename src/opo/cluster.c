@@ -0,0 +1,471 @@
+// Copyright 2017 by Peter Ohler, All Rights Reserved
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "builder.h"
+#include "client_int.h"
+#include "cluster.h"
+#include "park.h"
+#include "slab.h"
+
+#define VNODES		160 // points on the ring per node
+#define MAX_PATHS	16
+#define SCATTER_REF	0x4000000000000000ULL // set in scatter refs so they never match a client ref
+
+// A node stays in the nodes list until the cluster is closed even after it
+// is removed so responses to queries already sent are still processed. That
+// also keeps a client picked under the lock valid after the lock is
+// released so queries are sent without holding the lock.
+typedef struct _Node {
+    char		*name; // host:port
+    opoClient		client;
+    bool		member; // on the ring
+} *Node;
+
+typedef struct _Point {
+    uint64_t	hash;
+    int		node;
+} *Point;
+
+struct _opoCluster {
+    pthread_rwlock_t	lock;
+    Node		nodes;
+    int			ncnt;
+    int			ncap;
+    Point		ring;
+    int			rcnt;
+    const char		*paths[MAX_PATHS];
+    int			pcnt;
+    struct _opoClientOptions	options;
+    bool		has_options;
+    atomic_ullong	next_ref; // for scatter queries
+    struct _Park	ready;
+};
+
+// Collects the responses from each node for a scatter query.
+typedef struct _Gather {
+    atomic_int		remaining;
+    int			cnt;
+    opoRef		ref;
+    opoQueryCallback	cb;
+    void		*ctx;
+    struct _Part {
+	struct _Gather	*gather;
+	opoClient	client;
+	uint8_t		*resp;
+    } parts[];
+} *Gather;
+
+static uint64_t
+mix(uint64_t h) {
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+
+    return h;
+}
+
+// FNV-1a followed by a mix as FNV alone clusters for short similar keys.
+static uint64_t
+hash_bytes(const uint8_t *b, size_t len) {
+    uint64_t	h = 0xcbf29ce484222325ULL;
+
+    for (const uint8_t *end = b + len; b < end; b++) {
+	h ^= *b;
+	h *= 0x100000001b3ULL;
+    }
+    return mix(h);
+}
+
+static int
+point_cmp(const void *a, const void *b) {
+    uint64_t	ha = ((Point)a)->hash;
+    uint64_t	hb = ((Point)b)->hash;
+
+    return (ha < hb) ? -1 : ((ha > hb) ? 1 : 0);
+}
+
+// Must be called with the write lock held.
+static opoErrCode
+build_ring(opoErr err, opoCluster cluster) {
+    int		mcnt = 0;
+    Point	ring;
+    Point	p;
+    char	buf[300];
+
+    for (int i = 0; i < cluster->ncnt; i++) {
+	if (cluster->nodes[i].member) {
+	    mcnt++;
+	}
+    }
+    if (NULL == (ring = (Point)malloc(sizeof(struct _Point) * VNODES * (mcnt + 1)))) {
+	return opo_err_set(err, OPO_ERR_MEMORY, "failed to allocate memory for a cluster ring.");
+    }
+    p = ring;
+    for (int i = 0; i < cluster->ncnt; i++) {
+	if (!cluster->nodes[i].member) {
+	    continue;
+	}
+	for (int v = 0; v < VNODES; v++, p++) {
+	    int	len = snprintf(buf, sizeof(buf), "%s-%d", cluster->nodes[i].name, v);
+
+	    p->hash = hash_bytes((const uint8_t*)buf, len);
+	    p->node = i;
+	}
+    }
+    qsort(ring, p - ring, sizeof(struct _Point), point_cmp);
+    free(cluster->ring);
+    cluster->ring = ring;
+    cluster->rcnt = (int)(p - ring);
+
+    return OPO_ERR_OK;
+}
+
+static int
+find_node(opoCluster cluster, const char *name) {
+    for (int i = 0; i < cluster->ncnt; i++) {
+	if (0 == strcmp(name, cluster->nodes[i].name)) {
+	    return i;
+	}
+    }
+    return -1;
+}
+
+// Must be called with the write lock held.
+static opoErrCode
+connect_node(opoErr err, opoCluster cluster, const char *name) {
+    opoClient	client;
+    Node	node;
+
+    if (cluster->ncap <= cluster->ncnt) {
+	int	cap = cluster->ncap * 2 + 4;
+
+	if (NULL == (node = (Node)realloc(cluster->nodes, sizeof(struct _Node) * cap))) {
+	    return opo_err_set(err, OPO_ERR_MEMORY, "failed to allocate memory for a cluster node.");
+	}
+	cluster->nodes = node;
+	cluster->ncap = cap;
+    }
+    if (NULL == (client = client_connect_addr(err, name, cluster->has_options ? &cluster->options : NULL))) {
+	return err->code;
+    }
+    client_set_notify(client, &cluster->ready);
+    node = cluster->nodes + cluster->ncnt;
+    node->name = strdup(name);
+    node->client = client;
+    node->member = true;
+    cluster->ncnt++;
+
+    return err->code;
+}
+
+opoCluster
+opo_cluster_connect(opoErr err, const char **nodes, int cnt, const char **key_paths, opoClientOptions options) {
+    opoCluster	cluster = (opoCluster)calloc(1, sizeof(struct _opoCluster));
+
+    if (NULL == cluster) {
+	opo_err_set(err, OPO_ERR_MEMORY, "failed to allocate memory for a opoCluster.");
+	return NULL;
+    }
+    pthread_rwlock_init(&cluster->lock, NULL);
+    atomic_init(&cluster->next_ref, 1);
+    if (NULL != options) {
+	cluster->options = *options;
+	cluster->has_options = true;
+    }
+    park_init(&cluster->ready, (NULL == options) ? 0 : options->spin);
+    for (; NULL != key_paths && NULL != key_paths[cluster->pcnt]; cluster->pcnt++) {
+	if (MAX_PATHS <= cluster->pcnt) {
+	    opo_err_set(err, OPO_ERR_ARG, "too many key paths, the limit is %d", MAX_PATHS);
+	    opo_cluster_close(cluster);
+	    return NULL;
+	}
+	cluster->paths[cluster->pcnt] = strdup(key_paths[cluster->pcnt]);
+    }
+    for (int i = 0; i < cnt; i++) {
+	if (OPO_ERR_OK != connect_node(err, cluster, nodes[i])) {
+	    opo_cluster_close(cluster);
+	    return NULL;
+	}
+    }
+    if (OPO_ERR_OK != build_ring(err, cluster)) {
+	opo_cluster_close(cluster);
+	return NULL;
+    }
+    return cluster;
+}
+
+void
+opo_cluster_close(opoCluster cluster) {
+    for (int i = 0; i < cluster->ncnt; i++) {
+	opo_client_close(cluster->nodes[i].client);
+	free(cluster->nodes[i].name);
+    }
+    for (int i = 0; i < cluster->pcnt; i++) {
+	free((char*)cluster->paths[i]);
+    }
+    free(cluster->nodes);
+    free(cluster->ring);
+    park_cleanup(&cluster->ready);
+    pthread_rwlock_destroy(&cluster->lock);
+    free(cluster);
+}
+
+opoErrCode
+opo_cluster_add_node(opoErr err, opoCluster cluster, const char *node) {
+    int	i;
+
+    pthread_rwlock_wrlock(&cluster->lock);
+    if (0 <= (i = find_node(cluster, node))) {
+	if (cluster->nodes[i].member) {
+	    pthread_rwlock_unlock(&cluster->lock);
+	    return opo_err_set(err, OPO_ERR_IN_USE, "node %s is already in the cluster", node);
+	}
+	cluster->nodes[i].member = true;
+    } else if (OPO_ERR_OK != connect_node(err, cluster, node)) {
+	pthread_rwlock_unlock(&cluster->lock);
+	return err->code;
+    }
+    build_ring(err, cluster);
+    pthread_rwlock_unlock(&cluster->lock);
+
+    return err->code;
+}
+
+opoErrCode
+opo_cluster_remove_node(opoErr err, opoCluster cluster, const char *node) {
+    int	i;
+
+    pthread_rwlock_wrlock(&cluster->lock);
+    if (0 > (i = find_node(cluster, node)) || !cluster->nodes[i].member) {
+	pthread_rwlock_unlock(&cluster->lock);
+	return opo_err_set(err, OPO_ERR_NOT_FOUND, "node %s is not in the cluster", node);
+    }
+    cluster->nodes[i].member = false;
+    build_ring(err, cluster);
+    pthread_rwlock_unlock(&cluster->lock);
+
+    return err->code;
+}
+
+// Must be called with the read lock held. Returns NULL if the query does not
+// have any of the keys.
+static opoClient
+route(opoErr err, opoCluster cluster, opoVal query) {
+    opoVal	top = opo_msg_val(query);
+    opoVal	key = NULL;
+
+    for (int i = 0; NULL == key && i < cluster->pcnt; i++) {
+	key = opo_val_get(top, cluster->paths[i]);
+    }
+    if (NULL == key) {
+	opo_err_set(err, OPO_ERR_ARG, "query does not contain a routing key");
+	return NULL;
+    }
+    if (0 == cluster->rcnt) {
+	opo_err_set(err, OPO_ERR_NOT_FOUND, "no nodes in the cluster");
+	return NULL;
+    }
+    // The encoding of a value is canonical so hashing the bytes gives the
+    // same result for the same key.
+    uint64_t	h = hash_bytes(key, opo_val_bsize(key));
+    int		lo = 0;
+    int		hi = cluster->rcnt;
+
+    while (lo < hi) {
+	int	mid = (lo + hi) / 2;
+
+	if (cluster->ring[mid].hash < h) {
+	    lo = mid + 1;
+	} else {
+	    hi = mid;
+	}
+    }
+    if (cluster->rcnt <= lo) {
+	lo = 0;
+    }
+    return cluster->nodes[cluster->ring[lo].node].client;
+}
+
+opoClient
+opo_cluster_client(opoCluster cluster, opoVal query) {
+    struct _opoErr	err = OPO_ERR_INIT;
+    opoClient		client;
+
+    pthread_rwlock_rdlock(&cluster->lock);
+    client = route(&err, cluster, query);
+    pthread_rwlock_unlock(&cluster->lock);
+
+    return client;
+}
+
+opoRef
+opo_cluster_query(opoErr err, opoCluster cluster, opoVal query, opoQueryCallback cb, void *ctx) {
+    opoClient	client;
+    opoRef	ref = 0;
+
+    pthread_rwlock_rdlock(&cluster->lock);
+    client = route(err, cluster, query);
+    pthread_rwlock_unlock(&cluster->lock);
+    // Sending may wait for room so it is done without the lock to avoid
+    // holding off node changes.
+    if (NULL != client) {
+	ref = opo_client_query(err, client, query, cb, ctx);
+    }
+    return ref;
+}
+
+// The merged response is an array of the node responses.
+static void
+gather_done(Gather g) {
+    struct _opoErr	err = OPO_ERR_INIT;
+    struct _opoBuilder	builder;
+    uint8_t		head[256];
+
+    opo_builder_init(&err, &builder, head, sizeof(head));
+    opo_builder_push_array(&err, &builder, NULL, -1);
+    for (int i = 0; i < g->cnt; i++) {
+	if (NULL == g->parts[i].resp) {
+	    opo_builder_push_null(&err, &builder, NULL, -1);
+	} else {
+	    opo_builder_push_val(&err, &builder, opo_msg_val(g->parts[i].resp), NULL, -1);
+	}
+    }
+
+    opoMsg	msg = opo_builder_take_pooled(&builder);
+
+    opo_builder_cleanup(&builder);
+    if (NULL != msg) {
+	opo_msg_set_id((uint8_t*)msg, g->ref);
+	if (NULL != g->cb) {
+	    g->cb(g->ref, msg, g->ctx);
+	}
+	slab_free(msg);
+    }
+    for (int i = 0; i < g->cnt; i++) {
+	slab_free(g->parts[i].resp);
+    }
+    free(g);
+}
+
+// A node the query could not be sent to gets an error entry in place of a
+// response.
+static void
+part_failed(struct _Part *part, opoErr err) {
+    struct _opoErr	e = OPO_ERR_INIT;
+    struct _opoBuilder	builder;
+
+    if (OPO_ERR_OK != opo_builder_init(&e, &builder, NULL, 64 + strlen(err->msg))) {
+	return;
+    }
+    opo_builder_push_object(&e, &builder, NULL, -1);
+    opo_builder_push_int(&e, &builder, err->code, "code", 4);
+    opo_builder_push_string(&e, &builder, err->msg, -1, "error", 5);
+    if (OPO_ERR_OK == e.code) {
+	part->resp = (uint8_t*)opo_builder_take_pooled(&builder);
+    }
+    opo_builder_cleanup(&builder);
+}
+
+static void
+gather_cb(opoRef ref, opoMsg response, void *ctx) {
+    struct _Part	*part = (struct _Part*)ctx;
+    Gather		g = part->gather;
+    size_t		size = opo_msg_bsize(response);
+
+    // The response is only valid during the callback.
+    if (NULL != (part->resp = slab_alloc(size))) {
+	memcpy(part->resp, response, size);
+    }
+    if (1 == atomic_fetch_sub(&g->remaining, 1)) {
+	gather_done(g);
+    }
+}
+
+opoRef
+opo_cluster_scatter(opoErr err, opoCluster cluster, opoVal query, opoQueryCallback cb, void *ctx) {
+    Gather	g;
+    int		cnt = 0;
+
+    // The parts are completed by per-query callbacks.
+    if (cluster->has_options && NULL != cluster->options.query_callback) {
+	opo_err_set(err, OPO_ERR_ARG, "scatter queries can not be used with a query_callback");
+	return 0;
+    }
+    pthread_rwlock_rdlock(&cluster->lock);
+    for (int i = 0; i < cluster->ncnt; i++) {
+	if (cluster->nodes[i].member) {
+	    cnt++;
+	}
+    }
+    if (0 == cnt) {
+	pthread_rwlock_unlock(&cluster->lock);
+	opo_err_set(err, OPO_ERR_NOT_FOUND, "no nodes in the cluster");
+	return 0;
+    }
+    if (NULL == (g = (Gather)malloc(sizeof(struct _Gather) + sizeof(struct _Part) * cnt))) {
+	pthread_rwlock_unlock(&cluster->lock);
+	opo_err_set(err, OPO_ERR_MEMORY, "failed to allocate memory for a scatter query.");
+	return 0;
+    }
+    g->cnt = cnt;
+    g->ref = SCATTER_REF | (opoRef)atomic_fetch_add(&cluster->next_ref, 1);
+    g->cb = cb;
+    g->ctx = ctx;
+    // One extra so the gather can not complete until all are sent.
+    atomic_init(&g->remaining, cnt + 1);
+    for (int i = 0, p = 0; i < cluster->ncnt; i++) {
+	if (!cluster->nodes[i].member) {
+	    continue;
+	}
+	struct _Part	*part = g->parts + p++;
+
+	part->gather = g;
+	part->client = cluster->nodes[i].client;
+	part->resp = NULL;
+    }
+    pthread_rwlock_unlock(&cluster->lock);
+
+    for (int i = 0; i < cnt; i++) {
+	struct _opoErr	e = OPO_ERR_INIT;
+	struct _Part	*part = g->parts + i;
+
+	// Once sent the callback always comes, if only with a lost response.
+	if (0 == opo_client_query(&e, part->client, query, gather_cb, part)) {
+	    part_failed(part, &e);
+	    atomic_fetch_sub(&g->remaining, 1);
+	}
+    }
+    opoRef	ref = g->ref;
+
+    if (1 == atomic_fetch_sub(&g->remaining, 1)) {
+	gather_done(g);
+    }
+    return ref;
+}
+
+int
+opo_cluster_process(opoCluster cluster, int max, double wait) {
+    pthread_rwlock_rdlock(&cluster->lock);
+
+    int		cnt = cluster->ncnt;
+
+    if (0 == cnt) {
+	pthread_rwlock_unlock(&cluster->lock);
+	return 0;
+    }
+    opoClient	clients[cnt];
+
+    for (int i = 0; i < cnt; i++) {
+	clients[i] = cluster->nodes[i].client;
+    }
+    pthread_rwlock_unlock(&cluster->lock);
+
+    return client_group_process(clients, cnt, &cluster->ready, max, wait);
+}
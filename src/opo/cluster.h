@@ -0,0 +1,30 @@
+// Copyright 2017 by Peter Ohler, All Rights Reserved
+
+#ifndef __OPOC_CLUSTER_H__
+#define __OPOC_CLUSTER_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "client.h"
+
+    typedef struct _opoCluster	*opoCluster;
+
+    extern opoCluster	opo_cluster_connect(opoErr		err,
+					    const char		**nodes,
+					    int			cnt,
+					    const char		**key_paths,
+					    opoClientOptions	options);
+    extern void		opo_cluster_close(opoCluster cluster);
+    extern opoErrCode	opo_cluster_add_node(opoErr err, opoCluster cluster, const char *node);
+    extern opoErrCode	opo_cluster_remove_node(opoErr err, opoCluster cluster, const char *node);
+    extern opoRef	opo_cluster_query(opoErr err, opoCluster cluster, opoVal query, opoQueryCallback cb, void *ctx);
+    extern opoRef	opo_cluster_scatter(opoErr err, opoCluster cluster, opoVal query, opoQueryCallback cb, void *ctx);
+    extern int		opo_cluster_process(opoCluster cluster, int max, double wait);
+    extern opoClient	opo_cluster_client(opoCluster cluster, opoVal query);
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* __OPOC_CLUSTER_H__ */
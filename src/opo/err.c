@@ -67,6 +67,8 @@ opo_err_str(opoErrCode code) {
 	case OPO_ERR_IN_USE:	str = "in use";			break;
 	case OPO_ERR_TOO_MANY:	str = "too many";		break;
 	case OPO_ERR_TYPE:	str = "type error";		break;
+	case OPO_ERR_LOST:	str = "lost";			break;
+	case OPO_ERR_CANCELED:	str = "canceled";		break;
 	default:		str = "unknown error";		break;
 	}
     }
@@ -30,6 +30,7 @@ typedef enum {
     OPO_ERR_TOO_MANY,
     OPO_ERR_TYPE,
     OPO_ERR_LOST,
+    OPO_ERR_CANCELED,
     OPO_ERR_LAST
 } opoErrCode;
 
@@ -0,0 +1,264 @@
+// Copyright 2017 by Peter Ohler, All Rights Reserved
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "flight.h"
+
+#define MIN_FOLLOWERS	4
+
+Flights
+flights_create(size_t max) {
+    Flights	fs = (Flights)malloc(sizeof(struct _Flights));
+    size_t	cnt = 16;
+
+    if (NULL == fs) {
+	return NULL;
+    }
+    while (cnt < max) {
+	cnt *= 2;
+    }
+    if (NULL == (fs->by_hash = (Flight*)calloc(cnt, sizeof(Flight))) ||
+	NULL == (fs->by_id = (Flight*)calloc(cnt, sizeof(Flight)))) {
+	free(fs->by_hash);
+	free(fs);
+	return NULL;
+    }
+    pthread_mutex_init(&fs->lock, NULL);
+    fs->mask = cnt - 1;
+    fs->free_list = NULL;
+    fs->gen = 0;
+    atomic_init(&fs->joined, 0);
+
+    return fs;
+}
+
+static void
+flight_free(Flight f) {
+    free(f->followers);
+    free(f->key);
+    free(f);
+}
+
+void
+flights_destroy(Flights fs) {
+    Flight	f;
+
+    if (NULL == fs) {
+	return;
+    }
+    for (size_t i = 0; i <= fs->mask; i++) {
+	while (NULL != (f = fs->by_id[i])) {
+	    fs->by_id[i] = f->id_next;
+	    flight_free(f);
+	}
+    }
+    while (NULL != (f = fs->free_list)) {
+	fs->free_list = f->next;
+	flight_free(f);
+    }
+    pthread_mutex_destroy(&fs->lock);
+    free(fs->by_hash);
+    free(fs->by_id);
+    free(fs);
+}
+
+static Flight
+find_id(Flights fs, uint64_t id) {
+    Flight	f = fs->by_id[id & fs->mask];
+
+    for (; NULL != f && f->id != id; f = f->id_next) {
+    }
+    return f;
+}
+
+static bool
+add_follower(Flight f, uint64_t id) {
+    if (f->cap <= f->cnt) {
+	int		cap = (0 == f->cap) ? MIN_FOLLOWERS : f->cap * 2;
+	uint64_t	*followers = (uint64_t*)realloc(f->followers, sizeof(uint64_t) * cap);
+
+	if (NULL == followers) {
+	    return false;
+	}
+	f->followers = followers;
+	f->cap = cap;
+    }
+    f->followers[f->cnt++] = id;
+
+    return true;
+}
+
+static bool
+set_key(Flight f, opoMsg query) {
+    size_t	klen = opo_msg_bsize(query) - 8;
+
+    if (f->kcap < klen) {
+	uint8_t	*key = (uint8_t*)realloc(f->key, klen);
+
+	if (NULL == key) {
+	    return false;
+	}
+	f->key = key;
+	f->kcap = klen;
+    }
+    memcpy(f->key, query + 8, klen);
+    f->klen = klen;
+
+    return true;
+}
+
+static void
+unlink_hash(Flights fs, Flight f) {
+    Flight	*fp;
+
+    for (fp = fs->by_hash + (f->hash & fs->mask); *fp != f; fp = &(*fp)->next) {
+    }
+    *fp = f->next;
+}
+
+static void
+unlink_id(Flights fs, Flight f) {
+    Flight	*fp;
+
+    for (fp = fs->by_id + (f->id & fs->mask); *fp != f; fp = &(*fp)->id_next) {
+    }
+    *fp = f->id_next;
+}
+
+// Must be called with the lock held.
+static void
+free_flight(Flights fs, Flight f) {
+    f->resp = NULL;
+    f->next = fs->free_list;
+    fs->free_list = f;
+}
+
+bool
+flights_join(Flights fs, uint64_t hash, opoMsg query, uint64_t id, bool start, uint64_t *lead) {
+    Flight		*bucket = fs->by_hash + (hash & fs->mask);
+    const uint8_t	*key = query + 8;
+    size_t		klen = opo_msg_bsize(query) - 8;
+    Flight		f;
+
+    pthread_mutex_lock(&fs->lock);
+    for (f = *bucket; NULL != f; f = f->next) {
+	// The hash only picks out candidates. The query bytes must match
+	// as well.
+	if (f->hash == hash && f->gen == fs->gen && f->klen == klen && 0 == memcmp(f->key, key, klen)) {
+	    if (add_follower(f, id)) {
+		*lead = f->id;
+		pthread_mutex_unlock(&fs->lock);
+		atomic_fetch_add(&fs->joined, 1);
+		return true;
+	    }
+	    break;
+	}
+    }
+    if (!start) {
+	pthread_mutex_unlock(&fs->lock);
+	return false;
+    }
+    if (NULL != (f = fs->free_list)) {
+	fs->free_list = f->next;
+    } else if (NULL != (f = (Flight)malloc(sizeof(struct _Flight)))) {
+	f->cap = 0;
+	f->followers = NULL;
+	f->kcap = 0;
+	f->key = NULL;
+    }
+    if (NULL == f || !set_key(f, query)) {
+	if (NULL != f) {
+	    free_flight(fs, f);
+	}
+	// Sent on its own without a flight which only means nothing can
+	// join it.
+	pthread_mutex_unlock(&fs->lock);
+	return false;
+    }
+    f->hash = hash;
+    f->id = id;
+    f->gen = fs->gen;
+    f->sealed = false;
+    f->cnt = 0;
+    f->resp = NULL;
+    atomic_init(&f->refs, 0);
+    f->next = *bucket;
+    *bucket = f;
+    f->id_next = fs->by_id[id & fs->mask];
+    fs->by_id[id & fs->mask] = f;
+    pthread_mutex_unlock(&fs->lock);
+
+    return false;
+}
+
+Flight
+flights_land(Flights fs, uint64_t id) {
+    Flight	f;
+
+    pthread_mutex_lock(&fs->lock);
+    if (NULL != (f = find_id(fs, id))) {
+	unlink_id(fs, f);
+	// A sealed flight was taken out of the hash buckets already.
+	if (!f->sealed) {
+	    unlink_hash(fs, f);
+	}
+    }
+    pthread_mutex_unlock(&fs->lock);
+
+    return f;
+}
+
+void
+flights_release(Flights fs, Flight f) {
+    pthread_mutex_lock(&fs->lock);
+    free_flight(fs, f);
+    pthread_mutex_unlock(&fs->lock);
+}
+
+void
+flights_seal(Flights fs, uint64_t id) {
+    Flight	f;
+
+    pthread_mutex_lock(&fs->lock);
+    if (NULL != (f = find_id(fs, id)) && !f->sealed) {
+	f->sealed = true;
+	unlink_hash(fs, f);
+	// Followers can still be handed a late response so the flight is
+	// kept until they are done.
+	if (0 == f->cnt) {
+	    unlink_id(fs, f);
+	    free_flight(fs, f);
+	}
+    }
+    pthread_mutex_unlock(&fs->lock);
+}
+
+void
+flights_leave(Flights fs, uint64_t lead, uint64_t id) {
+    Flight	f;
+
+    pthread_mutex_lock(&fs->lock);
+    if (NULL != (f = find_id(fs, lead))) {
+	for (int i = 0; i < f->cnt; i++) {
+	    if (f->followers[i] == id) {
+		f->followers[i] = f->followers[--f->cnt];
+		break;
+	    }
+	}
+	if (f->sealed && 0 == f->cnt) {
+	    unlink_id(fs, f);
+	    free_flight(fs, f);
+	}
+    }
+    pthread_mutex_unlock(&fs->lock);
+}
+
+// Flights started before a write may see the data from before it so later
+// reads must not join them.
+void
+flights_seal_all(Flights fs) {
+    pthread_mutex_lock(&fs->lock);
+    fs->gen++;
+    pthread_mutex_unlock(&fs->lock);
+}
@@ -0,0 +1,74 @@
+// Copyright 2017 by Peter Ohler, All Rights Reserved
+
+#ifndef __OPO_FLIGHT_H__
+#define __OPO_FLIGHT_H__
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "val.h"
+
+// A read query on the wire and the ids of the identical queries that joined
+// it instead of being sent. The one response is handed to all of them. Once
+// the query sent is abandoned the flight is sealed, taken out of the hash
+// buckets, and freed when the last follower is done with it unless the
+// response arrives first.
+typedef struct _Flight {
+    struct _Flight	*next; // in the hash bucket
+    struct _Flight	*id_next; // in the id bucket
+    uint64_t		hash;
+    uint64_t		id; // of the query that was sent
+    uint64_t		gen; // of the flights when started
+    bool		sealed; // no longer joinable
+    uint8_t		*key; // query without the id
+    size_t		klen;
+    size_t		kcap;
+    int			cnt;
+    int			cap;
+    uint64_t		*followers;
+    atomic_int		refs; // holders of the shared response
+    opoMsg		resp;
+} *Flight;
+
+// Flights are found by query hash when joining and by id when the response
+// arrives. Landed flights are kept on a free list for reuse.
+typedef struct _Flights {
+    pthread_mutex_t	lock;
+    Flight		*by_hash;
+    Flight		*by_id;
+    size_t		mask;
+    Flight		free_list;
+    uint64_t		gen; // bumped to seal all flights at once
+    atomic_ullong	joined;
+} *Flights;
+
+extern Flights	flights_create(size_t max);
+extern void	flights_destroy(Flights fs);
+
+// Adds the query with the id to the flight for the same query, sets lead to
+// the id of the query sent for the flight, and returns true. The lead is set
+// before the lock is released so it is in place before the response can be
+// handed over. If there is no flight to join and start is true a new flight
+// is started with the query as the one to send. Returns false if not joined.
+extern bool	flights_join(Flights fs, uint64_t hash, opoMsg query, uint64_t id, bool start, uint64_t *lead);
+
+// Removes and returns the flight sent with the id, NULL if there is none.
+extern Flight	flights_land(Flights fs, uint64_t id);
+
+// Returns a landed flight to the free list.
+extern void	flights_release(Flights fs, Flight f);
+
+// Stops the flight sent with the id from being joined as the query sent was
+// abandoned. It is freed now if nothing joined it.
+extern void	flights_seal(Flights fs, uint64_t id);
+
+// Removes the follower with the id from the flight sent with lead and frees
+// the flight if it is sealed and no followers are left.
+extern void	flights_leave(Flights fs, uint64_t lead, uint64_t id);
+
+// Stops all flights from being joined.
+extern void	flights_seal_all(Flights fs);
+
+#endif /* __OPO_FLIGHT_H__ */
@@ -0,0 +1,326 @@
+// Copyright 2017 by Peter Ohler, All Rights Reserved
+
+#include <errno.h>
+#include <sched.h>
+#include <stdlib.h>
+
+#include "client_int.h"
+#include "dtime.h"
+#include "future_int.h"
+
+#define IDLE_WAIT	0.1 // longest block before checking the connections again
+
+// Each waiting thread blocks on its own park so a completion only wakes the
+// thread waiting on that future.
+static _Thread_local struct _Park	wait_park;
+static _Thread_local bool		wait_park_ready = false;
+
+// Marks the then callback as already made.
+static void
+fired(opoFuture future, opoMsg response, opoErrCode code, void *ctx) {
+}
+
+static Park
+get_wait_park() {
+    if (!wait_park_ready) {
+	park_init(&wait_park, 0);
+	wait_park_ready = true;
+    }
+    return &wait_park;
+}
+
+void
+future_init(opoFuture future) {
+    future->client = NULL;
+    future->ref = 0;
+    future->resp = NULL;
+    future->code = OPO_ERR_OK;
+    atomic_init(&future->state, FUTURE_IDLE);
+    atomic_init(&future->waiter, NULL);
+    atomic_init(&future->then, NULL);
+    future->then_ctx = NULL;
+}
+
+static bool
+is_pending(opoFuture future) {
+    char	state = atomic_load(&future->state);
+
+    return FUTURE_IDLE != state && FUTURE_DONE != state;
+}
+
+bool
+future_start(opoErr err, opoFuture future, opoClient client) {
+    if (is_pending(future)) {
+	opo_err_set(err, OPO_ERR_IN_USE, "future is still pending");
+	return false;
+    }
+    opo_future_reset(future);
+    future->client = client;
+    atomic_store(&future->state, FUTURE_PENDING);
+
+    return true;
+}
+
+void
+future_abort(opoFuture future) {
+    atomic_store(&future->state, FUTURE_IDLE);
+}
+
+void
+future_set(opoFuture future, opoMsg resp, opoErrCode code) {
+    opoFutureCallback	cb;
+    Park		waiter;
+
+    future->resp = resp;
+    future->code = code;
+    atomic_store(&future->state, FUTURE_SETTING);
+    if (NULL != (cb = atomic_exchange(&future->then, fired))) {
+	cb(future, resp, code, future->then_ctx);
+    }
+    atomic_store(&future->state, FUTURE_WAKING);
+    if (NULL != (waiter = atomic_load(&future->waiter))) {
+	park_wake(waiter);
+    }
+    atomic_store(&future->state, FUTURE_DONE);
+}
+
+opoFuture
+opo_future_create(opoErr err) {
+    opoFuture	future = (opoFuture)malloc(sizeof(struct _opoFuture));
+
+    if (NULL == future) {
+	opo_err_set(err, OPO_ERR_MEMORY, "failed to allocate memory for a opoFuture.");
+	return NULL;
+    }
+    future_init(future);
+
+    return future;
+}
+
+void
+opo_future_destroy(opoFuture future) {
+    if (NULL == future) {
+	return;
+    }
+    if (is_pending(future)) {
+	struct _opoErr	err = OPO_ERR_INIT;
+
+	// The receiving side still refers to the future.
+	if (!opo_client_cancel(future->client, future->ref)) {
+	    opo_future_wait(&err, future, 0.0);
+	}
+    }
+    opo_future_reset(future);
+    free(future);
+}
+
+// Releases the response. The future must not be pending.
+void
+opo_future_reset(opoFuture future) {
+    if (NULL != future->resp) {
+	opo_msg_release_pooled(future->resp);
+    }
+    future_init(future);
+}
+
+bool
+opo_future_ready(opoFuture future) {
+    return FUTURE_DONE == atomic_load(&future->state);
+}
+
+// A future that is waking its waiter already has its response. Futures
+// without a query count as done only if idle is true.
+static bool
+is_done(opoFuture future, bool idle) {
+    char	state = atomic_load(&future->state);
+
+    return FUTURE_DONE == state || FUTURE_WAKING == state || (idle && FUTURE_IDLE == state);
+}
+
+static int
+count_done(opoFuture *futures, int cnt, bool idle) {
+    int	done = 0;
+
+    for (; 0 < cnt; cnt--, futures++) {
+	if (is_done(*futures, idle)) {
+	    done++;
+	}
+    }
+    return done;
+}
+
+static int
+count_idle(opoFuture *futures, int cnt) {
+    int	idle = 0;
+
+    for (; 0 < cnt; cnt--, futures++) {
+	if (FUTURE_IDLE == atomic_load(&(*futures)->state)) {
+	    idle++;
+	}
+    }
+    return idle;
+}
+
+// Gives the pending queries a push when no receiving thread will. Embedded
+// clients are pumped and queries on closed connections are canceled.
+// Returns true if anything was done.
+static bool
+assist(opoFuture *futures, int cnt, double wait) {
+    opoClient	pumped = NULL;
+    bool	acted = false;
+
+    for (; 0 < cnt; cnt--, futures++) {
+	opoFuture	f = *futures;
+
+	if (FUTURE_PENDING != atomic_load(&f->state)) {
+	    continue;
+	}
+	if (!client_connected(f->client)) {
+	    opo_client_cancel(f->client, f->ref);
+	    acted = true;
+	} else if (f->client != pumped && client_pump_wait(f->client, (NULL == pumped) ? wait : 0.0)) {
+	    pumped = f->client;
+	    acted = true;
+	}
+    }
+    return acted;
+}
+
+// Waits for at least want of the futures to complete. Returns the number
+// done which is less than want only on timeout.
+static int
+wait_for(opoFuture *futures, int cnt, int want, bool idle, double timeout) {
+    Park	park = get_wait_park();
+    double	give_up = (0.0 < timeout) ? dtime() + timeout : 0.0;
+    int		spins = 0;
+    int		i;
+
+    for (i = 0; i < cnt; i++) {
+	atomic_store(&futures[i]->waiter, park);
+    }
+    while (count_done(futures, cnt, idle) < want) {
+	double	slice = IDLE_WAIT;
+
+	if (0.0 < give_up) {
+	    double	left = give_up - dtime();
+
+	    if (0.0 >= left) {
+		break;
+	    }
+	    if (left < slice) {
+		slice = left;
+	    }
+	}
+	if (assist(futures, cnt, slice) || park_spin(park, &spins)) {
+	    continue;
+	}
+	unsigned int	key = park_prepare(park);
+
+	if (count_done(futures, cnt, idle) < want) {
+	    park_wait(park, key, slice);
+	}
+	park_done(park);
+    }
+    for (i = 0; i < cnt; i++) {
+	atomic_store(&futures[i]->waiter, NULL);
+    }
+    // A completing thread may have picked up the park before it was
+    // cleared so let it finish before the park can go away.
+    for (i = 0; i < cnt; i++) {
+	while (FUTURE_WAKING == atomic_load(&futures[i]->state)) {
+	    sched_yield();
+	}
+    }
+    return count_done(futures, cnt, idle);
+}
+
+static opoMsg
+future_result(opoErr err, opoFuture future) {
+    switch (future->code) {
+    case OPO_ERR_OK:
+	break;
+    case OPO_ERR_LOST:
+	opo_err_set(err, future->code, "query timed out");
+	break;
+    case OPO_ERR_CANCELED:
+	opo_err_set(err, future->code, "query canceled");
+	break;
+    case OPO_ERR_READ:
+	opo_err_set(err, future->code, "connection closed");
+	break;
+    default:
+	opo_err_set(err, future->code, "failed to copy the response");
+	break;
+    }
+    return future->resp;
+}
+
+opoMsg
+opo_future_wait(opoErr err, opoFuture future, double timeout) {
+    if (FUTURE_IDLE == atomic_load(&future->state)) {
+	opo_err_set(err, OPO_ERR_ARG, "future has no query");
+	return NULL;
+    }
+    if (1 > wait_for(&future, 1, 1, false, timeout)) {
+	opo_err_set(err, ETIMEDOUT, "timed out waiting for a response");
+	return NULL;
+    }
+    return future_result(err, future);
+}
+
+int
+opo_future_wait_all(opoErr err, opoFuture *futures, int cnt, double timeout) {
+    int	done = wait_for(futures, cnt, cnt, true, timeout);
+
+    if (done < cnt) {
+	opo_err_set(err, ETIMEDOUT, "timed out waiting for %d of %d responses", cnt - done, cnt);
+    }
+    return done;
+}
+
+int
+opo_future_wait_any(opoErr err, opoFuture *futures, int cnt, double timeout) {
+    if (cnt == count_idle(futures, cnt)) {
+	opo_err_set(err, OPO_ERR_ARG, "none of the futures has a query");
+	return -1;
+    }
+    if (0 < wait_for(futures, cnt, 1, false, timeout)) {
+	for (int i = 0; i < cnt; i++) {
+	    if (is_done(futures[i], false)) {
+		return i;
+	    }
+	}
+    }
+    opo_err_set(err, ETIMEDOUT, "timed out waiting for a response");
+
+    return -1;
+}
+
+void
+opo_future_then(opoFuture future, opoFutureCallback cb, void *ctx) {
+    opoFutureCallback	expect = NULL;
+
+    future->then_ctx = ctx;
+    if (!atomic_compare_exchange_strong(&future->then, &expect, cb)) {
+	// Already completed.
+	cb(future, future->resp, future->code, ctx);
+    }
+}
+
+opoMsg
+opo_future_response(opoFuture future) {
+    if (!opo_future_ready(future)) {
+	return NULL;
+    }
+    return future->resp;
+}
+
+opoMsg
+opo_future_take(opoFuture future) {
+    opoMsg	resp = opo_future_response(future);
+
+    if (NULL != resp) {
+	future->resp = NULL;
+    }
+    return resp;
+}
@@ -0,0 +1,34 @@
+// Copyright 2017 by Peter Ohler, All Rights Reserved
+
+#ifndef __OPOC_FUTURE_H__
+#define __OPOC_FUTURE_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdbool.h>
+
+#include "err.h"
+#include "val.h"
+
+    // A future holds a single waiter. Only one thread at a time may wait on
+    // a future, alone or as part of a wait_all or wait_any.
+    typedef struct _opoFuture	*opoFuture;
+    typedef void		(*opoFutureCallback)(opoFuture future, opoMsg response, opoErrCode code, void *ctx);
+
+    extern opoFuture	opo_future_create(opoErr err);
+    extern void		opo_future_destroy(opoFuture future);
+    extern void		opo_future_reset(opoFuture future);
+    extern bool		opo_future_ready(opoFuture future);
+    extern opoMsg	opo_future_wait(opoErr err, opoFuture future, double timeout);
+    extern int		opo_future_wait_all(opoErr err, opoFuture *futures, int cnt, double timeout);
+    extern int		opo_future_wait_any(opoErr err, opoFuture *futures, int cnt, double timeout);
+    extern void		opo_future_then(opoFuture future, opoFutureCallback cb, void *ctx);
+    extern opoMsg	opo_future_response(opoFuture future);
+    extern opoMsg	opo_future_take(opoFuture future);
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* __OPOC_FUTURE_H__ */
@@ -0,0 +1,45 @@
+// Copyright 2017 by Peter Ohler, All Rights Reserved
+
+#ifndef __OPO_FUTURE_INT_H__
+#define __OPO_FUTURE_INT_H__
+
+#include <stdatomic.h>
+
+#include "client.h"
+#include "future.h"
+#include "park.h"
+
+#define FUTURE_IDLE	'i' // no query
+#define FUTURE_PENDING	'p'
+#define FUTURE_SETTING	's' // response set, then callback being made
+#define FUTURE_WAKING	'w' // waking the waiter, done right after
+#define FUTURE_DONE	'd'
+
+// Futures are completed by the receiving side of a client while other
+// threads wait on them. The response is a copy owned by the future.
+struct _opoFuture {
+    opoClient		client;
+    opoRef		ref;
+    opoMsg		resp;
+    opoErrCode		code;
+    atomic_char		state;
+    _Atomic(Park)	waiter; // park of a thread waiting on the future
+    _Atomic(opoFutureCallback)	then;
+    void		*then_ctx;
+};
+
+// Sets up a future that is not allocated, such as one on the stack.
+extern void	future_init(opoFuture future);
+
+// Readies a future for a new query on the client, releasing any earlier
+// response. Fails if the future is still pending.
+extern bool	future_start(opoErr err, opoFuture future, opoClient client);
+
+// Puts a future started for a query that could not be sent back to idle.
+extern void	future_abort(opoFuture future);
+
+// Completes the future. The response may be NULL if the code is not
+// OPO_ERR_OK. The future may be reused as soon as this returns.
+extern void	future_set(opoFuture future, opoMsg resp, opoErrCode code);
+
+#endif /* __OPO_FUTURE_INT_H__ */
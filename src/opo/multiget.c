@@ -0,0 +1,274 @@
+// Copyright 2017 by Peter Ohler, All Rights Reserved
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "builder.h"
+#include "multiget.h"
+#include "slab.h"
+
+Multiget
+multiget_create(double window, int max, const char *select, size_t pending_max) {
+    Multiget	mg = (Multiget)malloc(sizeof(struct _Multiget));
+    size_t	cnt = 16;
+
+    if (NULL == mg) {
+	return NULL;
+    }
+    while (cnt < pending_max) {
+	cnt *= 2;
+    }
+    if (NULL == (mg->sent = (Gather*)calloc(cnt, sizeof(Gather))) ||
+	NULL == (mg->select = strdup(select))) {
+	free(mg->sent);
+	free(mg);
+	return NULL;
+    }
+    pthread_mutex_init(&mg->lock, NULL);
+    mg->window = window;
+    mg->max = max;
+    mg->open = NULL;
+    mg->due = 0.0;
+    mg->mask = cnt - 1;
+    mg->free_list = NULL;
+    atomic_init(&mg->batches, 0);
+
+    return mg;
+}
+
+static void
+gather_free(Gather g) {
+    free(g->ids);
+    free(g->refs);
+    free(g);
+}
+
+void
+multiget_destroy(Multiget mg) {
+    Gather	g;
+
+    if (NULL == mg) {
+	return;
+    }
+    for (size_t i = 0; i <= mg->mask; i++) {
+	while (NULL != (g = mg->sent[i])) {
+	    mg->sent[i] = g->next;
+	    gather_free(g);
+	}
+    }
+    while (NULL != (g = mg->free_list)) {
+	mg->free_list = g->next;
+	gather_free(g);
+    }
+    if (NULL != mg->open) {
+	gather_free(mg->open);
+    }
+    pthread_mutex_destroy(&mg->lock);
+    free(mg->sent);
+    free(mg->select);
+    free(mg);
+}
+
+bool
+multiget_ref(Multiget mg, opoMsg query, int64_t *refp) {
+    struct _opoErr	err = OPO_ERR_INIT;
+    opoVal		top = opo_msg_val(query);
+    opoVal		where = opo_val_get(top, "where");
+    opoVal		select;
+    const char		*str;
+    int			len;
+
+    if (NULL == where || OPO_VAL_INT != opo_val_type(where) ||
+	NULL == (select = opo_val_get(top, "select")) || OPO_VAL_STR != opo_val_type(select) ||
+	2 != opo_val_member_count(&err, top)) {
+	return false;
+    }
+    str = opo_val_string(&err, select, &len);
+    if ((size_t)len != strlen(mg->select) || 0 != strncmp(str, mg->select, len)) {
+	return false;
+    }
+    *refp = opo_val_int(&err, where);
+
+    return true;
+}
+
+// Moves the open gather to the sent table. Called with the lock held.
+static Gather
+take_open(Multiget mg) {
+    Gather	g = mg->open;
+    Gather	*bucket = mg->sent + (g->id & mg->mask);
+
+    g->next = *bucket;
+    *bucket = g;
+    mg->open = NULL;
+    atomic_fetch_add(&mg->batches, 1);
+
+    return g;
+}
+
+bool
+multiget_add(Multiget mg, uint64_t id, int64_t ref, double now, Gather *fullp) {
+    Gather	g;
+
+    pthread_mutex_lock(&mg->lock);
+    if (NULL == (g = mg->open)) {
+	if (NULL != (g = mg->free_list)) {
+	    mg->free_list = g->next;
+	} else if (NULL == (g = (Gather)calloc(1, sizeof(struct _Gather))) ||
+		   NULL == (g->ids = (uint64_t*)malloc(sizeof(uint64_t) * mg->max)) ||
+		   NULL == (g->refs = (int64_t*)malloc(sizeof(int64_t) * mg->max))) {
+	    pthread_mutex_unlock(&mg->lock);
+	    if (NULL != g) {
+		gather_free(g);
+	    }
+	    return false;
+	}
+	g->id = id;
+	g->cnt = 0;
+	mg->open = g;
+	mg->due = now + mg->window;
+    }
+    g->ids[g->cnt] = id;
+    g->refs[g->cnt] = ref;
+    g->cnt++;
+    *fullp = (mg->max <= g->cnt) ? take_open(mg) : NULL;
+    pthread_mutex_unlock(&mg->lock);
+
+    return true;
+}
+
+Gather
+multiget_due(Multiget mg, double now) {
+    Gather	g = NULL;
+
+    pthread_mutex_lock(&mg->lock);
+    if (NULL != mg->open && mg->due <= now) {
+	g = take_open(mg);
+    }
+    pthread_mutex_unlock(&mg->lock);
+
+    return g;
+}
+
+double
+multiget_next(Multiget mg) {
+    double	due = 0.0;
+
+    pthread_mutex_lock(&mg->lock);
+    if (NULL != mg->open) {
+	due = mg->due;
+    }
+    pthread_mutex_unlock(&mg->lock);
+
+    return due;
+}
+
+uint8_t*
+multiget_query(opoErr err, Multiget mg, Gather g) {
+    struct _opoBuilder	builder;
+
+    if (OPO_ERR_OK != opo_builder_init(err, &builder, NULL, 64 + strlen(mg->select) + 9 * g->cnt)) {
+	return NULL;
+    }
+    opo_builder_push_object(err, &builder, NULL, -1);
+    opo_builder_push_array(err, &builder, "where", 5);
+    opo_builder_push_string(err, &builder, "IN", 2, NULL, -1);
+    opo_builder_push_string(err, &builder, "$ref", 4, NULL, -1);
+    for (int i = 0; i < g->cnt; i++) {
+	opo_builder_push_int(err, &builder, g->refs[i], NULL, -1);
+    }
+    opo_builder_pop(err, &builder);
+    opo_builder_push_array(err, &builder, "select", 6);
+    opo_builder_push_string(err, &builder, "$ref", 4, NULL, -1);
+    opo_builder_push_string(err, &builder, mg->select, -1, NULL, -1);
+    opo_builder_pop(err, &builder);
+    if (OPO_ERR_OK != err->code) {
+	opo_builder_cleanup(&builder);
+	return NULL;
+    }
+    uint8_t	*query = (uint8_t*)opo_builder_take_pooled(&builder);
+
+    opo_msg_set_id(query, g->id);
+
+    return query;
+}
+
+Gather
+multiget_land(Multiget mg, uint64_t id) {
+    Gather	*gp;
+    Gather	g;
+
+    pthread_mutex_lock(&mg->lock);
+    for (gp = mg->sent + (id & mg->mask); NULL != (g = *gp) && g->id != id; gp = &g->next) {
+    }
+    if (NULL != g) {
+	*gp = g->next;
+    }
+    pthread_mutex_unlock(&mg->lock);
+
+    return g;
+}
+
+void
+multiget_release(Multiget mg, Gather g) {
+    pthread_mutex_lock(&mg->lock);
+    g->next = mg->free_list;
+    mg->free_list = g;
+    pthread_mutex_unlock(&mg->lock);
+}
+
+// Returns the value paired with the ref in the results or NULL.
+static opoVal
+find_result(opoVal results, int64_t ref) {
+    struct _opoErr	err = OPO_ERR_INIT;
+    opoVal		end = results + opo_val_bsize(results);
+    opoVal		pair = opo_val_members(&err, results);
+
+    for (; NULL != pair && pair < end; pair = opo_val_next(pair)) {
+	opoVal	r;
+
+	if (OPO_VAL_ARRAY == opo_val_type(pair) &&
+	    NULL != (r = opo_val_members(&err, pair)) && opo_val_next(r) < opo_val_next(pair) &&
+	    OPO_VAL_INT == opo_val_type(r) && ref == opo_val_int(&err, r)) {
+	    return opo_val_next(r);
+	}
+    }
+    return NULL;
+}
+
+uint8_t*
+multiget_response(opoMsg resp, int64_t ref) {
+    struct _opoErr	err = OPO_ERR_INIT;
+    opoVal		top = opo_msg_val(resp);
+    opoVal		results = opo_val_get(top, "results");
+    int64_t		code = opo_val_int(&err, opo_val_get(top, "code"));
+    uint8_t		*msg;
+
+    if (0 != code || NULL == results || OPO_VAL_ARRAY != opo_val_type(results)) {
+	// Every fetch gets the error.
+	size_t	size = opo_msg_bsize(resp);
+
+	if (NULL != (msg = slab_alloc(size))) {
+	    memcpy(msg, resp, size);
+	}
+	return msg;
+    }
+    struct _opoBuilder	builder;
+    opoVal		val = find_result(results, ref);
+
+    if (OPO_ERR_OK != opo_builder_init(&err, &builder, NULL, 64 + ((NULL == val) ? 0 : opo_val_bsize(val)))) {
+	return NULL;
+    }
+    opo_builder_push_object(&err, &builder, NULL, -1);
+    opo_builder_push_int(&err, &builder, 0, "code", 4);
+    opo_builder_push_array(&err, &builder, "results", 7);
+    if (NULL != val) {
+	opo_builder_push_val(&err, &builder, val, NULL, -1);
+    }
+    opo_builder_pop(&err, &builder);
+    if (OPO_ERR_OK != err.code) {
+	opo_builder_cleanup(&builder);
+	return NULL;
+    }
+    return (uint8_t*)opo_builder_take_pooled(&builder);
+}
@@ -0,0 +1,72 @@
+// Copyright 2017 by Peter Ohler, All Rights Reserved
+
+#ifndef __OPO_MULTIGET_H__
+#define __OPO_MULTIGET_H__
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "err.h"
+#include "val.h"
+
+// Fetches of single records gathered into one query. The query sent has the
+// id of the first fetch.
+typedef struct _Gather {
+    struct _Gather	*next; // in the id bucket or free list
+    uint64_t		id; // of the query sent
+    int			cnt;
+    uint64_t		*ids; // of the fetches
+    int64_t		*refs; // records fetched
+} *Gather;
+
+// Queries of the form {where:<ref>, select:<select>} are collected for up to
+// window seconds or until there are max of them and then sent as a single
+// {where:["IN","$ref",<refs>...], select:["$ref",<select>]} query. Each
+// result in the response is a [ref, value] pair that is handed to the
+// fetches of that ref.
+typedef struct _Multiget {
+    pthread_mutex_t	lock;
+    double		window;
+    int			max;
+    char		*select;
+    Gather		open; // collecting, NULL if none
+    double		due; // when the open gather must be sent
+    Gather		*sent; // by id
+    size_t		mask;
+    Gather		free_list;
+    atomic_ullong	batches;
+} *Multiget;
+
+extern Multiget	multiget_create(double window, int max, const char *select, size_t pending_max);
+extern void	multiget_destroy(Multiget mg);
+
+// Returns true and sets the ref if the query is a fetch that can be gathered.
+extern bool	multiget_ref(Multiget mg, opoMsg query, int64_t *refp);
+
+// Adds a fetch to the open gather and sets fullp to the gather if it is full
+// and must be sent now, otherwise to NULL. Returns false if the fetch could
+// not be added.
+extern bool	multiget_add(Multiget mg, uint64_t id, int64_t ref, double now, Gather *fullp);
+
+// Returns the open gather if it is due and must be sent now, otherwise NULL.
+extern Gather	multiget_due(Multiget mg, double now);
+
+// Returns when the open gather is due or zero if there is none.
+extern double	multiget_next(Multiget mg);
+
+// Builds the query for a gather, allocated with slab_alloc().
+extern uint8_t*	multiget_query(opoErr err, Multiget mg, Gather g);
+
+// Removes and returns the gather sent with the id, NULL if there is none.
+extern Gather	multiget_land(Multiget mg, uint64_t id);
+
+// Returns a landed gather to the free list.
+extern void	multiget_release(Multiget mg, Gather g);
+
+// Builds the response for the fetch of a ref from the response to a gather,
+// allocated with slab_alloc().
+extern uint8_t*	multiget_response(opoMsg resp, int64_t ref);
+
+#endif /* __OPO_MULTIGET_H__ */
@@ -0,0 +1,276 @@
+// Copyright 2017 by Peter Ohler, All Rights Reserved
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "builder.h"
+#include "multiput.h"
+#include "slab.h"
+
+#define MIN_INSERTS	16
+
+Multiput
+multiput_create(double window, size_t max, size_t pending_max) {
+    Multiput	mp = (Multiput)malloc(sizeof(struct _Multiput));
+    size_t	cnt = 16;
+
+    if (NULL == mp) {
+	return NULL;
+    }
+    while (cnt < pending_max) {
+	cnt *= 2;
+    }
+    if (NULL == (mp->sent = (Bundle*)calloc(cnt, sizeof(Bundle)))) {
+	free(mp);
+	return NULL;
+    }
+    pthread_mutex_init(&mp->lock, NULL);
+    mp->window = window;
+    mp->max = max;
+    mp->open = NULL;
+    mp->due = 0.0;
+    mp->mask = cnt - 1;
+    mp->free_list = NULL;
+    atomic_init(&mp->batches, 0);
+
+    return mp;
+}
+
+static void
+bundle_free(Bundle b) {
+    free(b->ids);
+    free(b->docs);
+    free(b);
+}
+
+void
+multiput_destroy(Multiput mp) {
+    Bundle	b;
+
+    if (NULL == mp) {
+	return;
+    }
+    for (size_t i = 0; i <= mp->mask; i++) {
+	while (NULL != (b = mp->sent[i])) {
+	    mp->sent[i] = b->next;
+	    bundle_free(b);
+	}
+    }
+    while (NULL != (b = mp->free_list)) {
+	mp->free_list = b->next;
+	bundle_free(b);
+    }
+    if (NULL != mp->open) {
+	bundle_free(mp->open);
+    }
+    pthread_mutex_destroy(&mp->lock);
+    free(mp->sent);
+    free(mp);
+}
+
+opoVal
+multiput_record(opoMsg query) {
+    struct _opoErr	err = OPO_ERR_INIT;
+    opoVal		top = opo_msg_val(query);
+    opoVal		record = opo_val_get(top, "insert");
+
+    if (NULL == record || OPO_VAL_OBJ != opo_val_type(record) || 1 != opo_val_member_count(&err, top)) {
+	return NULL;
+    }
+    return record;
+}
+
+// Moves the open bundle to the sent table. Called with the lock held.
+static Bundle
+take_open(Multiput mp) {
+    Bundle	b = mp->open;
+    Bundle	*bucket = mp->sent + (b->id & mp->mask);
+
+    b->next = *bucket;
+    *bucket = b;
+    mp->open = NULL;
+    atomic_fetch_add(&mp->batches, 1);
+
+    return b;
+}
+
+// Makes room for one more insert of len bytes. Called with the lock held.
+static bool
+bundle_grow(Bundle b, size_t len) {
+    if (b->cap <= b->cnt) {
+	int		cap = (0 == b->cap) ? MIN_INSERTS : b->cap * 2;
+	uint64_t	*ids = (uint64_t*)realloc(b->ids, sizeof(uint64_t) * cap);
+
+	if (NULL == ids) {
+	    return false;
+	}
+	b->ids = ids;
+	b->cap = cap;
+    }
+    if (b->size < b->len + len) {
+	size_t	size = (0 == b->size) ? 4096 : b->size * 2;
+	uint8_t	*docs;
+
+	for (; size < b->len + len; size *= 2) {
+	}
+	if (NULL == (docs = (uint8_t*)realloc(b->docs, size))) {
+	    return false;
+	}
+	b->docs = docs;
+	b->size = size;
+    }
+    return true;
+}
+
+bool
+multiput_add(Multiput mp, uint64_t id, opoVal record, double now, Bundle *fullp) {
+    size_t	len = opo_val_bsize(record);
+    Bundle	b;
+
+    pthread_mutex_lock(&mp->lock);
+    if (NULL == (b = mp->open)) {
+	if (NULL != (b = mp->free_list)) {
+	    mp->free_list = b->next;
+	} else if (NULL == (b = (Bundle)calloc(1, sizeof(struct _Bundle)))) {
+	    pthread_mutex_unlock(&mp->lock);
+	    return false;
+	}
+	b->id = id;
+	b->cnt = 0;
+	b->len = 0;
+	mp->open = b;
+	mp->due = now + mp->window;
+    }
+    if (!bundle_grow(b, len)) {
+	if (0 == b->cnt) {
+	    mp->open = NULL;
+	    b->next = mp->free_list;
+	    mp->free_list = b;
+	}
+	pthread_mutex_unlock(&mp->lock);
+	return false;
+    }
+    b->ids[b->cnt++] = id;
+    memcpy(b->docs + b->len, record, len);
+    b->len += len;
+    *fullp = (mp->max <= b->len) ? take_open(mp) : NULL;
+    pthread_mutex_unlock(&mp->lock);
+
+    return true;
+}
+
+Bundle
+multiput_due(Multiput mp, double now, bool force) {
+    Bundle	b = NULL;
+
+    pthread_mutex_lock(&mp->lock);
+    if (NULL != mp->open && (force || mp->due <= now)) {
+	b = take_open(mp);
+    }
+    pthread_mutex_unlock(&mp->lock);
+
+    return b;
+}
+
+double
+multiput_next(Multiput mp) {
+    double	due = 0.0;
+
+    pthread_mutex_lock(&mp->lock);
+    if (NULL != mp->open) {
+	due = mp->due;
+    }
+    pthread_mutex_unlock(&mp->lock);
+
+    return due;
+}
+
+uint8_t*
+multiput_query(opoErr err, Bundle b) {
+    struct _opoBuilder	builder;
+
+    if (OPO_ERR_OK != opo_builder_init(err, &builder, NULL, 64 + b->len)) {
+	return NULL;
+    }
+    opo_builder_push_object(err, &builder, NULL, -1);
+    opo_builder_push_array(err, &builder, "insert", 6);
+    for (opoVal rec = b->docs; rec < b->docs + b->len; rec = opo_val_next(rec)) {
+	opo_builder_push_val(err, &builder, rec, NULL, -1);
+    }
+    opo_builder_pop(err, &builder);
+    if (OPO_ERR_OK != err->code) {
+	opo_builder_cleanup(&builder);
+	return NULL;
+    }
+    uint8_t	*query = (uint8_t*)opo_builder_take_pooled(&builder);
+
+    opo_msg_set_id(query, b->id);
+
+    return query;
+}
+
+Bundle
+multiput_land(Multiput mp, uint64_t id) {
+    Bundle	*bp;
+    Bundle	b;
+
+    pthread_mutex_lock(&mp->lock);
+    for (bp = mp->sent + (id & mp->mask); NULL != (b = *bp) && b->id != id; bp = &b->next) {
+    }
+    if (NULL != b) {
+	*bp = b->next;
+    }
+    pthread_mutex_unlock(&mp->lock);
+
+    return b;
+}
+
+void
+multiput_release(Multiput mp, Bundle b) {
+    pthread_mutex_lock(&mp->lock);
+    b->next = mp->free_list;
+    mp->free_list = b;
+    pthread_mutex_unlock(&mp->lock);
+}
+
+opoVal
+multiput_refs(opoMsg resp, opoVal *endp) {
+    struct _opoErr	err = OPO_ERR_INIT;
+    opoVal		top = opo_msg_val(resp);
+    opoVal		refs = opo_val_get(top, "refs");
+
+    if (0 != opo_val_int(&err, opo_val_get(top, "code")) || NULL == refs || OPO_VAL_ARRAY != opo_val_type(refs)) {
+	return NULL;
+    }
+    *endp = opo_val_next(refs);
+
+    return opo_val_members(&err, refs);
+}
+
+uint8_t*
+multiput_response(opoMsg resp, opoVal ref) {
+    struct _opoErr	err = OPO_ERR_INIT;
+    uint8_t		*msg;
+
+    if (NULL == ref) {
+	size_t	size = opo_msg_bsize(resp);
+
+	if (NULL != (msg = slab_alloc(size))) {
+	    memcpy(msg, resp, size);
+	}
+	return msg;
+    }
+    struct _opoBuilder	builder;
+
+    if (OPO_ERR_OK != opo_builder_init(&err, &builder, NULL, 64)) {
+	return NULL;
+    }
+    opo_builder_push_object(&err, &builder, NULL, -1);
+    opo_builder_push_int(&err, &builder, 0, "code", 4);
+    opo_builder_push_val(&err, &builder, ref, "ref", 3);
+    if (OPO_ERR_OK != err.code) {
+	opo_builder_cleanup(&builder);
+	return NULL;
+    }
+    return (uint8_t*)opo_builder_take_pooled(&builder);
+}
@@ -0,0 +1,80 @@
+// Copyright 2017 by Peter Ohler, All Rights Reserved
+
+#ifndef __OPO_MULTIPUT_H__
+#define __OPO_MULTIPUT_H__
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "err.h"
+#include "val.h"
+
+// Inserts bundled into one query. The query sent has the id of the first
+// insert.
+typedef struct _Bundle {
+    struct _Bundle	*next; // in the id bucket or free list
+    uint64_t		id; // of the query sent
+    int			cnt;
+    int			cap;
+    uint64_t		*ids; // of the inserts
+    uint8_t		*docs; // inserted values back to back
+    size_t		len;
+    size_t		size;
+} *Bundle;
+
+// Queries of the form {insert:<record>} are collected for up to window
+// seconds or until the records add up to max bytes and then sent as a single
+// {insert:[<records>...]} query. The refs array in the response is in the
+// same order as the records and each is handed to the insert it belongs to.
+typedef struct _Multiput {
+    pthread_mutex_t	lock;
+    double		window;
+    size_t		max;
+    Bundle		open; // collecting, NULL if none
+    double		due; // when the open bundle must be sent
+    Bundle		*sent; // by id
+    size_t		mask;
+    Bundle		free_list;
+    atomic_ullong	batches;
+} *Multiput;
+
+extern Multiput	multiput_create(double window, size_t max, size_t pending_max);
+extern void	multiput_destroy(Multiput mp);
+
+// Returns the record if the query is an insert that can be bundled,
+// otherwise NULL.
+extern opoVal	multiput_record(opoMsg query);
+
+// Adds an insert to the open bundle and sets fullp to the bundle if it is
+// full and must be sent now, otherwise to NULL. Returns false if the insert
+// could not be added.
+extern bool	multiput_add(Multiput mp, uint64_t id, opoVal record, double now, Bundle *fullp);
+
+// Returns the open bundle if it is due, or if force is true and there is
+// one, so it can be sent now, otherwise NULL.
+extern Bundle	multiput_due(Multiput mp, double now, bool force);
+
+// Returns when the open bundle is due or zero if there is none.
+extern double	multiput_next(Multiput mp);
+
+// Builds the query for a bundle, allocated with slab_alloc().
+extern uint8_t*	multiput_query(opoErr err, Bundle b);
+
+// Removes and returns the bundle sent with the id, NULL if there is none.
+extern Bundle	multiput_land(Multiput mp, uint64_t id);
+
+// Returns a landed bundle to the free list.
+extern void	multiput_release(Multiput mp, Bundle b);
+
+// Returns the first of the refs in the response to a bundle and sets endp
+// to the end of them, or returns NULL if the bundle failed.
+extern opoVal	multiput_refs(opoMsg resp, opoVal *endp);
+
+// Builds the response for an insert with the ref it was given, allocated
+// with slab_alloc(). Without a ref the response is a copy of the one to the
+// bundle.
+extern uint8_t*	multiput_response(opoMsg resp, opoVal ref);
+
+#endif /* __OPO_MULTIPUT_H__ */
@@ -14,6 +14,10 @@ extern "C" {
 
 #include "client.h"
 #include "builder.h"
+#include "cluster.h"
+#include "future.h"
+#include "pool.h"
+#include "replica.h"
 #include "val.h"
 
     extern opoMsg	opo_ojc_to_msg(opoErr err, ojcVal val);
@@ -0,0 +1,109 @@
+// Copyright 2017 by Peter Ohler, All Rights Reserved
+
+#include <limits.h>
+#include <math.h>
+#include <sched.h>
+#include <time.h>
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#include "park.h"
+
+// A zero spin selects the default and a negative spin blocks right away.
+void
+park_init(Park p, int spin) {
+    atomic_init(&p->seq, 0);
+    atomic_init(&p->waiters, 0);
+    if (0 == spin) {
+	spin = PARK_SPIN_DEFAULT;
+    } else if (spin < 0) {
+	spin = 0;
+    }
+    p->spin = spin;
+#ifndef __linux__
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->cond, NULL);
+#endif
+}
+
+void
+park_cleanup(Park p) {
+#ifndef __linux__
+    pthread_cond_destroy(&p->cond);
+    pthread_mutex_destroy(&p->lock);
+#endif
+}
+
+// Returns true and yields if the caller should check again before
+// blocking.
+bool
+park_spin(Park p, int *spins) {
+    if (p->spin <= *spins) {
+	return false;
+    }
+    (*spins)++;
+    sched_yield();
+
+    return true;
+}
+
+unsigned int
+park_prepare(Park p) {
+    atomic_fetch_add(&p->waiters, 1);
+
+    return atomic_load(&p->seq);
+}
+
+void
+park_done(Park p) {
+    atomic_fetch_sub(&p->waiters, 1);
+}
+
+// Blocks until woken, the timeout in seconds expires, or a wake has already
+// happened since the key was taken. Spurious returns are possible so the
+// caller must check again.
+void
+park_wait(Park p, unsigned int key, double timeout) {
+    if (0.0 >= timeout) {
+	return;
+    }
+#ifdef __linux__
+    struct timespec	ts;
+
+    ts.tv_sec = (time_t)timeout;
+    ts.tv_nsec = (long)((timeout - floor(timeout)) * 1000000000.0);
+    syscall(SYS_futex, &p->seq, FUTEX_WAIT_PRIVATE, key, &ts, NULL, 0);
+#else
+    struct timespec	ts;
+    double		end;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    end = (double)ts.tv_sec + (double)ts.tv_nsec / 1000000000.0 + timeout;
+    ts.tv_sec = (time_t)end;
+    ts.tv_nsec = (long)((end - floor(end)) * 1000000000.0);
+    pthread_mutex_lock(&p->lock);
+    if (key == atomic_load(&p->seq)) {
+	pthread_cond_timedwait(&p->cond, &p->lock, &ts);
+    }
+    pthread_mutex_unlock(&p->lock);
+#endif
+}
+
+// Cheap when no one is waiting, just an atomic load.
+void
+park_wake(Park p) {
+    if (0 >= atomic_load(&p->waiters)) {
+	return;
+    }
+    atomic_fetch_add(&p->seq, 1);
+#ifdef __linux__
+    syscall(SYS_futex, &p->seq, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+#else
+    pthread_mutex_lock(&p->lock);
+    pthread_cond_broadcast(&p->cond);
+    pthread_mutex_unlock(&p->lock);
+#endif
+}
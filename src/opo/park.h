@@ -0,0 +1,44 @@
+// Copyright 2017 by Peter Ohler, All Rights Reserved
+
+#ifndef __OPO_PARK_H__
+#define __OPO_PARK_H__
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#ifndef __linux__
+#include <pthread.h>
+#endif
+
+#define PARK_SPIN_DEFAULT	64
+
+// A place for threads to block until another thread has something for
+// them. It is an event count so a waker never has to take a lock and a wake
+// that happens between checking for work and blocking is not lost. The
+// expected use is:
+//
+//   key = park_prepare(p);
+//   if (nothing to do) {
+//       park_wait(p, key, timeout);
+//   }
+//   park_done(p);
+//
+// On Linux a futex is used. Elsewhere a mutex and condition variable.
+typedef struct _Park {
+    atomic_uint		seq;
+    atomic_int		waiters;
+    int			spin; // checks before blocking
+#ifndef __linux__
+    pthread_mutex_t	lock;
+    pthread_cond_t	cond;
+#endif
+} *Park;
+
+extern void		park_init(Park p, int spin);
+extern void		park_cleanup(Park p);
+extern bool		park_spin(Park p, int *spins);
+extern unsigned int	park_prepare(Park p);
+extern void		park_wait(Park p, unsigned int key, double timeout);
+extern void		park_done(Park p);
+extern void		park_wake(Park p);
+
+#endif /* __OPO_PARK_H__ */
@@ -0,0 +1,134 @@
+// Copyright 2017 by Peter Ohler, All Rights Reserved
+
+#include <stdatomic.h>
+#include <stdlib.h>
+
+#include "client_int.h"
+#include "park.h"
+#include "pool.h"
+
+struct _opoPool {
+    opoClient		*clients;
+    int			cnt;
+    bool		affinity;
+    atomic_uint		next; // rotates the start of the least pending scan
+    struct _Park	ready; // woken by any of the clients
+};
+
+// Threads are given slots round robin the first time they query a pool with
+// affinity. The slot modulo the pool size picks the connection.
+static atomic_uint		affinity_cnt = 0;
+static _Thread_local int	affinity_slot = -1;
+
+opoPool
+opo_pool_connect(opoErr err, const char *host, int port, int n, opoClientOptions options) {
+    opoPool	pool;
+
+    if (n < 1) {
+	opo_err_set(err, OPO_ERR_ARG, "a pool must have at least one connection");
+	return NULL;
+    }
+    if (NULL == (pool = (opoPool)malloc(sizeof(struct _opoPool))) ||
+	NULL == (pool->clients = (opoClient*)calloc(n, sizeof(opoClient)))) {
+	free(pool);
+	opo_err_set(err, OPO_ERR_MEMORY, "failed to allocate memory for a opoPool.");
+	return NULL;
+    }
+    pool->cnt = 0;
+    pool->affinity = false;
+    atomic_init(&pool->next, 0);
+    park_init(&pool->ready, (NULL == options) ? 0 : options->spin);
+    for (; pool->cnt < n; pool->cnt++) {
+	opoClient	client = opo_client_connect(err, host, port, options);
+
+	if (NULL == client) {
+	    break;
+	}
+	client_set_notify(client, &pool->ready);
+	pool->clients[pool->cnt] = client;
+	if (OPO_ERR_OK != err->code) {
+	    pool->cnt++;
+	    break;
+	}
+    }
+    if (OPO_ERR_OK != err->code) {
+	opo_pool_close(pool);
+	return NULL;
+    }
+    return pool;
+}
+
+void
+opo_pool_close(opoPool pool) {
+    for (int i = 0; i < pool->cnt; i++) {
+	opo_client_close(pool->clients[i]);
+    }
+    park_cleanup(&pool->ready);
+    free(pool->clients);
+    free(pool);
+}
+
+// Must be set before queries are made.
+void
+opo_pool_set_affinity(opoPool pool, bool on) {
+    pool->affinity = on;
+}
+
+static opoClient
+pick_client(opoPool pool) {
+    if (pool->affinity) {
+	if (affinity_slot < 0) {
+	    affinity_slot = (int)(atomic_fetch_add(&affinity_cnt, 1) & 0x7fffffff);
+	}
+	return pool->clients[affinity_slot % pool->cnt];
+    }
+    // Starting at a different connection each time spreads the queries
+    // when the pending counts are equal.
+    int		start = (int)(atomic_fetch_add(&pool->next, 1) % pool->cnt);
+    opoClient	best = pool->clients[start];
+    int		least = opo_client_pending_count(best);
+
+    for (int i = 1; 0 < least && i < pool->cnt; i++) {
+	opoClient	client = pool->clients[(start + i) % pool->cnt];
+	int		pending = opo_client_pending_count(client);
+
+	if (pending < least) {
+	    best = client;
+	    least = pending;
+	}
+    }
+    return best;
+}
+
+opoRef
+opo_pool_query(opoErr err, opoPool pool, opoVal query, opoQueryCallback cb, void *ctx) {
+    return opo_client_query(err, pick_client(pool), query, cb, ctx);
+}
+
+int
+opo_pool_process(opoPool pool, int max, double wait) {
+    return client_group_process(pool->clients, pool->cnt, &pool->ready, max, wait);
+}
+
+int
+opo_pool_pending_count(opoPool pool) {
+    int	cnt = 0;
+
+    for (int i = 0; i < pool->cnt; i++) {
+	cnt += opo_client_pending_count(pool->clients[i]);
+    }
+    return cnt;
+}
+
+int
+opo_pool_size(opoPool pool) {
+    return pool->cnt;
+}
+
+opoClient
+opo_pool_client(opoPool pool, int i) {
+    if (i < 0 || pool->cnt <= i) {
+	return NULL;
+    }
+    return pool->clients[i];
+}
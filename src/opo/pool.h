@@ -0,0 +1,28 @@
+// Copyright 2017 by Peter Ohler, All Rights Reserved
+
+#ifndef __OPOC_POOL_H__
+#define __OPOC_POOL_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdbool.h>
+
+#include "client.h"
+
+    typedef struct _opoPool	*opoPool;
+
+    extern opoPool	opo_pool_connect(opoErr err, const char *host, int port, int n, opoClientOptions options);
+    extern void		opo_pool_close(opoPool pool);
+    extern void		opo_pool_set_affinity(opoPool pool, bool on);
+    extern opoRef	opo_pool_query(opoErr err, opoPool pool, opoVal query, opoQueryCallback cb, void *ctx);
+    extern int		opo_pool_process(opoPool pool, int max, double wait);
+    extern int		opo_pool_pending_count(opoPool pool);
+    extern int		opo_pool_size(opoPool pool);
+    extern opoClient	opo_pool_client(opoPool pool, int i);
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* __OPOC_POOL_H__ */
@@ -0,0 +1,361 @@
+// Copyright 2017 by Peter Ohler, All Rights Reserved
+
+#include <errno.h>
+#include <float.h>
+#include <math.h>
+#include <poll.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#endif
+
+#include "dtime.h"
+#include "reactor.h"
+
+#define MAX_EVENTS	64
+
+// Each loop has its own epoll set and thread. Watches are spread across the
+// loops round robin.
+typedef struct _Loop {
+    int			epfd;
+    int			wake_fd;
+    pthread_t		thread;
+    bool		started;
+    atomic_ullong	epoch; // incremented after each batch of events
+    _Atomic double	due; // earliest wake asked for, DBL_MAX if none
+    opoReactor		reactor;
+    // Recursive so a handler called for a tick can remove its own watch.
+    pthread_mutex_t	lock;
+    Watch		watches;
+    // A handler may remove any watch on its own loop so removal moves the
+    // tick cursor past the watch and clears it from the events not yet
+    // dispatched. Both are only used on the loop thread.
+    Watch		cursor;
+    struct epoll_event	*ev_next;
+    struct epoll_event	*ev_end;
+} *Loop;
+
+struct _opoReactor {
+    struct _Loop	*loops;
+    int			cnt;
+    atomic_uint		next;
+    volatile bool	active;
+};
+
+#ifdef __linux__
+
+static void
+wake_loop(Loop loop) {
+    uint64_t	one = 1;
+
+    if (write(loop->wake_fd, &one, sizeof(one))) {}
+}
+
+static void
+tick(Loop loop) {
+    pthread_mutex_lock(&loop->lock);
+    for (Watch w = loop->watches; NULL != w; w = loop->cursor) {
+	loop->cursor = w->next;
+	w->handler(w->ctx, 0);
+    }
+    loop->cursor = NULL;
+    pthread_mutex_unlock(&loop->lock);
+}
+
+static void*
+loop_run(void *ctx) {
+    Loop		loop = (Loop)ctx;
+    struct epoll_event	events[MAX_EVENTS];
+    struct epoll_event	*ev;
+    int			cnt;
+    double		next_tick = dtime() + REACTOR_TICK;
+    double		now;
+    double		wake;
+
+    while (loop->reactor->active) {
+	now = dtime();
+	if (next_tick <= now || atomic_load(&loop->due) <= now) {
+	    // Cleared first so a handler can ask again during the tick.
+	    atomic_store(&loop->due, DBL_MAX);
+	    tick(loop);
+	    next_tick = now + REACTOR_TICK;
+	}
+	if ((wake = atomic_load(&loop->due)) > next_tick) {
+	    wake = next_tick;
+	}
+	wake -= now;
+	// Rounded up so the wake is never early. A wake that is already due
+	// only polls.
+	if (0 > (cnt = epoll_wait(loop->epfd, events, MAX_EVENTS, (0.0 < wake) ? (int)ceil(wake * 1000.0) : 0))) {
+	    if (EINTR == errno) {
+		continue;
+	    }
+	    break;
+	}
+	loop->ev_next = events;
+	loop->ev_end = events + cnt;
+	while (loop->ev_next < loop->ev_end) {
+	    ev = loop->ev_next++;
+	    if (NULL == ev->data.ptr) {
+		uint64_t	buf;
+
+		if (read(loop->wake_fd, &buf, sizeof(buf))) {}
+		continue;
+	    }
+	    if ((void*)loop == ev->data.ptr) { // watch removed by a handler
+		continue;
+	    }
+	    Watch	w = (Watch)ev->data.ptr;
+	    short	pe = 0;
+
+	    if (0 != (ev->events & EPOLLIN)) {
+		pe |= POLLIN;
+	    }
+	    if (0 != (ev->events & EPOLLOUT)) {
+		pe |= POLLOUT;
+	    }
+	    if (0 != (ev->events & EPOLLERR)) {
+		pe |= POLLERR;
+	    }
+	    if (0 != (ev->events & (EPOLLHUP | EPOLLRDHUP))) {
+		pe |= POLLHUP;
+	    }
+	    w->handler(w->ctx, pe);
+	}
+	loop->ev_next = NULL;
+	loop->ev_end = NULL;
+	atomic_fetch_add(&loop->epoch, 1);
+    }
+    return NULL;
+}
+
+opoReactor
+opo_reactor_create(opoErr err, int thread_cnt) {
+    opoReactor	reactor = (opoReactor)malloc(sizeof(struct _opoReactor));
+
+    if (NULL == reactor) {
+	opo_err_set(err, OPO_ERR_MEMORY, "failed to allocate memory for a opoReactor.");
+	return NULL;
+    }
+    if (thread_cnt < 1) {
+	thread_cnt = 1;
+    }
+    if (NULL == (reactor->loops = (Loop)calloc(thread_cnt, sizeof(struct _Loop)))) {
+	free(reactor);
+	opo_err_set(err, OPO_ERR_MEMORY, "failed to allocate memory for a opoReactor.");
+	return NULL;
+    }
+    reactor->cnt = thread_cnt;
+    reactor->active = true;
+    atomic_init(&reactor->next, 0);
+    for (int i = 0; i < thread_cnt; i++) {
+	Loop			loop = reactor->loops + i;
+	struct epoll_event	ev;
+	int			stat;
+
+	loop->reactor = reactor;
+	atomic_init(&loop->epoch, 0);
+	atomic_init(&loop->due, DBL_MAX);
+
+	pthread_mutexattr_t	attr;
+
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+	pthread_mutex_init(&loop->lock, &attr);
+	pthread_mutexattr_destroy(&attr);
+	loop->watches = NULL;
+	if (0 > (loop->epfd = epoll_create1(EPOLL_CLOEXEC)) ||
+	    0 > (loop->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC))) {
+	    opo_err_no(err, "failed to create reactor event set");
+	    opo_reactor_destroy(reactor);
+	    return NULL;
+	}
+	ev.events = EPOLLIN;
+	ev.data.ptr = NULL;
+	epoll_ctl(loop->epfd, EPOLL_CTL_ADD, loop->wake_fd, &ev);
+	if (0 != (stat = pthread_create(&loop->thread, NULL, loop_run, loop))) {
+	    opo_err_set(err, OPO_ERR_THREAD, "failed create reactor thread. %s", strerror(stat));
+	    opo_reactor_destroy(reactor);
+	    return NULL;
+	}
+	loop->started = true;
+    }
+    return reactor;
+}
+
+void
+opo_reactor_destroy(opoReactor reactor) {
+    Loop	loop;
+
+    reactor->active = false;
+    for (loop = reactor->loops; loop < reactor->loops + reactor->cnt; loop++) {
+	if (loop->started) {
+	    wake_loop(loop);
+	    pthread_join(loop->thread, NULL);
+	}
+	if (0 < loop->wake_fd) {
+	    close(loop->wake_fd);
+	}
+	if (0 < loop->epfd) {
+	    close(loop->epfd);
+	}
+	if (NULL != loop->reactor) {
+	    pthread_mutex_destroy(&loop->lock);
+	}
+    }
+    free(reactor->loops);
+    free(reactor);
+}
+
+opoErrCode
+reactor_add(opoErr err, opoReactor reactor, Watch w, int fd, WatchHandler handler, void *ctx) {
+    Loop		loop = reactor->loops + (atomic_fetch_add(&reactor->next, 1) % reactor->cnt);
+    struct epoll_event	ev;
+
+    w->fd = fd;
+    w->handler = handler;
+    w->ctx = ctx;
+    w->writing = false;
+    atomic_flag_clear(&w->mod_lock);
+    atomic_init(&w->loop, loop);
+
+    ev.events = EPOLLIN | EPOLLRDHUP;
+    ev.data.ptr = w;
+    pthread_mutex_lock(&loop->lock);
+    w->prev = NULL;
+    if (NULL != (w->next = loop->watches)) {
+	w->next->prev = w;
+    }
+    loop->watches = w;
+    pthread_mutex_unlock(&loop->lock);
+    if (0 > epoll_ctl(loop->epfd, EPOLL_CTL_ADD, fd, &ev)) {
+	reactor_remove(w);
+	return opo_err_no(err, "failed to add connection to reactor");
+    }
+    return OPO_ERR_OK;
+}
+
+// Once this returns the handler will not be called again for the watch. If
+// called from a thread other than the one serving the watch it waits for
+// the batch of events in progress to finish as that batch may still hold
+// the watch. If called from a handler on the serving thread the watch is
+// skipped for the rest of the tick or batch instead.
+void
+reactor_remove(Watch w) {
+    Loop		loop = atomic_exchange(&w->loop, NULL);
+    unsigned long long	epoch;
+
+    if (NULL == loop) {
+	return;
+    }
+    epoll_ctl(loop->epfd, EPOLL_CTL_DEL, w->fd, NULL);
+    pthread_mutex_lock(&loop->lock);
+    if (NULL == w->prev) {
+	loop->watches = w->next;
+    } else {
+	w->prev->next = w->next;
+    }
+    if (NULL != w->next) {
+	w->next->prev = w->prev;
+    }
+    if (loop->cursor == w) {
+	loop->cursor = w->next;
+    }
+    pthread_mutex_unlock(&loop->lock);
+    if (pthread_equal(loop->thread, pthread_self())) {
+	// Called from a handler so the watch may be later in the batch of
+	// events being dispatched.
+	for (struct epoll_event *ev = loop->ev_next; ev < loop->ev_end; ev++) {
+	    if (w == ev->data.ptr) {
+		ev->data.ptr = loop;
+	    }
+	}
+	return;
+    }
+    epoch = atomic_load(&loop->epoch);
+    wake_loop(loop);
+    while (loop->reactor->active && epoch == atomic_load(&loop->epoch)) {
+	sched_yield();
+    }
+}
+
+void
+reactor_want_write(Watch w, bool on) {
+    Loop	loop = atomic_load(&w->loop);
+
+    if (NULL == loop) {
+	return;
+    }
+    while (atomic_flag_test_and_set(&w->mod_lock)) {
+	sched_yield();
+    }
+    if (w->writing != on) {
+	struct epoll_event	ev;
+
+	ev.events = EPOLLIN | EPOLLRDHUP;
+	if (on) {
+	    ev.events |= EPOLLOUT;
+	}
+	ev.data.ptr = w;
+	epoll_ctl(loop->epfd, EPOLL_CTL_MOD, w->fd, &ev);
+	w->writing = on;
+    }
+    atomic_flag_clear(&w->mod_lock);
+}
+
+void
+reactor_wake_at(Watch w, double when) {
+    Loop	loop = atomic_load(&w->loop);
+    double	due;
+
+    if (NULL == loop) {
+	return;
+    }
+    due = atomic_load(&loop->due);
+    while (when < due) {
+	if (atomic_compare_exchange_weak(&loop->due, &due, when)) {
+	    // The loop thread looks at the due time before waiting again.
+	    if (!pthread_equal(loop->thread, pthread_self())) {
+		wake_loop(loop);
+	    }
+	    break;
+	}
+    }
+}
+
+#else
+
+opoReactor
+opo_reactor_create(opoErr err, int thread_cnt) {
+    opo_err_set(err, OPO_ERR_IMPL, "reactors require epoll");
+
+    return NULL;
+}
+
+void
+opo_reactor_destroy(opoReactor reactor) {
+}
+
+opoErrCode
+reactor_add(opoErr err, opoReactor reactor, Watch w, int fd, WatchHandler handler, void *ctx) {
+    return opo_err_set(err, OPO_ERR_IMPL, "reactors require epoll");
+}
+
+void
+reactor_remove(Watch w) {
+}
+
+void
+reactor_want_write(Watch w, bool on) {
+}
+
+void
+reactor_wake_at(Watch w, double when) {
+}
+
+#endif
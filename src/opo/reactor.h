@@ -0,0 +1,44 @@
+// Copyright 2017 by Peter Ohler, All Rights Reserved
+
+#ifndef __OPO_REACTOR_H__
+#define __OPO_REACTOR_H__
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+
+#include "client.h"
+#include "err.h"
+
+#define REACTOR_TICK	0.1
+
+// The handler is called on a reactor thread with poll style events
+// (POLLIN, POLLOUT, POLLERR, and POLLHUP). It is also called with no events
+// every REACTOR_TICK seconds, or sooner if asked with reactor_wake_at(), so
+// the owner can check timers.
+typedef void	(*WatchHandler)(void *ctx, short events);
+
+// A file descriptor registered with a reactor. Each watch is served by one
+// of the reactor threads for as long as it is registered.
+typedef struct _Watch {
+    int				fd;
+    WatchHandler		handler;
+    void			*ctx;
+    _Atomic(struct _Loop*)	loop;
+    atomic_flag			mod_lock;
+    bool			writing;
+    struct _Watch		*next; // in the loop's list of watches
+    struct _Watch		*prev;
+} *Watch;
+
+extern opoErrCode	reactor_add(opoErr err, opoReactor reactor, Watch w, int fd, WatchHandler handler, void *ctx);
+extern void		reactor_remove(Watch w);
+extern void		reactor_want_write(Watch w, bool on);
+
+// Asks for the handlers on the watch's loop to be called with no events at
+// the time given, a dtime() value, if that is before the next call already
+// planned. Requests are forgotten once the handlers are called so handlers
+// ask again for whatever is still ahead.
+extern void		reactor_wake_at(Watch w, double when);
+
+#endif /* __OPO_REACTOR_H__ */
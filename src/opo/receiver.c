@@ -0,0 +1,259 @@
+// Copyright 2017 by Peter Ohler, All Rights Reserved
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#include "receiver.h"
+#include "slab.h"
+
+#define MIN_RECV_SIZE	4096
+#define MIN_SPANS	64
+
+// head, read, and tail only move forward and are only changed by the
+// receiving thread. The bytes from head to read are delivered messages, some
+// of which may have been released. The bytes from read to tail are the start
+// of the next message.
+
+void
+receiver_init(Receiver r, size_t size) {
+    if (size < MIN_RECV_SIZE) {
+	size = MIN_RECV_SIZE;
+    }
+    r->buf = (uint8_t*)malloc(size);
+    r->size = size;
+    r->head = 0;
+    r->tail = 0;
+    r->read = 0;
+
+    // A message is at least 13 bytes but most are larger.
+    r->span_cap = size / 32;
+    if (r->span_cap < MIN_SPANS) {
+	r->span_cap = MIN_SPANS;
+    }
+    r->spans = (Span)calloc(r->span_cap, sizeof(struct _Span));
+    atomic_init(&r->span_head, 0);
+    atomic_init(&r->span_tail, 0);
+
+    r->spilling = false;
+    r->hcnt = 0;
+    r->big = NULL;
+    r->bsize = 0;
+    r->bcnt = 0;
+}
+
+void
+receiver_cleanup(Receiver r) {
+    slab_free(r->big);
+    r->big = NULL;
+    free(r->spans);
+    r->spans = NULL;
+    free(r->buf);
+    r->buf = NULL;
+}
+
+static void
+ring_copy(Receiver r, uint8_t *dest, size_t pos, size_t len) {
+    size_t	start = pos % r->size;
+
+    if (r->size < start + len) {
+	size_t	first = r->size - start;
+
+	memcpy(dest, r->buf + start, first);
+	memcpy(dest + first, r->buf, len - first);
+    } else {
+	memcpy(dest, r->buf + start, len);
+    }
+}
+
+// Moves head past all the released messages at the front of the ring.
+static void
+reclaim(Receiver r) {
+    size_t	sh = atomic_load(&r->span_head);
+    size_t	st = atomic_load(&r->span_tail);
+
+    for (; sh < st; sh++) {
+	if (NULL != atomic_load(&r->spans[sh % r->span_cap].msg)) {
+	    break;
+	}
+    }
+    atomic_store(&r->span_head, sh);
+    if (sh < st) {
+	r->head = r->spans[sh % r->span_cap].start;
+    } else {
+	r->head = r->read;
+    }
+}
+
+// Moves the partial message at read out of the ring and onto the heap.
+static bool
+spill(Receiver r) {
+    size_t	avail = r->tail - r->read;
+
+    if (avail < MSG_HEAD_SIZE) {
+	ring_copy(r, r->hdr, r->read, avail);
+	r->hcnt = avail;
+    } else {
+	ring_copy(r, r->hdr, r->read, MSG_HEAD_SIZE);
+
+	size_t	msize = opo_msg_bsize(r->hdr);
+
+	if (NULL == (r->big = slab_alloc(msize))) {
+	    return false;
+	}
+	if (msize < avail) {
+	    avail = msize;
+	}
+	ring_copy(r, r->big, r->read, avail);
+	r->hcnt = MSG_HEAD_SIZE;
+	r->bsize = msize;
+	r->bcnt = avail;
+    }
+    r->read += avail;
+    r->spilling = true;
+
+    return true;
+}
+
+ssize_t
+receiver_recv(Receiver r, int sock) {
+    ssize_t	cnt;
+
+    if (r->spilling) {
+	if (NULL == r->big) {
+	    if (0 < (cnt = recv(sock, r->hdr + r->hcnt, MSG_HEAD_SIZE - r->hcnt, 0))) {
+		r->hcnt += cnt;
+	    }
+	} else if (0 < (cnt = recv(sock, r->big + r->bcnt, r->bsize - r->bcnt, 0))) {
+	    r->bcnt += cnt;
+	}
+	return cnt;
+    }
+    reclaim(r);
+
+    size_t	space = r->size - (r->tail - r->head);
+    size_t	start = r->tail % r->size;
+
+    if (0 == space) {
+	// Full of messages that have not been released yet so read the next
+	// message into the heap instead of waiting.
+	if (!spill(r)) {
+	    errno = ENOMEM;
+	    return -1;
+	}
+	if (NULL != r->big && r->bsize <= r->bcnt) { // already complete
+	    errno = EAGAIN;
+	    return -1;
+	}
+	return receiver_recv(r, sock);
+    }
+    if (r->size - start < space) {
+	space = r->size - start;
+    }
+    if (0 < (cnt = recv(sock, r->buf + start, space, 0))) {
+	r->tail += cnt;
+    }
+    return cnt;
+}
+
+opoMsg
+receiver_next(opoErr err, Receiver r) {
+    uint8_t	*msg;
+
+    if (r->spilling) {
+	if (NULL == r->big) {
+	    if (r->hcnt < MSG_HEAD_SIZE) {
+		return NULL;
+	    }
+	    r->bsize = opo_msg_bsize(r->hdr);
+	    if (NULL == (r->big = slab_alloc(r->bsize))) {
+		opo_err_set(err, OPO_ERR_MEMORY, "failed to allocate memory for message of size %lu.", (unsigned long)r->bsize);
+		return NULL;
+	    }
+	    memcpy(r->big, r->hdr, MSG_HEAD_SIZE);
+	    r->bcnt = MSG_HEAD_SIZE;
+	}
+	if (r->bcnt < r->bsize) {
+	    return NULL;
+	}
+	msg = r->big;
+	r->big = NULL;
+	r->hcnt = 0;
+	r->spilling = false;
+
+	return msg;
+    }
+    size_t	avail = r->tail - r->read;
+    size_t	start = r->read % r->size;
+    size_t	msize;
+
+    if (avail < MSG_HEAD_SIZE) {
+	return NULL;
+    }
+    if (r->size - start < MSG_HEAD_SIZE) {
+	ring_copy(r, r->hdr, r->read, MSG_HEAD_SIZE);
+	msize = opo_msg_bsize(r->hdr);
+    } else {
+	msize = opo_msg_bsize(r->buf + start);
+    }
+    if (r->size < start + msize) {
+	// Wraps around the end of the ring or is larger than the ring.
+	if (!spill(r)) {
+	    opo_err_set(err, OPO_ERR_MEMORY, "failed to allocate memory for message of size %lu.", (unsigned long)msize);
+	    return NULL;
+	}
+	return receiver_next(err, r);
+    }
+    if (avail < msize) {
+	return NULL;
+    }
+    size_t	st = atomic_load(&r->span_tail);
+
+    msg = r->buf + start;
+    if (r->span_cap <= st - atomic_load(&r->span_head)) {
+	reclaim(r);
+	if (r->span_cap <= st - atomic_load(&r->span_head)) {
+	    // Too many messages still held so fall back to a copy.
+	    if (NULL == (msg = slab_alloc(msize))) {
+		opo_err_set(err, OPO_ERR_MEMORY, "failed to allocate memory for message of size %lu.", (unsigned long)msize);
+		return NULL;
+	    }
+	    memcpy(msg, r->buf + start, msize);
+	    r->read += msize;
+
+	    return msg;
+	}
+    }
+    r->spans[st % r->span_cap].start = r->read;
+    atomic_store(&r->spans[st % r->span_cap].msg, msg);
+    atomic_store(&r->span_tail, st + 1);
+    r->read += msize;
+
+    return msg;
+}
+
+// Can be called from any thread.
+void
+receiver_release(Receiver r, opoMsg msg) {
+    if (!receiver_in_ring(r, msg)) {
+	slab_free(msg);
+	return;
+    }
+    size_t	st = atomic_load(&r->span_tail);
+
+    // Messages are usually released in order so the match is almost always
+    // the first one.
+    for (size_t i = atomic_load(&r->span_head); i < st; i++) {
+	const uint8_t	*m = msg;
+
+	if (atomic_compare_exchange_strong(&r->spans[i % r->span_cap].msg, &m, NULL)) {
+	    break;
+	}
+    }
+}
+
+bool
+receiver_partial(Receiver r) {
+    return r->spilling || r->read != r->tail;
+}
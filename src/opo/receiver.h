@@ -0,0 +1,61 @@
+// Copyright 2017 by Peter Ohler, All Rights Reserved
+
+#ifndef __OPO_RECEIVER_H__
+#define __OPO_RECEIVER_H__
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "err.h"
+#include "val.h"
+
+#define MSG_HEAD_SIZE	13 // 8 bytes for id, 1 for type, and 4 for length of val
+
+// A delivered message that still occupies space in the ring. The msg is set
+// to NULL when released.
+typedef struct _Span {
+    _Atomic(const uint8_t*)	msg;
+    size_t			start;
+} *Span;
+
+// Messages are read directly into a ring buffer and handed out as pointers
+// into the ring. Space is reclaimed in order as messages are released. A
+// message that would wrap around the end of the ring or that does not fit is
+// copied to the heap instead.
+typedef struct _Receiver {
+    uint8_t		*buf;
+    size_t		size;
+    size_t		head; // oldest byte still in use, never wraps
+    size_t		tail; // next byte to read into, never wraps
+    size_t		read; // start of the next undelivered message, never wraps
+
+    struct _Span	*spans;
+    size_t		span_cap;
+    atomic_size_t	span_head;
+    atomic_size_t	span_tail;
+
+    // Message being assembled on the heap.
+    bool		spilling;
+    uint8_t		hdr[MSG_HEAD_SIZE];
+    size_t		hcnt;
+    uint8_t		*big;
+    size_t		bsize;
+    size_t		bcnt;
+} *Receiver;
+
+// Returns true if the message is in the ring rather than on the heap.
+static inline bool
+receiver_in_ring(Receiver r, opoMsg msg) {
+    return r->buf <= msg && msg < r->buf + r->size;
+}
+
+extern void	receiver_init(Receiver r, size_t size);
+extern void	receiver_cleanup(Receiver r);
+extern ssize_t	receiver_recv(Receiver r, int sock);
+extern opoMsg	receiver_next(opoErr err, Receiver r);
+extern void	receiver_release(Receiver r, opoMsg msg);
+extern bool	receiver_partial(Receiver r);
+
+#endif /* __OPO_RECEIVER_H__ */
@@ -0,0 +1,563 @@
+// Copyright 2017 by Peter Ohler, All Rights Reserved
+
+#include <math.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "client_int.h"
+#include "dtime.h"
+#include "park.h"
+#include "replica.h"
+
+#define LAT_BUCKETS	32 // log2 of microseconds
+#define LAT_MIN_SAMPLES	100 // before the p95 is trusted
+#define LAT_PERIOD	1.0 // seconds between p95 updates
+#define HEDGE_IDLE	0.1 // longest the hedge thread sleeps
+
+// A read query that may be sent to a second replica. It is freed when the
+// hedge thread and every copy sent are done with it. The refs are zero until
+// the copy is sent so a response that beats the send does not see a stale
+// ref. The copies count includes the one the hedge thread has yet to send.
+typedef struct _Hedge {
+    struct _Hedge	*next; // in the hedge thread queue
+    struct _Hedge	*live_prev; // every hedge not yet freed
+    struct _Hedge	*live_next;
+    opoReplicaSet	set;
+    opoClient		first; // replica the query was sent to first
+    opoClient		second; // replica the copy was sent to
+    opoQueryCallback	cb;
+    void		*ctx;
+    _Atomic(opoRef)	ref; // of the first copy, the one returned
+    _Atomic(opoRef)	second_ref;
+    double		sent;
+    double		fire; // when to send the copy
+    atomic_bool		done;
+    atomic_int		refs;
+    atomic_int		copies; // that may still be answered
+    _Atomic(opoMsg)	failed; // last time out or cancel of a copy
+    uint8_t		query[];
+} *Hedge;
+
+struct _opoReplicaSet {
+    opoClient		*clients;
+    int			cnt;
+    struct _Park	ready; // woken by any of the clients
+    bool		async; // the clients have a query_callback
+
+    // Hedging is off when the delay is zero and uses the observed p95 when
+    // negative.
+    double		hedge_delay;
+    bool		hedging; // hedge thread running
+    pthread_t		hedge_thread;
+    struct _Park	hedge_park;
+    pthread_mutex_t	hedge_lock;
+    Hedge		hedge_head;
+    Hedge		hedge_tail;
+    Hedge		live;
+    atomic_uint		lat[LAT_BUCKETS]; // response times of hedged queries
+    _Atomic double	p95;
+};
+
+static _Thread_local uint32_t	pick_seed = 0;
+
+// xorshift is plenty for picking replicas and has no shared state.
+static uint32_t
+pick_rand() {
+    uint32_t	x = pick_seed;
+
+    if (0 == x) {
+	x = ((uint32_t)(uintptr_t)&pick_seed ^ (uint32_t)(dtime() * 1000000.0)) | 1;
+    }
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    pick_seed = x;
+
+    return x;
+}
+
+opoReplicaSet
+opo_replica_connect(opoErr err, const char **nodes, int cnt, opoClientOptions options) {
+    opoReplicaSet	set;
+
+    if (cnt < 1) {
+	opo_err_set(err, OPO_ERR_ARG, "a replica set must have at least one node");
+	return NULL;
+    }
+    if (NULL == (set = (opoReplicaSet)malloc(sizeof(struct _opoReplicaSet))) ||
+	NULL == (set->clients = (opoClient*)calloc(cnt, sizeof(opoClient)))) {
+	free(set);
+	opo_err_set(err, OPO_ERR_MEMORY, "failed to allocate memory for a opoReplicaSet.");
+	return NULL;
+    }
+    set->cnt = 0;
+    park_init(&set->ready, (NULL == options) ? 0 : options->spin);
+    set->async = NULL != options && NULL != options->query_callback;
+    set->hedge_delay = 0.0;
+    set->hedging = false;
+    park_init(&set->hedge_park, -1);
+    pthread_mutex_init(&set->hedge_lock, NULL);
+    set->hedge_head = NULL;
+    set->hedge_tail = NULL;
+    set->live = NULL;
+    for (int i = 0; i < LAT_BUCKETS; i++) {
+	atomic_init(&set->lat[i], 0);
+    }
+    atomic_init(&set->p95, 0.0);
+    for (; set->cnt < cnt; set->cnt++) {
+	opoClient	client = client_connect_addr(err, nodes[set->cnt], options);
+
+	if (NULL == client) {
+	    break;
+	}
+	client_set_notify(client, &set->ready);
+	set->clients[set->cnt] = client;
+	if (OPO_ERR_OK != err->code) {
+	    set->cnt++;
+	    break;
+	}
+    }
+    if (OPO_ERR_OK != err->code) {
+	opo_replica_close(set);
+	return NULL;
+    }
+    return set;
+}
+
+static void
+hedge_release(Hedge h) {
+    if (1 == atomic_fetch_sub(&h->refs, 1)) {
+	opoReplicaSet	set = h->set;
+
+	pthread_mutex_lock(&set->hedge_lock);
+	if (NULL == h->live_prev) {
+	    set->live = h->live_next;
+	} else {
+	    h->live_prev->live_next = h->live_next;
+	}
+	if (NULL != h->live_next) {
+	    h->live_next->live_prev = h->live_prev;
+	}
+	pthread_mutex_unlock(&set->hedge_lock);
+	free(h);
+    }
+}
+
+// Takes a reference unless the last one is already being released.
+static bool
+hedge_hold(Hedge h) {
+    int	refs = atomic_load(&h->refs);
+
+    while (0 < refs) {
+	if (atomic_compare_exchange_weak(&h->refs, &refs, refs + 1)) {
+	    return true;
+	}
+    }
+    return false;
+}
+
+// Replicas that have not answered yet have no load so fewer pending
+// queries breaks the tie.
+static bool
+less_loaded(opoClient a, opoClient b) {
+    double	la = client_load(a);
+    double	lb = client_load(b);
+
+    if (la == lb) {
+	return opo_client_pending_count(a) <= opo_client_pending_count(b);
+    }
+    return la < lb;
+}
+
+// Power of two choices. Comparing two random replicas avoids the herd that
+// always picking the single best would send to one replica between
+// response time updates.
+static opoClient
+pick_client(opoReplicaSet set) {
+    if (1 == set->cnt) {
+	return *set->clients;
+    }
+    int	a = (int)(pick_rand() % (uint32_t)set->cnt);
+    int	b = (int)(pick_rand() % (uint32_t)(set->cnt - 1));
+
+    if (a <= b) {
+	b++;
+    }
+    return less_loaded(set->clients[a], set->clients[b]) ? set->clients[a] : set->clients[b];
+}
+
+static void
+lat_record(opoReplicaSet set, double dt) {
+    int	b = 0;
+
+    for (uint64_t us = (uint64_t)(dt * 1000000.0); 0 < us && b < LAT_BUCKETS - 1; us >>= 1) {
+	b++;
+    }
+    atomic_fetch_add_explicit(&set->lat[b], 1, memory_order_relaxed);
+}
+
+// Sets the p95 to the upper bound of the bucket it falls in and halves the
+// counts so older response times fade out.
+static void
+lat_update(opoReplicaSet set) {
+    unsigned int	counts[LAT_BUCKETS];
+    unsigned int	total = 0;
+    unsigned int	sum = 0;
+
+    for (int i = 0; i < LAT_BUCKETS; i++) {
+	counts[i] = atomic_load_explicit(&set->lat[i], memory_order_relaxed);
+	atomic_store_explicit(&set->lat[i], counts[i] / 2, memory_order_relaxed);
+	total += counts[i];
+    }
+    if (total < LAT_MIN_SAMPLES) {
+	return;
+    }
+    for (int i = 0; i < LAT_BUCKETS; i++) {
+	sum += counts[i];
+	if (total * 95 <= sum * 100) {
+	    atomic_store(&set->p95, ldexp(1.0, i) / 1000000.0);
+	    break;
+	}
+    }
+}
+
+static double
+hedge_after(opoReplicaSet set) {
+    if (0.0 < set->hedge_delay) {
+	return set->hedge_delay;
+    }
+    return atomic_load(&set->p95);
+}
+
+// Cancels whichever copies have been sent. The copy being called back has
+// already been claimed so the cancel skips it.
+static void
+hedge_cancel(Hedge h) {
+    opoRef	ref;
+
+    if (0 != (ref = atomic_load(&h->ref))) {
+	opo_client_cancel(h->first, ref);
+    }
+    if (0 != (ref = atomic_load(&h->second_ref))) {
+	opo_client_cancel(h->second, ref);
+    }
+}
+
+// Passes the response on once and cancels the other copy so its slot is
+// freed and the client never sees a duplicate.
+static void
+hedge_finish(Hedge h, opoRef ref, opoMsg response, bool answered) {
+    if (!atomic_exchange(&h->done, true)) {
+	opoRef	first_ref = atomic_load(&h->ref);
+
+	// The copy is only sent after the first ref is set so a response
+	// before then is for the first copy.
+	if (0 == first_ref) {
+	    first_ref = ref;
+	}
+	if (answered) {
+	    lat_record(h->set, dtime() - h->sent);
+	}
+	if (NULL != h->cb) {
+	    h->cb(first_ref, response, h->ctx);
+	}
+	hedge_cancel(h);
+    }
+}
+
+// Called for the response to either copy. The first response from a server
+// wins. A copy that times out or is canceled only drops out unless it was
+// the last that could be answered.
+static void
+hedge_cb(opoRef ref, opoMsg response, void *ctx) {
+    Hedge	h = (Hedge)ctx;
+
+    if (client_gave_up(h->first, response) || (NULL != h->second && client_gave_up(h->second, response))) {
+	atomic_store(&h->failed, response);
+	if (1 == atomic_fetch_sub(&h->copies, 1)) {
+	    hedge_finish(h, ref, response, false);
+	}
+    } else {
+	hedge_finish(h, ref, response, true);
+    }
+    hedge_release(h);
+}
+
+// The hedge thread's copy is not sent. If the first copy has already
+// failed the failure is passed on.
+static void
+hedge_skip(Hedge h) {
+    if (1 == atomic_fetch_sub(&h->copies, 1)) {
+	hedge_finish(h, atomic_load(&h->ref), atomic_load(&h->failed), false);
+    }
+}
+
+// Cancels the copies still waiting on a response so their callbacks are
+// made while the clients are still open.
+static void
+cancel_live(opoReplicaSet set) {
+    Hedge	*live = NULL;
+    int		cnt = 0;
+
+    pthread_mutex_lock(&set->hedge_lock);
+    for (Hedge h = set->live; NULL != h; h = h->live_next) {
+	cnt++;
+    }
+    if (0 < cnt && NULL != (live = (Hedge*)malloc(sizeof(Hedge) * cnt))) {
+	cnt = 0;
+	for (Hedge h = set->live; NULL != h; h = h->live_next) {
+	    if (hedge_hold(h)) {
+		live[cnt++] = h;
+	    }
+	}
+    }
+    pthread_mutex_unlock(&set->hedge_lock);
+    if (NULL != live) {
+	for (int i = 0; i < cnt; i++) {
+	    hedge_cancel(live[i]);
+	    hedge_release(live[i]);
+	}
+	free(live);
+    }
+}
+
+void
+opo_replica_close(opoReplicaSet set) {
+    if (set->hedging) {
+	set->hedging = false;
+	park_wake(&set->hedge_park);
+	pthread_join(set->hedge_thread, NULL);
+	for (Hedge h = set->hedge_head; NULL != h; h = set->hedge_head) {
+	    set->hedge_head = h->next;
+	    hedge_skip(h);
+	    hedge_release(h);
+	}
+    }
+    cancel_live(set);
+    park_cleanup(&set->hedge_park);
+    for (int i = 0; i < set->cnt; i++) {
+	opo_client_close(set->clients[i]);
+    }
+    // A response that was ready but not processed is never called back once
+    // the clients are closed.
+    for (Hedge h = set->live; NULL != h; h = set->live) {
+	set->live = h->live_next;
+	free(h);
+    }
+    pthread_mutex_destroy(&set->hedge_lock);
+    park_cleanup(&set->ready);
+    free(set->clients);
+    free(set);
+}
+
+// Sends the copy to the least loaded replica other than the first. A try
+// query is used so a full window does not hold up the other hedges. Returns
+// false if the copy was not sent.
+static bool
+hedge_send(opoReplicaSet set, Hedge h) {
+    opoClient	best = NULL;
+
+    for (int i = 0; i < set->cnt; i++) {
+	opoClient	client = set->clients[i];
+
+	if (client != h->first && (NULL == best || less_loaded(client, best))) {
+	    best = client;
+	}
+    }
+    if (NULL != best) {
+	struct _opoErr	err = OPO_ERR_INIT;
+	opoRef		ref;
+
+	h->second = best;
+	atomic_fetch_add(&h->refs, 1);
+	if (0 == (ref = opo_client_try_query(&err, best, h->query, hedge_cb, h))) {
+	    atomic_fetch_sub(&h->refs, 1);
+	    return false;
+	}
+	atomic_store(&h->second_ref, ref);
+	// The first copy may have answered before the ref was set.
+	if (atomic_load(&h->done)) {
+	    opo_client_cancel(best, ref);
+	}
+	return true;
+    }
+    return false;
+}
+
+static void*
+hedge_loop(void *ctx) {
+    opoReplicaSet	set = (opoReplicaSet)ctx;
+    double		next_update = dtime() + LAT_PERIOD;
+
+    while (set->hedging) {
+	unsigned int	key = park_prepare(&set->hedge_park);
+	double		now = dtime();
+	double		timeout = HEDGE_IDLE;
+	Hedge		h;
+
+	if (next_update <= now) {
+	    lat_update(set);
+	    next_update = now + LAT_PERIOD;
+	}
+	pthread_mutex_lock(&set->hedge_lock);
+	// Hedges are queued in send order so the one at the head fires
+	// first. A p95 that changes can make them a little out of order
+	// which only delays the later ones.
+	if (NULL != (h = set->hedge_head)) {
+	    if (atomic_load(&h->done) || h->fire <= now) {
+		if (NULL == (set->hedge_head = h->next)) {
+		    set->hedge_tail = NULL;
+		}
+		timeout = 0.0;
+	    } else {
+		timeout = fmin(h->fire - now, HEDGE_IDLE);
+		h = NULL;
+	    }
+	}
+	pthread_mutex_unlock(&set->hedge_lock);
+	if (NULL != h) {
+	    if (atomic_load(&h->done) || !hedge_send(set, h)) {
+		hedge_skip(h);
+	    }
+	    hedge_release(h);
+	}
+	park_wait(&set->hedge_park, key, timeout);
+	park_done(&set->hedge_park);
+    }
+    return NULL;
+}
+
+opoErrCode
+opo_replica_set_hedge(opoErr err, opoReplicaSet set, double delay) {
+    int	stat;
+
+    // The copies are completed by per-query callbacks which a
+    // query_callback replaces.
+    if (0.0 != delay && set->async) {
+	return opo_err_set(err, OPO_ERR_ARG, "hedging can not be used with a query_callback");
+    }
+    set->hedge_delay = delay;
+    if (0.0 != delay && !set->hedging && 1 < set->cnt) {
+	set->hedging = true;
+	if (0 != (stat = pthread_create(&set->hedge_thread, NULL, hedge_loop, set))) {
+	    set->hedging = false;
+	    set->hedge_delay = 0.0;
+	    return opo_err_set(err, OPO_ERR_THREAD, "failed to create hedge thread. %s", strerror(stat));
+	}
+    }
+    return OPO_ERR_OK;
+}
+
+// Only reads are hedged as a write sent twice would be applied twice.
+static bool
+is_read(opoVal query) {
+    opoVal	top = opo_msg_val(query);
+
+    return (NULL == opo_val_get(top, "insert") &&
+	    NULL == opo_val_get(top, "update") &&
+	    NULL == opo_val_get(top, "delete"));
+}
+
+// If after is zero the query is only timed and a copy is never sent.
+static opoRef
+hedged_query(opoErr err, opoReplicaSet set, opoClient client, opoVal query, opoQueryCallback cb, void *ctx, double after) {
+    size_t	size = (0.0 < after) ? opo_msg_bsize(query) : 0;
+    Hedge	h = (Hedge)malloc(sizeof(struct _Hedge) + size);
+    opoRef	ref;
+    bool	empty;
+
+    if (NULL == h) {
+	opo_err_set(err, OPO_ERR_MEMORY, "failed to allocate memory for a hedged query.");
+	return 0;
+    }
+    memcpy(h->query, query, size);
+    h->next = NULL;
+    h->set = set;
+    h->first = client;
+    h->second = NULL;
+    h->cb = cb;
+    h->ctx = ctx;
+    h->sent = dtime();
+    h->fire = h->sent + after;
+    atomic_init(&h->ref, 0);
+    atomic_init(&h->second_ref, 0);
+    atomic_init(&h->done, false);
+    // The first copy, the hedge thread, and this call as the response may
+    // arrive before the query call returns.
+    atomic_init(&h->refs, (0.0 < after) ? 3 : 2);
+    atomic_init(&h->copies, (0.0 < after) ? 2 : 1);
+    atomic_init(&h->failed, NULL);
+    h->live_prev = NULL;
+    if (0 == (ref = opo_client_query(err, client, query, hedge_cb, h))) {
+	free(h);
+	return 0;
+    }
+    atomic_store(&h->ref, ref);
+    pthread_mutex_lock(&set->hedge_lock);
+    if (NULL != (h->live_next = set->live)) {
+	set->live->live_prev = h;
+    }
+    set->live = h;
+    if (0.0 >= after) {
+	pthread_mutex_unlock(&set->hedge_lock);
+	hedge_release(h);
+	return ref;
+    }
+    if (NULL == set->hedge_tail) {
+	set->hedge_head = h;
+	empty = true;
+    } else {
+	set->hedge_tail->next = h;
+	empty = false;
+    }
+    set->hedge_tail = h;
+    pthread_mutex_unlock(&set->hedge_lock);
+    hedge_release(h);
+    if (empty) {
+	park_wake(&set->hedge_park);
+    }
+    return ref;
+}
+
+opoRef
+opo_replica_query(opoErr err, opoReplicaSet set, opoVal query, opoQueryCallback cb, void *ctx) {
+    opoClient	client = pick_client(set);
+
+    if (set->hedging && 0.0 != set->hedge_delay && is_read(query)) {
+	// Until there are enough response times to know the p95 reads are
+	// only timed.
+	return hedged_query(err, set, client, query, cb, ctx, hedge_after(set));
+    }
+    return opo_client_query(err, client, query, cb, ctx);
+}
+
+int
+opo_replica_process(opoReplicaSet set, int max, double wait) {
+    return client_group_process(set->clients, set->cnt, &set->ready, max, wait);
+}
+
+int
+opo_replica_pending_count(opoReplicaSet set) {
+    int	cnt = 0;
+
+    for (int i = 0; i < set->cnt; i++) {
+	cnt += opo_client_pending_count(set->clients[i]);
+    }
+    return cnt;
+}
+
+int
+opo_replica_size(opoReplicaSet set) {
+    return set->cnt;
+}
+
+opoClient
+opo_replica_client(opoReplicaSet set, int i) {
+    if (i < 0 || set->cnt <= i) {
+	return NULL;
+    }
+    return set->clients[i];
+}
@@ -0,0 +1,26 @@
+// Copyright 2017 by Peter Ohler, All Rights Reserved
+
+#ifndef __OPOC_REPLICA_H__
+#define __OPOC_REPLICA_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "client.h"
+
+    typedef struct _opoReplicaSet	*opoReplicaSet;
+
+    extern opoReplicaSet	opo_replica_connect(opoErr err, const char **nodes, int cnt, opoClientOptions options);
+    extern void			opo_replica_close(opoReplicaSet set);
+    extern opoErrCode		opo_replica_set_hedge(opoErr err, opoReplicaSet set, double delay);
+    extern opoRef		opo_replica_query(opoErr err, opoReplicaSet set, opoVal query, opoQueryCallback cb, void *ctx);
+    extern int			opo_replica_process(opoReplicaSet set, int max, double wait);
+    extern int			opo_replica_pending_count(opoReplicaSet set);
+    extern int			opo_replica_size(opoReplicaSet set);
+    extern opoClient		opo_replica_client(opoReplicaSet set, int i);
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* __OPOC_REPLICA_H__ */
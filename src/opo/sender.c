@@ -0,0 +1,421 @@
+// Copyright 2017 by Peter Ohler, All Rights Reserved
+
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "dtime.h"
+#include "sender.h"
+
+// lower gives faster response but burns more CPU. This is a reasonable compromise.
+#define RETRY_SECS	0.0001
+#define MIN_SEND_SIZE	4096
+
+#ifndef IOV_MAX
+#define IOV_MAX		1024
+#endif
+
+#ifdef MSG_NOSIGNAL
+#define SEND_FLAGS	MSG_NOSIGNAL
+#else
+#define SEND_FLAGS	0
+#endif
+
+void
+sender_init(Sender s, size_t size) {
+    if (size < MIN_SEND_SIZE) {
+	size = MIN_SEND_SIZE;
+    }
+    s->buf = (uint8_t*)malloc(size);
+    s->size = size;
+    atomic_init(&s->head, 0);
+    atomic_init(&s->tail, 0);
+    pthread_mutex_init(&s->lock, NULL);
+    atomic_flag_clear(&s->flushing);
+    atomic_init(&s->bytes, 0);
+    atomic_init(&s->calls, 0);
+    s->wake = NULL;
+    s->wake_ctx = NULL;
+}
+
+void
+sender_cleanup(Sender s) {
+    pthread_mutex_destroy(&s->lock);
+    free(s->buf);
+    s->buf = NULL;
+}
+
+// Waits for the socket to accept more data after a short write.
+static opoErrCode
+wait_writable(opoErr err, int sock, double timeout) {
+    struct pollfd	pa;
+    int			i;
+
+    pa.fd = sock;
+    pa.events = POLLOUT;
+    pa.revents = 0;
+    if (0 > (i = poll(&pa, 1, (0.0 < timeout) ? (int)(timeout * 1000.0) : -1))) {
+	if (EINTR == errno) {
+	    return OPO_ERR_OK;
+	}
+	return opo_err_no(err, "write polling failed");
+    }
+    if (0 == i) {
+	return opo_err_set(err, OPO_ERR_WRITE, "write failed, timed out");
+    }
+    if (0 != (pa.revents & (POLLERR | POLLHUP | POLLNVAL))) {
+	return opo_err_set(err, OPO_ERR_WRITE, "write failed, connection closed");
+    }
+    return OPO_ERR_OK;
+}
+
+// Writes everything between head and tail. Must only be called while holding
+// the flushing flag. Bytes appended during the write are picked up on the
+// next pass so a busy connection sends many messages per call. If wait is
+// false the write stops when the socket is full and the rest is left in the
+// buffer.
+static opoErrCode
+write_pending(opoErr err, Sender s, int sock, bool wait, double timeout) {
+    size_t		head = atomic_load(&s->head);
+    size_t		tail = atomic_load(&s->tail);
+    struct iovec	iov[2];
+    struct msghdr	mh;
+    ssize_t		cnt;
+    opoErrCode		code = OPO_ERR_OK;
+
+    memset(&mh, 0, sizeof(mh));
+    mh.msg_iov = iov;
+    while (head < tail) {
+	size_t	start = head % s->size;
+	size_t	len = tail - head;
+
+	iov[0].iov_base = s->buf + start;
+	if (s->size < start + len) { // wrapped so write both pieces
+	    iov[0].iov_len = s->size - start;
+	    iov[1].iov_base = s->buf;
+	    iov[1].iov_len = len - iov[0].iov_len;
+	    mh.msg_iovlen = 2;
+	} else {
+	    iov[0].iov_len = len;
+	    mh.msg_iovlen = 1;
+	}
+	if (0 > (cnt = sendmsg(sock, &mh, SEND_FLAGS))) {
+	    if (EAGAIN == errno || EWOULDBLOCK == errno) {
+		if (!wait) {
+		    break;
+		}
+		if (OPO_ERR_OK != (code = wait_writable(err, sock, timeout))) {
+		    break;
+		}
+		continue;
+	    }
+	    if (EINTR == errno) {
+		continue;
+	    }
+	    code = opo_err_no(err, "write failed");
+	    break;
+	}
+	atomic_fetch_add(&s->bytes, (unsigned long long)cnt);
+	atomic_fetch_add(&s->calls, 1);
+	head += cnt;
+	atomic_store(&s->head, head);
+	tail = atomic_load(&s->tail);
+    }
+    if (OPO_ERR_OK != code) {
+	// The connection is no longer usable so drop whatever is left.
+	atomic_store(&s->head, atomic_load(&s->tail));
+    }
+    return code;
+}
+
+// Lets go of the flushing flag. Threads that appended while the flag was
+// held left their bytes for the holder so if any are still buffered the
+// writable waiter is woken to flush them.
+static void
+release_flag(Sender s) {
+    atomic_flag_clear(&s->flushing);
+    if (NULL != s->wake && atomic_load(&s->head) != atomic_load(&s->tail)) {
+	s->wake(s->wake_ctx);
+    }
+}
+
+static opoErrCode
+write_direct(opoErr err, Sender s, int sock, const uint8_t *data, size_t len, double timeout) {
+    ssize_t	cnt;
+    opoErrCode	code = OPO_ERR_OK;
+
+    while (0 < len) {
+	if (0 > (cnt = send(sock, data, len, SEND_FLAGS))) {
+	    if (EAGAIN == errno || EWOULDBLOCK == errno) {
+		if (OPO_ERR_OK != (code = wait_writable(err, sock, timeout))) {
+		    break;
+		}
+		continue;
+	    }
+	    if (EINTR == errno) {
+		continue;
+	    }
+	    code = opo_err_no(err, "write failed");
+	    break;
+	}
+	atomic_fetch_add(&s->bytes, (unsigned long long)cnt);
+	atomic_fetch_add(&s->calls, 1);
+	data += cnt;
+	len -= cnt;
+    }
+    return code;
+}
+
+opoErrCode
+sender_flush(opoErr err, Sender s, int sock, double timeout) {
+    opoErrCode	code = OPO_ERR_OK;
+
+    // If another thread is flushing it will pick up anything appended
+    // before it clears the flag. The loop covers an append that lands just
+    // after that last check.
+    while (atomic_load(&s->head) != atomic_load(&s->tail)) {
+	if (atomic_flag_test_and_set(&s->flushing)) {
+	    break;
+	}
+	code = write_pending(err, s, sock, true, timeout);
+	atomic_flag_clear(&s->flushing);
+	if (OPO_ERR_OK != code) {
+	    break;
+	}
+    }
+    return code;
+}
+
+// Writes as much as the socket will take without waiting. Returns right away
+// if another thread is flushing.
+opoErrCode
+sender_try_flush(opoErr err, Sender s, int sock) {
+    opoErrCode	code = OPO_ERR_OK;
+
+    if (atomic_load(&s->head) != atomic_load(&s->tail) && !atomic_flag_test_and_set(&s->flushing)) {
+	code = write_pending(err, s, sock, false, 0.0);
+	release_flag(s);
+    }
+    return code;
+}
+
+bool
+sender_pending(Sender s) {
+    return atomic_load(&s->head) != atomic_load(&s->tail);
+}
+
+// A hint only as other threads may append at the same time. A message too
+// large for the buffer is written directly once the buffer is empty.
+bool
+sender_room(Sender s, size_t len) {
+    size_t	used = atomic_load(&s->tail) - atomic_load(&s->head);
+
+    if (s->size < len) {
+	return 0 == used;
+    }
+    return len <= s->size - used;
+}
+
+// A message too big for the buffer is written directly from the caller's
+// memory. It is called without the lock so other threads keep appending
+// while it waits. Holding the flushing flag keeps anyone else from writing
+// to the socket so whatever is buffered goes first and then the message
+// whole. If wait is false it is only written when nothing is buffered or
+// being written but once started it is always written whole.
+static opoErrCode
+write_oversize(opoErr err, Sender s, int sock, const uint8_t *data, size_t len, double timeout, bool wait) {
+    double	give_up = dtime() + timeout;
+    opoErrCode	code;
+
+    while (atomic_flag_test_and_set(&s->flushing)) {
+	if (!wait || (0.0 < timeout && give_up < dtime())) {
+	    return opo_err_set(err, EAGAIN, "write failed, busy");
+	}
+	dsleep(RETRY_SECS);
+    }
+    if (!wait && atomic_load(&s->head) != atomic_load(&s->tail)) {
+	release_flag(s);
+	return opo_err_set(err, EAGAIN, "write failed, busy");
+    }
+    if (OPO_ERR_OK == (code = write_pending(err, s, sock, true, timeout))) {
+	code = write_direct(err, s, sock, data, len, timeout);
+    }
+    release_flag(s);
+
+    return code;
+}
+
+// Copies a message into the buffer if there is room for it. Must be called
+// while holding the lock.
+static bool
+copy_in(Sender s, const uint8_t *data, size_t len) {
+    size_t	tail = atomic_load(&s->tail);
+
+    if (s->size - (tail - atomic_load(&s->head)) < len) {
+	return false;
+    }
+    size_t	start = tail % s->size;
+
+    if (s->size < start + len) {
+	size_t	first = s->size - start;
+
+	memcpy(s->buf + start, data, first);
+	memcpy(s->buf, data + first, len - first);
+    } else {
+	memcpy(s->buf + start, data, len);
+    }
+    atomic_store(&s->tail, tail + len);
+
+    return true;
+}
+
+// Makes room by flushing, without the lock, and sleeps briefly if another
+// thread is the one writing. The give_up time is set on the first call. A
+// timeout of zero or less does not wait on the socket and gives up as soon
+// as flushing has not made room.
+static opoErrCode
+wait_room(opoErr err, Sender s, int sock, size_t len, double timeout, double *give_up) {
+    opoErrCode	code;
+
+    if (0.0 >= timeout) {
+	if (OPO_ERR_OK != (code = sender_try_flush(err, s, sock))) {
+	    return code;
+	}
+	if (sender_room(s, len)) {
+	    return OPO_ERR_OK;
+	}
+	return opo_err_set(err, EAGAIN, "write failed, busy");
+    }
+    if (OPO_ERR_OK != (code = sender_flush(err, s, sock, timeout))) {
+	return code;
+    }
+    if (sender_room(s, len)) {
+	return OPO_ERR_OK;
+    }
+    if (0.0 == *give_up) {
+	*give_up = dtime() + timeout;
+    } else if (*give_up < dtime()) {
+	return opo_err_set(err, EAGAIN, "write failed, busy");
+    }
+    dsleep(RETRY_SECS);
+
+    return OPO_ERR_OK;
+}
+
+opoErrCode
+sender_append(opoErr err, Sender s, int sock, const uint8_t *data, size_t len, double timeout, bool wait) {
+    double	give_up = 0.0;
+    opoErrCode	code = OPO_ERR_OK;
+    bool	done;
+
+    if (s->size < len) {
+	return write_oversize(err, s, sock, data, len, timeout, wait);
+    }
+    while (OPO_ERR_OK == code) {
+	pthread_mutex_lock(&s->lock);
+	done = copy_in(s, data, len);
+	pthread_mutex_unlock(&s->lock);
+	if (done) {
+	    break;
+	}
+	if (!wait) {
+	    return opo_err_set(err, EAGAIN, "send buffer full");
+	}
+	code = wait_room(err, s, sock, len, timeout, &give_up);
+    }
+    return code;
+}
+
+// Appends a batch of messages under a single hold of the lock unless there
+// is not room for all of them. If nothing is buffered the batch is written
+// straight from the caller's memory with one vectored write and only what
+// the socket does not take is copied into the buffer to be sent by the next
+// flush. The write is made without the lock so other threads keep appending
+// behind it.
+int
+sender_appendv(opoErr err, Sender s, int sock, const struct iovec *iov, int cnt, double timeout, bool wait) {
+    opoErrCode	code = OPO_ERR_OK;
+    size_t	skip = 0; // bytes already written from iov[0]
+    size_t	start = 0; // tail when the direct write was made
+    bool	holding = false; // still holding the flushing flag
+    double	give_up = 0.0;
+    int		taken = 0;
+
+    if (atomic_load(&s->head) == atomic_load(&s->tail) && !atomic_flag_test_and_set(&s->flushing)) {
+	// Something may have been appended just before the flag was taken.
+	if ((start = atomic_load(&s->tail)) != atomic_load(&s->head)) {
+	    release_flag(s);
+	} else {
+	    struct msghdr	mh;
+	    ssize_t		wcnt;
+
+	    memset(&mh, 0, sizeof(mh));
+	    mh.msg_iov = (struct iovec*)iov;
+	    mh.msg_iovlen = (IOV_MAX < cnt) ? IOV_MAX : cnt;
+	    while (0 > (wcnt = sendmsg(sock, &mh, SEND_FLAGS)) && EINTR == errno) {
+	    }
+	    if (0 <= wcnt) {
+		atomic_fetch_add(&s->bytes, (unsigned long long)wcnt);
+		atomic_fetch_add(&s->calls, 1);
+		for (; 0 < cnt && iov->iov_len <= (size_t)wcnt; cnt--, iov++, taken++) {
+		    wcnt -= iov->iov_len;
+		}
+		skip = (size_t)wcnt;
+	    } else if (EAGAIN != errno && EWOULDBLOCK != errno) {
+		code = opo_err_no(err, "write failed");
+		cnt = 0;
+	    }
+	    // The rest of a message cut short must follow it on the wire so
+	    // the flag is kept until that rest is buffered or written.
+	    if (!(holding = 0 < skip && 0 < cnt)) {
+		release_flag(s);
+	    }
+	}
+    }
+    pthread_mutex_lock(&s->lock);
+    while (0 < cnt && OPO_ERR_OK == code) {
+	const uint8_t	*data = (uint8_t*)iov->iov_base + skip;
+	size_t		len = iov->iov_len - skip;
+
+	if (holding) {
+	    // The buffer is still empty unless something was appended during
+	    // the write. In that case or if the rest is too big it is written
+	    // directly ahead of whatever was appended.
+	    if (atomic_load(&s->tail) != start || s->size < len) {
+		pthread_mutex_unlock(&s->lock);
+		code = write_direct(err, s, sock, data, len, timeout);
+		pthread_mutex_lock(&s->lock);
+	    } else {
+		copy_in(s, data, len);
+	    }
+	    release_flag(s);
+	    holding = false;
+	} else if (s->size < len) {
+	    pthread_mutex_unlock(&s->lock);
+	    code = write_oversize(err, s, sock, data, len, timeout, wait);
+	    pthread_mutex_lock(&s->lock);
+	} else if (!copy_in(s, data, len)) {
+	    pthread_mutex_unlock(&s->lock);
+	    if (!wait) {
+		opo_err_set(err, EAGAIN, "send buffer full");
+		return taken;
+	    }
+	    code = wait_room(err, s, sock, len, timeout, &give_up);
+	    pthread_mutex_lock(&s->lock);
+	    continue;
+	}
+	if (OPO_ERR_OK == code) {
+	    taken++;
+	}
+	cnt--;
+	iov++;
+	skip = 0;
+    }
+    pthread_mutex_unlock(&s->lock);
+
+    return taken;
+}
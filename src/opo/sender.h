@@ -0,0 +1,46 @@
+// Copyright 2017 by Peter Ohler, All Rights Reserved
+
+#ifndef __OPO_SENDER_H__
+#define __OPO_SENDER_H__
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+#include "err.h"
+
+// Outgoing messages are copied into a ring buffer by any number of threads
+// and written to the socket by whichever thread holds the flushing flag. All
+// the messages appended while a write is in progress go out on the next
+// write in a single system call.
+typedef struct _Sender {
+    uint8_t		*buf;
+    size_t		size;
+    atomic_size_t	head; // next byte to write to the socket, never wraps
+    atomic_size_t	tail; // next byte to append to, never wraps
+    pthread_mutex_t	lock; // held while appending
+    atomic_flag		flushing;
+    atomic_ullong	bytes;
+    atomic_ullong	calls;
+    // Called when the flushing flag is let go with bytes still buffered, as
+    // when the socket was full, so that whoever waits for the socket to be
+    // writable can flush them. NULL if no one does.
+    void		(*wake)(void *ctx);
+    void		*wake_ctx;
+} *Sender;
+
+extern void		sender_init(Sender s, size_t size);
+extern void		sender_cleanup(Sender s);
+// If wait is false a message that does not fit right away is not appended
+// and err is set to EAGAIN. The batch version returns the number of messages
+// appended, stopping at the first that does not fit.
+extern opoErrCode	sender_append(opoErr err, Sender s, int sock, const uint8_t *data, size_t len, double timeout, bool wait);
+extern int		sender_appendv(opoErr err, Sender s, int sock, const struct iovec *iov, int cnt, double timeout, bool wait);
+extern opoErrCode	sender_flush(opoErr err, Sender s, int sock, double timeout);
+extern opoErrCode	sender_try_flush(opoErr err, Sender s, int sock);
+extern bool		sender_pending(Sender s);
+extern bool		sender_room(Sender s, size_t len);
+
+#endif /* __OPO_SENDER_H__ */
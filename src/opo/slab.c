@@ -0,0 +1,229 @@
+// Copyright 2017 by Peter Ohler, All Rights Reserved
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "slab.h"
+#include "val.h"
+
+#define MIN_SHIFT	6 // 64 bytes
+#define CLASS_CNT	11 // 64 bytes to 64K
+#define LARGE_CLASS	CLASS_CNT
+#define CACHE_MAX	64
+#define BATCH_SIZE	32
+#define SHARED_MAX	4096
+
+// Keeps the message that follows 16 byte aligned. Only slab_alloc() writes
+// one so slab_free() and slab_realloc() must only be given its blocks.
+typedef struct _Head {
+    uint32_t	cls;
+    uint32_t	pad;
+    uint64_t	size;
+} *Head;
+
+typedef struct _Link {
+    struct _Link	*next;
+} *Link;
+
+typedef struct _Shared {
+    pthread_mutex_t	lock;
+    Link		head;
+    int			cnt;
+} *Shared;
+
+typedef struct _Cache {
+    Link	heads[CLASS_CNT];
+    int		cnts[CLASS_CNT];
+} *Cache;
+
+static struct _Shared		shared[CLASS_CNT];
+static pthread_once_t		slab_once = PTHREAD_ONCE_INIT;
+static pthread_key_t		cache_key;
+static _Thread_local struct _Cache	cache;
+static _Thread_local bool	cache_registered = false;
+
+static void
+give_back(int cls, Link list, int cnt) {
+    Shared	sh = shared + cls;
+    Link	last = list;
+
+    for (; NULL != last->next; last = last->next) {
+    }
+    pthread_mutex_lock(&sh->lock);
+    if (SHARED_MAX < sh->cnt + cnt) {
+	pthread_mutex_unlock(&sh->lock);
+	while (NULL != list) {
+	    Link	next = list->next;
+
+	    free((uint8_t*)list - sizeof(struct _Head));
+	    list = next;
+	}
+	return;
+    }
+    last->next = sh->head;
+    sh->head = list;
+    sh->cnt += cnt;
+    pthread_mutex_unlock(&sh->lock);
+}
+
+// Called when a thread exits so the blocks in its cache are not lost.
+static void
+cache_release(void *ptr) {
+    Cache	c = (Cache)ptr;
+
+    for (int cls = 0; cls < CLASS_CNT; cls++) {
+	if (NULL != c->heads[cls]) {
+	    give_back(cls, c->heads[cls], c->cnts[cls]);
+	    c->heads[cls] = NULL;
+	    c->cnts[cls] = 0;
+	}
+    }
+}
+
+static void
+slab_init() {
+    for (int cls = 0; cls < CLASS_CNT; cls++) {
+	pthread_mutex_init(&shared[cls].lock, NULL);
+	shared[cls].head = NULL;
+	shared[cls].cnt = 0;
+    }
+    pthread_key_create(&cache_key, cache_release);
+}
+
+static Cache
+get_cache() {
+    if (!cache_registered) {
+	pthread_once(&slab_once, slab_init);
+	pthread_setspecific(cache_key, &cache);
+	cache_registered = true;
+    }
+    return &cache;
+}
+
+static int
+size_class(size_t size) {
+    int	cls = 0;
+
+    for (size_t cs = (size_t)1 << MIN_SHIFT; cs < size; cs <<= 1) {
+	cls++;
+    }
+    return cls;
+}
+
+static Link
+refill(int cls) {
+    Shared	sh = shared + cls;
+    Link	list;
+    Link	last;
+    int		cnt = 0;
+
+    pthread_mutex_lock(&sh->lock);
+    if (NULL == (list = sh->head)) {
+	pthread_mutex_unlock(&sh->lock);
+	return NULL;
+    }
+    for (last = list, cnt = 1; cnt < BATCH_SIZE && NULL != last->next; last = last->next, cnt++) {
+    }
+    sh->head = last->next;
+    sh->cnt -= cnt;
+    pthread_mutex_unlock(&sh->lock);
+    last->next = NULL;
+    cache.cnts[cls] = cnt;
+
+    return list;
+}
+
+uint8_t*
+slab_alloc(size_t size) {
+    Head	h;
+    int		cls = size_class(size);
+
+    if (LARGE_CLASS <= cls) {
+	if (NULL == (h = (Head)malloc(sizeof(struct _Head) + size))) {
+	    return NULL;
+	}
+	h->cls = LARGE_CLASS;
+	h->size = size;
+
+	return (uint8_t*)(h + 1);
+    }
+    Cache	c = get_cache();
+    Link	link = c->heads[cls];
+
+    if (NULL == link) {
+	link = c->heads[cls] = refill(cls);
+    }
+    if (NULL != link) {
+	c->heads[cls] = link->next;
+	c->cnts[cls]--;
+
+	return (uint8_t*)link;
+    }
+    size_t	cs = (size_t)1 << (MIN_SHIFT + cls);
+
+    if (NULL == (h = (Head)malloc(sizeof(struct _Head) + cs))) {
+	return NULL;
+    }
+    h->cls = cls;
+    h->size = cs;
+
+    return (uint8_t*)(h + 1);
+}
+
+uint8_t*
+slab_realloc(uint8_t *ptr, size_t size) {
+    if (NULL == ptr) {
+	return slab_alloc(size);
+    }
+    Head	h = (Head)ptr - 1;
+    uint8_t	*p;
+
+    if (size <= h->size) {
+	return ptr;
+    }
+    if (NULL != (p = slab_alloc(size))) {
+	memcpy(p, ptr, h->size);
+	slab_free(ptr);
+    }
+    return p;
+}
+
+void
+slab_free(const uint8_t *ptr) {
+    if (NULL == ptr) {
+	return;
+    }
+    Head	h = (Head)ptr - 1;
+
+    if (LARGE_CLASS <= h->cls) {
+	free(h);
+	return;
+    }
+    Cache	c = get_cache();
+    Link	link = (Link)ptr;
+    int		cls = h->cls;
+
+    link->next = c->heads[cls];
+    c->heads[cls] = link;
+    c->cnts[cls]++;
+    if (CACHE_MAX < c->cnts[cls]) {
+	// Hand a batch over to the shared list where the allocating thread
+	// can pick it up.
+	Link	last = link;
+	int	cnt = 1;
+
+	for (; cnt < BATCH_SIZE; cnt++) {
+	    last = last->next;
+	}
+	c->heads[cls] = last->next;
+	c->cnts[cls] -= cnt;
+	last->next = NULL;
+	give_back(cls, link, cnt);
+    }
+}
+
+void
+opo_msg_release_pooled(opoMsg msg) {
+    slab_free(msg);
+}
@@ -0,0 +1,20 @@
+// Copyright 2017 by Peter Ohler, All Rights Reserved
+
+#ifndef __OPO_SLAB_H__
+#define __OPO_SLAB_H__
+
+#include <stdint.h>
+#include <stdlib.h>
+
+// Size classed message pools. Each thread keeps a small cache of free blocks
+// per class and exchanges batches with a shared list so that the receiving
+// thread and the processing threads rarely contend. Classes run from 64
+// bytes to 64K. Larger blocks go straight to malloc. A block carries no
+// marker so only pointers returned by slab_alloc() or slab_realloc() may be
+// passed to slab_free().
+
+extern uint8_t*	slab_alloc(size_t size);
+extern uint8_t*	slab_realloc(uint8_t *ptr, size_t size);
+extern void	slab_free(const uint8_t *ptr);
+
+#endif /* __OPO_SLAB_H__ */
@@ -0,0 +1,155 @@
+// Copyright 2017 by Peter Ohler, All Rights Reserved
+
+#include <stddef.h>
+
+#include "wheel.h"
+
+#define SLOT_MASK	(WHEEL_SLOTS - 1)
+#define MAX_TICKS	(((uint64_t)1 << (WHEEL_BITS * WHEEL_LEVELS)) - 1)
+
+void
+wheel_init(Wheel w, double tick, double now) {
+    w->tick = tick;
+    w->start = now;
+    w->now = 0;
+    w->cnt = 0;
+    for (int l = 0; l < WHEEL_LEVELS; l++) {
+	for (int i = 0; i < WHEEL_SLOTS; i++) {
+	    Timer	head = &w->slots[l][i];
+
+	    head->next = head;
+	    head->prev = head;
+	}
+    }
+}
+
+static void
+link_timer(Wheel w, Timer t) {
+    uint64_t	delta;
+    int		level = 0;
+
+    if (t->expires < w->now) {
+	t->expires = w->now;
+    }
+    if (MAX_TICKS < (delta = t->expires - w->now)) {
+	t->expires = w->now + MAX_TICKS;
+	delta = MAX_TICKS;
+    }
+    while (level < WHEEL_LEVELS - 1 && ((uint64_t)1 << (WHEEL_BITS * (level + 1))) <= delta) {
+	level++;
+    }
+    Timer	head = &w->slots[level][(t->expires >> (WHEEL_BITS * level)) & SLOT_MASK];
+
+    t->next = head;
+    t->prev = head->prev;
+    head->prev->next = t;
+    head->prev = t;
+    w->cnt++;
+}
+
+void
+wheel_add(Wheel w, Timer t, double when) {
+    double	ticks = (when - w->start) / w->tick;
+
+    if (wheel_linked(t)) {
+	wheel_remove(w, t);
+    }
+    // Rounded up so a timer never fires early.
+    t->expires = (0.0 < ticks) ? (uint64_t)ticks + 1 : 0;
+    link_timer(w, t);
+}
+
+void
+wheel_remove(Wheel w, Timer t) {
+    if (wheel_linked(t)) {
+	t->prev->next = t->next;
+	t->next->prev = t->prev;
+	t->next = NULL;
+	t->prev = NULL;
+	w->cnt--;
+    }
+}
+
+// Unlinks all the timers in a slot and returns them as a NULL terminated
+// list.
+static Timer
+take_slot(Wheel w, Timer head) {
+    Timer	first = head->next;
+
+    if (first == head) {
+	return NULL;
+    }
+    head->prev->next = NULL;
+    head->next = head;
+    head->prev = head;
+
+    return first;
+}
+
+static void
+cascade(Wheel w, int level, int slot) {
+    Timer	next;
+
+    for (Timer t = take_slot(w, &w->slots[level][slot]); NULL != t; t = next) {
+	next = t->next;
+	w->cnt--;
+	link_timer(w, t);
+    }
+}
+
+// Expires every timer due at or before now. The expire function may add or
+// remove timers.
+void
+wheel_advance(Wheel w, double now, TimerExpire expire, void *ctx) {
+    double	ticks = (now - w->start) / w->tick;
+    uint64_t	target;
+    Timer	next;
+
+    if (0.0 > ticks) {
+	return;
+    }
+    target = (uint64_t)ticks;
+    for (; w->now <= target; w->now++) {
+	if (0 == w->cnt) {
+	    w->now = target + 1;
+	    break;
+	}
+	int	slot = (int)(w->now & SLOT_MASK);
+
+	if (0 == slot) {
+	    for (int l = 1; l < WHEEL_LEVELS; l++) {
+		int	s = (int)((w->now >> (WHEEL_BITS * l)) & SLOT_MASK);
+
+		cascade(w, l, s);
+		if (0 != s) {
+		    break;
+		}
+	    }
+	}
+	for (Timer t = take_slot(w, &w->slots[0][slot]); NULL != t; t = next) {
+	    next = t->next;
+	    t->next = NULL;
+	    t->prev = NULL;
+	    w->cnt--;
+	    expire(t, ctx);
+	}
+    }
+}
+
+// Returns the time the wheel next needs to be advanced or zero if there are
+// no timers. It may be early when timers in upper levels need to be moved
+// down.
+double
+wheel_next(Wheel w) {
+    if (0 == w->cnt) {
+	return 0.0;
+    }
+    uint64_t	tick = w->now;
+
+    for (int i = 0; i < WHEEL_SLOTS; i++, tick++) {
+	if (0 == (tick & SLOT_MASK) || w->slots[0][tick & SLOT_MASK].next != &w->slots[0][tick & SLOT_MASK]) {
+	    break;
+	}
+    }
+    return w->start + (double)tick * w->tick;
+}
@@ -0,0 +1,47 @@
+// Copyright 2017 by Peter Ohler, All Rights Reserved
+
+#ifndef __OPO_WHEEL_H__
+#define __OPO_WHEEL_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define WHEEL_BITS	6
+#define WHEEL_SLOTS	(1 << WHEEL_BITS)
+#define WHEEL_LEVELS	4
+
+// A timer is linked into one slot of the wheel. The next is NULL when it is
+// not in the wheel.
+typedef struct _Timer {
+    struct _Timer	*next;
+    struct _Timer	*prev;
+    uint64_t		expires; // tick
+} *Timer;
+
+typedef void	(*TimerExpire)(Timer t, void *ctx);
+
+// A hierarchical timing wheel. Level zero has a slot per tick and each
+// level above covers a full turn of the one below it in each slot. Timers in
+// upper levels are moved down as the lower level wraps around so adding,
+// removing, and expiring are all constant time. Not thread safe, the owner
+// must be the only one using it.
+typedef struct _Wheel {
+    double		tick; // seconds per tick
+    double		start;
+    uint64_t		now; // next tick to expire
+    int			cnt;
+    struct _Timer	slots[WHEEL_LEVELS][WHEEL_SLOTS];
+} *Wheel;
+
+extern void	wheel_init(Wheel w, double tick, double now);
+extern void	wheel_add(Wheel w, Timer t, double when);
+extern void	wheel_remove(Wheel w, Timer t);
+extern void	wheel_advance(Wheel w, double now, TimerExpire expire, void *ctx);
+extern double	wheel_next(Wheel w);
+
+static inline bool
+wheel_linked(Timer t) {
+    return NULL != t->next;
+}
+
+#endif /* __OPO_WHEEL_H__ */
@@ -108,9 +108,53 @@ builder_build_val_test() {
     opo_builder_cleanup(&builder);
 }
 
+void
+builder_take_test() {
+    struct _opoBuilder	builder;
+    struct _opoErr	err = OPO_ERR_INIT;
+    uint8_t		data[1024];
+    opoMsg		msg;
+    char		buf[1024];
+
+    // Taken messages can be freed as always.
+    opo_builder_init(&err, &builder, NULL, 0);
+    build_sample_msg(&builder);
+    msg = opo_builder_take(&builder);
+    ut_hex_dump_buf(msg, (int)opo_msg_bsize(msg), buf);
+    ut_same(expect_sample_dump, buf, "hex dump mismatch");
+    free((uint8_t*)msg);
+
+    opo_builder_init(&err, &builder, data, sizeof(data));
+    build_sample_msg(&builder);
+    msg = opo_builder_take_pooled(&builder);
+    ut_true(msg != data, "take did not copy the provided buffer");
+    ut_hex_dump_buf(msg, (int)opo_msg_bsize(msg), buf);
+    ut_same(expect_sample_dump, buf, "hex dump mismatch");
+    opo_msg_release_pooled(msg);
+
+    // Released messages are reused by the next take of the same size.
+    opo_builder_init(&err, &builder, data, sizeof(data));
+    build_sample_msg(&builder);
+    ut_true(msg == opo_builder_take_pooled(&builder), "released message not reused");
+    opo_msg_release_pooled(msg);
+
+    // Larger than the biggest pool class.
+    char	big[70000];
+
+    memset(big, 'x', sizeof(big) - 1);
+    big[sizeof(big) - 1] = '\0';
+    opo_builder_init(&err, &builder, NULL, 0);
+    opo_builder_push_string(&err, &builder, big, -1, NULL, 0);
+    msg = opo_builder_take_pooled(&builder);
+    ut_same_int(OPO_ERR_OK, err.code, "error building. %s", err.msg);
+    ut_same_int(sizeof(big) + 13, opo_msg_bsize(msg), "wrong size");
+    opo_msg_release_pooled(msg);
+}
+
 void
 append_builder_tests(utTest tests) {
     ut_appenda(tests, "opo.builder.buf", builder_build_buf_test, NULL);
     ut_appenda(tests, "opo.builder.alloc", builder_build_alloc_test, NULL);
     ut_appenda(tests, "opo.builder.val", builder_build_val_test, NULL);
+    ut_appenda(tests, "opo.builder.take", builder_take_test, NULL);
 }
@@ -1,20 +1,42 @@
 // Copyright 2017 by Peter Ohler, All Rights Reserved
 
+#include <errno.h>
+#include <poll.h>
 #include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #include <unistd.h>
 
 #include <opo/opo.h>
 
+#include "helper.h"
 #include "ut.h"
 
-static const char	*opod_host = "127.0.0.1";
-//static const char	*opod_host = "192.168.1.10";
-//static const char	*opod_host = "192.168.1.11";
+// Set OPOD_UNIX to the unix socket path opod listens on to run the rate and
+// latency benchmarks over it instead of loopback TCP.
+static const char*
+opod_unix() {
+    const char	*path = getenv("OPOD_UNIX");
 
-static int		opod_port = 6364;
+    return (NULL == path || '\0' == *path) ? NULL : path;
+}
+
+static const char*
+bench_transport() {
+    return (NULL == opod_unix()) ? "tcp" : "unix";
+}
+
+static opoClient
+bench_connect(opoErr err, opoClientOptions options) {
+    if (NULL != opod_unix()) {
+	return opo_client_connect_unix(err, opod_unix(), options);
+    }
+    return opo_client_connect(err, opod_host, opod_port, options);
+}
 
 static void
 connect_test() {
@@ -164,7 +186,7 @@ query_test() {
 	.pending_max = 1024,
 	.status_callback = status_callback,
     };
-    opoClient	client = opo_client_connect(&err, opod_host, opod_port, &options);
+    opoClient	client = bench_connect(&err, &options);
 
     ut_same_int(OPO_ERR_OK, err.code, "error connecting. %s", err.msg);
 
@@ -203,7 +225,13 @@ query_test() {
 	usleep(100);
     }
     dt = dtime() - start;
-    printf("--- query rate: %d in %0.3f secs  %d queries/sec\n", cnt, dt, (int)((double)cnt / dt));
+    printf("--- %s query rate: %d in %0.3f secs  %d queries/sec\n", bench_transport(), cnt, dt, (int)((double)cnt / dt));
+
+    struct _opoClientStats	stats;
+
+    opo_client_stats(client, &stats);
+    ut_true(0 < stats.send_calls, "no sends recorded");
+    printf("--- bytes per send: %0.1f\n", (double)stats.sent_bytes / (double)stats.send_calls);
 
     pthread_join(thread, NULL);
     opo_client_close(client);
@@ -239,8 +267,10 @@ async_query_test() {
     ctx.ref = 0;
     atomic_init(&ctx.pending, 0);
 
+    // Async queries are held to the timeout too so it must cover the
+    // backlog of a full window.
     struct _opoClientOptions	options = {
-	.timeout = 0.2,
+	.timeout = 2.0,
 	.pending_max = 1024,
 	.status_callback = status_callback,
 	.query_callback = async_query_cb,
@@ -351,7 +381,7 @@ dual_async_test() {
     atomic_init(&ctx1.pending, 0);
     atomic_init(&ctx2.pending, 0);
     struct _opoClientOptions	options = {
-	.timeout = 0.2,
+	.timeout = 2.0,
 	.pending_max = 4096,
 	.status_callback = status_callback,
 	.query_callback = async_query_cb,
@@ -398,6 +428,313 @@ dual_async_test() {
     opo_client_close(c2);
 }
 
+static void
+try_query_test() {
+    struct _opoErr		err = OPO_ERR_INIT;
+    struct _opoClientOptions	options = {
+	.timeout = 0.2,
+	.pending_max = 16,
+	.status_callback = status_callback,
+    };
+    opoClient	client = opo_client_connect(&err, opod_host, opod_port, &options);
+
+    ut_same_int(OPO_ERR_OK, err.code, "error connecting. %s", err.msg);
+
+    uint64_t	ref = setup_records(client);
+    uint8_t	query[1024];
+    int		cnt = 0;
+    int		sent = 0;
+    pthread_t	thread;
+
+    build_query(query, sizeof(query), 0, ref);
+    // Nothing is processing responses so the window fills.
+    while (0 != opo_client_try_query(&err, client, query, query_cb, &cnt)) {
+	sent++;
+    }
+    ut_same_int(EAGAIN, err.code, "expected a full window. %s", err.msg);
+    ut_same_int(16, sent, "sent before the window filled");
+    opo_err_clear(&err);
+
+    struct pollfd	pa;
+
+    pa.fd = opo_client_writable_fd(client);
+    pa.events = POLLIN;
+    pa.revents = 0;
+    ut_same_int(0, poll(&pa, 1, 0), "writable fd ready before room freed");
+
+    pthread_create(&thread, NULL, process_loop, client);
+    ut_same_int(1, poll(&pa, 1, 1000), "writable fd not ready after room freed");
+    ut_true(0 != opo_client_try_query(&err, client, query, query_cb, &cnt), "query not sent after room freed");
+    ut_same_int(OPO_ERR_OK, err.code, "error sending. %s", err.msg);
+
+    pthread_join(thread, NULL);
+    ut_same_int(17, cnt, "responses processed");
+    opo_client_close(client);
+}
+
+static void
+reactor_test() {
+    struct _opoErr	err = OPO_ERR_INIT;
+    opoReactor		reactor = opo_reactor_create(&err, 2);
+
+    ut_same_int(OPO_ERR_OK, err.code, "error creating reactor. %s", err.msg);
+
+    struct _opoClientOptions	options = {
+	.timeout = 2.0,
+	.pending_max = 1024,
+	.reactor = reactor,
+    };
+    opoClient	clients[16];
+    int		cnts[16];
+    uint8_t	query[1024];
+    uint64_t	ref = 0;
+    int		iter = 1000;
+    double	start = dtime();
+    double	dt;
+
+    for (int i = 0; i < 16; i++) {
+	clients[i] = opo_client_connect(&err, opod_host, opod_port, &options);
+	ut_same_int(OPO_ERR_OK, err.code, "error connecting. %s", err.msg);
+	cnts[i] = 0;
+    }
+    ref = setup_records(clients[0]);
+    build_query(query, sizeof(query), 0, ref);
+    for (int i = 0; i < 16; i++) {
+	for (int j = iter; 0 < j; j--) {
+	    opo_client_query(&err, clients[i], query, query_cb, cnts + i);
+	}
+    }
+    for (int i = 0; i < 16; i++) {
+	opo_client_process(clients[i], iter, 1.0);
+	ut_same_int(iter, cnts[i], "client %d responses", i);
+    }
+    dt = dtime() - start;
+    printf("--- 16 clients on 2 reactor threads: %d queries/sec\n", (int)((double)(iter * 16) / dt));
+
+    for (int i = 0; i < 16; i++) {
+	opo_client_close(clients[i]);
+    }
+    opo_reactor_destroy(reactor);
+}
+
+static void
+embedded_test() {
+    struct _opoErr		err = OPO_ERR_INIT;
+    struct _opoClientOptions	options = {
+	.timeout = 2.0,
+	.pending_max = 1024,
+	.status_callback = status_callback,
+	.embedded = true,
+    };
+    opoClient	client = opo_client_connect(&err, opod_host, opod_port, &options);
+
+    ut_same_int(OPO_ERR_OK, err.code, "error connecting. %s", err.msg);
+    ut_true(0 < opo_client_fd(client), "client fd not valid");
+
+    uint8_t	query[1024];
+    int		cnt = 0;
+    int		iter = 1000;
+    double	give_up = dtime() + 2.0;
+
+    build_query(query, sizeof(query), 0, 1);
+    for (int i = iter; 0 < i; i--) {
+	opo_client_query(&err, client, query, query_cb, &cnt);
+	ut_same_int(OPO_ERR_OK, err.code, "error sending. %s", err.msg);
+    }
+    ut_same_int(0, cnt, "responses processed without a pump");
+    // Busy poll like a caller driven event loop would.
+    while (cnt < iter && dtime() < give_up) {
+	opo_client_pump(client, 100);
+    }
+    ut_same_int(iter, cnt, "responses processed");
+
+    opo_client_close(client);
+}
+
+typedef struct _Submitter {
+    opoClient		client;
+    uint64_t		ref;
+    int			iter;
+    atomic_int		*cntp;
+} *Submitter;
+
+static void
+scaling_cb(opoRef ref, opoVal response, void *ctx) {
+    atomic_fetch_add((atomic_int*)ctx, 1);
+}
+
+static void*
+submit_loop(void *ctx) {
+    Submitter		sub = (Submitter)ctx;
+    struct _opoErr	err = OPO_ERR_INIT;
+    uint8_t		query[1024];
+
+    build_query(query, sizeof(query), 0, sub->ref);
+    for (int i = sub->iter; 0 < i; i--) {
+	opo_client_query(&err, sub->client, query, scaling_cb, sub->cntp);
+	if (OPO_ERR_OK != err.code) {
+	    printf("*** error sending %s\n", err.msg);
+	    opo_err_clear(&err);
+	}
+    }
+    return NULL;
+}
+
+static void
+scaling_test() {
+    struct _opoErr		err = OPO_ERR_INIT;
+    struct _opoClientOptions	options = {
+	.timeout = 2.0,
+	.pending_max = 4096,
+	.status_callback = status_callback,
+    };
+    opoClient	client = opo_client_connect(&err, opod_host, opod_port, &options);
+
+    ut_same_int(OPO_ERR_OK, err.code, "error connecting. %s", err.msg);
+
+    uint64_t		ref = setup_records(client);
+    pthread_t		thread;
+    int			iter = 128000;
+    atomic_int		cnt;
+
+    pthread_create(&thread, NULL, process_loop, client);
+    for (int tcnt = 1; tcnt <= 32; tcnt *= 2) {
+	pthread_t		threads[32];
+	struct _Submitter	subs[32];
+	double			start = dtime();
+	double			dt;
+
+	atomic_init(&cnt, 0);
+	for (int t = 0; t < tcnt; t++) {
+	    subs[t].client = client;
+	    subs[t].ref = ref;
+	    subs[t].iter = iter / tcnt;
+	    subs[t].cntp = &cnt;
+	    pthread_create(threads + t, NULL, submit_loop, subs + t);
+	}
+	for (int t = 0; t < tcnt; t++) {
+	    pthread_join(threads[t], NULL);
+	}
+	dt = dtime() - start;
+	printf("--- %2d threads: %d submissions/sec\n", tcnt, (int)((double)iter / dt));
+
+	// Drain before the next round.
+	for (double give_up = dtime() + 5.0; atomic_load(&cnt) < iter && dtime() < give_up; ) {
+	    usleep(100);
+	}
+	ut_same_int(iter, atomic_load(&cnt), "not all responses received");
+    }
+    pthread_join(thread, NULL);
+    opo_client_close(client);
+}
+
+// Queries too big for the send buffer are written directly while other
+// threads keep appending.
+static void
+oversize_test() {
+    struct _opoErr		err = OPO_ERR_INIT;
+    struct _opoClientOptions	options = {
+	.timeout = 2.0,
+	.pending_max = 1024,
+	.send_buffer_size = 4096,
+	.status_callback = status_callback,
+    };
+    opoClient	client = opo_client_connect(&err, opod_host, opod_port, &options);
+
+    ut_same_int(OPO_ERR_OK, err.code, "error connecting. %s", err.msg);
+
+    struct _opoBuilder	builder;
+    uint8_t		big[8192];
+    pthread_t		thread;
+    pthread_t		threads[2];
+    struct _Submitter	subs[2];
+    int			iter = 20;
+    atomic_int		cnt;
+
+    opo_builder_init(&err, &builder, big, sizeof(big));
+    opo_builder_push_object(&err, &builder, NULL, -1);
+    opo_builder_push_array(&err, &builder, "where", 5);
+    opo_builder_push_string(&err, &builder, "IN", 2, NULL, -1);
+    opo_builder_push_string(&err, &builder, "$ref", 4, NULL, -1);
+    for (int i = 0; i < 1000; i++) {
+	opo_builder_push_int(&err, &builder, 100000 + i, NULL, -1);
+    }
+    opo_builder_finish(&builder);
+    ut_true(4096 < opo_msg_bsize(big), "query not big enough");
+
+    atomic_init(&cnt, 0);
+    pthread_create(&thread, NULL, process_loop, client);
+    for (int t = 0; t < 2; t++) {
+	subs[t].client = client;
+	subs[t].ref = 1;
+	subs[t].iter = 5000;
+	subs[t].cntp = &cnt;
+	pthread_create(threads + t, NULL, submit_loop, subs + t);
+    }
+    for (int i = iter; 0 < i; i--) {
+	opo_client_query(&err, client, big, scaling_cb, &cnt);
+	ut_same_int(OPO_ERR_OK, err.code, "error sending. %s", err.msg);
+    }
+    for (int t = 0; t < 2; t++) {
+	pthread_join(threads[t], NULL);
+    }
+    for (double give_up = dtime() + 5.0; atomic_load(&cnt) < iter + 10000 && dtime() < give_up; ) {
+	usleep(100);
+    }
+    ut_same_int(iter + 10000, atomic_load(&cnt), "not all responses received");
+    pthread_join(thread, NULL);
+    opo_client_close(client);
+}
+
+static void
+multi_process_run(bool unordered) {
+    struct _opoErr		err = OPO_ERR_INIT;
+    struct _opoClientOptions	options = {
+	.timeout = 2.0,
+	.pending_max = 4096,
+	.status_callback = status_callback,
+	.unordered = unordered,
+    };
+    opoClient	client = opo_client_connect(&err, opod_host, opod_port, &options);
+
+    ut_same_int(OPO_ERR_OK, err.code, "error connecting. %s", err.msg);
+
+    uint64_t		ref = setup_records(client);
+    pthread_t		threads[4];
+    struct _Submitter	sub;
+    int			iter = 100000;
+    atomic_int		cnt;
+    double		start = dtime();
+    double		dt;
+
+    atomic_init(&cnt, 0);
+    for (int t = 0; t < 4; t++) {
+	pthread_create(threads + t, NULL, process_loop, client);
+    }
+    sub.client = client;
+    sub.ref = ref;
+    sub.iter = iter;
+    sub.cntp = &cnt;
+    submit_loop(&sub);
+    for (double give_up = dtime() + 5.0; atomic_load(&cnt) < iter && dtime() < give_up; ) {
+	usleep(100);
+    }
+    dt = dtime() - start;
+    printf("--- %s with 4 threads: %d queries/sec\n", unordered ? "unordered" : "ordered", (int)((double)iter / dt));
+    ut_same_int(iter, atomic_load(&cnt), "not all responses processed");
+
+    for (int t = 0; t < 4; t++) {
+	pthread_join(threads[t], NULL);
+    }
+    opo_client_close(client);
+}
+
+static void
+multi_process_test() {
+    multi_process_run(false);
+    multi_process_run(true);
+}
+
 typedef struct _Lat {
     int		cnt;
     int		max_rid;
@@ -426,7 +763,7 @@ latency_test() {
 	.pending_max = 10,
 	.status_callback = status_callback,
     };
-    opoClient	client = opo_client_connect(&err, opod_host, opod_port, &options);
+    opoClient	client = bench_connect(&err, &options);
 
     ut_same_int(OPO_ERR_OK, err.code, "error connecting. %s", err.msg);
 
@@ -473,12 +810,1412 @@ latency_test() {
 	sum += lat.times[i - 1];
 	//printf("*** %f usecs\n", lat.times[i - 1] * 1000000.0);
     }
-    printf("--- query latency: %d usecs/query\n", (int)((sum / iter) * 1000000.0));
+    printf("--- %s query latency: %d usecs/query\n", bench_transport(), (int)((sum / iter) * 1000000.0));
 
     pthread_join(thread, NULL);
     opo_client_close(client);
 }
 
+static void
+inline_latency_test() {
+    struct _opoErr		err = OPO_ERR_INIT;
+    struct _opoClientOptions	options = {
+	.timeout = 0.2,
+	.pending_max = 10,
+	.status_callback = status_callback,
+	.inline_callbacks = true,
+    };
+    opoClient	client = bench_connect(&err, &options);
+
+    ut_same_int(OPO_ERR_OK, err.code, "error connecting. %s", err.msg);
+
+    uint8_t	query[1024];
+    int		iter = 1000;
+    double	times[iter];
+    struct _Lat	lat = {
+	.cnt = 0,
+	.max_rid = iter,
+	.times = times,
+    };
+    double	done = dtime() + 5.0;
+
+    // No processing thread, callbacks are made on the receiving thread.
+    for (int i = iter; 0 < i; i--) {
+	lat.times[i - 1] = dtime();
+	build_query(query, sizeof(query), i, 1);
+	opo_client_query(&err, client, query, latency_cb, &lat);
+	ut_same_int(OPO_ERR_OK, err.code, "error sending. %s", err.msg);
+    }
+    while (lat.cnt < iter && dtime() < done) {
+	usleep(100);
+    }
+    ut_same_int(iter, lat.cnt, "responses processed");
+    ut_same_int(0, opo_client_process(client, 0, 0.0), "responses left for processing");
+
+    double	sum = 0.0;
+
+    for (int i = iter; 0 < i; i--) {
+	sum += lat.times[i - 1];
+    }
+    printf("--- %s inline query latency: %d usecs/query\n", bench_transport(), (int)((sum / iter) * 1000000.0));
+
+    opo_client_close(client);
+}
+
+// Returns a listening unix socket at the path that accepts connections but
+// never answers.
+static int
+silent_unix_server(const char *path) {
+    struct sockaddr_un	addr;
+    int			sock = socket(AF_UNIX, SOCK_STREAM, 0);
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    unlink(path);
+    bind(sock, (struct sockaddr*)&addr, sizeof(addr));
+    listen(sock, 4);
+
+    return sock;
+}
+
+typedef struct _Lost {
+    int		cnt;
+    int64_t	code;
+    double	when;
+} *Lost;
+
+static void
+lost_cb(opoRef ref, opoMsg response, void *ctx) {
+    struct _opoErr	err = OPO_ERR_INIT;
+    Lost		lost = (Lost)ctx;
+
+    lost->cnt++;
+    lost->code = opo_val_int(&err, opo_val_get(opo_msg_val(response), "code"));
+    lost->when = dtime();
+}
+
+static void
+deadline_test() {
+    struct _opoErr		err = OPO_ERR_INIT;
+    struct _opoClientOptions	options = {
+	.timeout = 0.2,
+	.pending_max = 2,
+	.unordered = true, // so the shorter deadline is not held behind the first
+    };
+    int		port;
+    int		server = silent_server(&port);
+    opoClient	client = opo_client_connect(&err, "127.0.0.1", port, &options);
+
+    ut_same_int(OPO_ERR_OK, err.code, "error connecting. %s", err.msg);
+
+    uint8_t		query[1024];
+    struct _Lost	lost = { .cnt = 0 };
+    struct _Lost	quick = { .cnt = 0 };
+    double		start = dtime();
+
+    build_query(query, sizeof(query), 1, 1);
+    opo_client_query(&err, client, query, lost_cb, &lost);
+    opo_client_query_timeout(&err, client, query, lost_cb, &quick, 0.05);
+    ut_same_int(OPO_ERR_OK, err.code, "error sending. %s", err.msg);
+    // Both slots are taken so nothing more can be sent until they time out.
+    ut_same_int(0, (int)opo_client_try_query(&err, client, query, lost_cb, &lost), "window should be full");
+    opo_err_clear(&err);
+
+    ut_same_int(2, opo_client_process(client, 2, 1.0), "timed out queries processed");
+    ut_same_int(1, lost.cnt, "default deadline callbacks");
+    ut_same_int(1, quick.cnt, "query deadline callbacks");
+    ut_same_int(OPO_ERR_LOST, (int)lost.code, "timed out response code");
+    ut_true(0.19 <= lost.when - start && lost.when - start < 0.5, "default deadline took %0.3f secs", lost.when - start);
+    ut_true(quick.when - start < 0.15, "query deadline took %0.3f secs", quick.when - start);
+    ut_same_int(0, opo_client_pending_count(client), "pending after time out");
+
+    // The slots are free again.
+    ut_true(0 != opo_client_try_query(&err, client, query, lost_cb, &lost), "window still full. %s", err.msg);
+
+    opo_client_close(client);
+    close(server);
+}
+
+// A query_callback gets the lost response when a deadline passes and the
+// query's place in the window is freed.
+static void
+deadline_async_test() {
+    struct _opoErr		err = OPO_ERR_INIT;
+    struct _Lost		lost = { .cnt = 0 };
+    struct _opoClientOptions	options = {
+	.timeout = 0.1,
+	.pending_max = 2,
+	.query_callback = lost_cb,
+	.query_ctx = &lost,
+    };
+    int		port;
+    int		server = silent_server(&port);
+    opoClient	client = opo_client_connect(&err, "127.0.0.1", port, &options);
+
+    ut_same_int(OPO_ERR_OK, err.code, "error connecting. %s", err.msg);
+
+    uint8_t	query[1024];
+    double	start = dtime();
+
+    build_query(query, sizeof(query), 1, 1);
+    opo_client_query(&err, client, query, NULL, NULL);
+    opo_client_query(&err, client, query, NULL, NULL);
+    ut_same_int(OPO_ERR_OK, err.code, "error sending. %s", err.msg);
+    ut_same_int(0, (int)opo_client_try_query(&err, client, query, NULL, NULL), "window should be full");
+    opo_err_clear(&err);
+
+    ut_same_int(2, opo_client_process(client, 2, 1.0), "timed out queries processed");
+    ut_same_int(2, lost.cnt, "deadline callbacks");
+    ut_same_int(OPO_ERR_LOST, (int)lost.code, "timed out response code");
+    ut_true(lost.when - start < 0.5, "deadline took %0.3f secs", lost.when - start);
+    ut_same_int(0, opo_client_pending_count(client), "pending after time out");
+    ut_true(0 != opo_client_try_query(&err, client, query, NULL, NULL), "window still full. %s", err.msg);
+
+    opo_client_close(client);
+    close(server);
+}
+
+static void
+ignore_cb(opoRef ref, opoVal response, void *ctx) {
+}
+
+// Deadlines on a reactor client are checked when they pass rather than on
+// the next reactor tick.
+static void
+deadline_reactor_test() {
+    struct _opoErr	err = OPO_ERR_INIT;
+    opoReactor		reactor = opo_reactor_create(&err, 1);
+
+    ut_same_int(OPO_ERR_OK, err.code, "error creating reactor. %s", err.msg);
+
+    struct _opoClientOptions	options = {
+	.timeout = 1.0,
+	.pending_max = 16,
+	.reactor = reactor,
+    };
+    int		port;
+    int		server = silent_server(&port);
+    opoClient	client = opo_client_connect(&err, "127.0.0.1", port, &options);
+
+    ut_same_int(OPO_ERR_OK, err.code, "error connecting. %s", err.msg);
+
+    uint8_t		query[1024];
+    struct _Lost	lost = { .cnt = 0 };
+    double		worst = 0.0;
+
+    build_query(query, sizeof(query), 1, 1);
+    for (int i = 0; i < 5; i++) {
+	double	start = dtime();
+	double	dt;
+
+	opo_client_query_timeout(&err, client, query, lost_cb, &lost, 0.01);
+	ut_same_int(OPO_ERR_OK, err.code, "error sending. %s", err.msg);
+	opo_client_process(client, 1, 1.0);
+	ut_same_int(i + 1, lost.cnt, "deadline callbacks");
+	if (worst < (dt = lost.when - start)) {
+	    worst = dt;
+	}
+    }
+    ut_true(worst < 0.06, "deadline took %0.3f secs", worst);
+    opo_client_close(client);
+    opo_reactor_destroy(reactor);
+    close(server);
+}
+
+static void
+async_full_test() {
+    struct _opoErr		err = OPO_ERR_INIT;
+    struct _opoClientOptions	options = {
+	.timeout = 0.2,
+	.pending_max = 2,
+	.query_callback = ignore_cb,
+    };
+    int		port;
+    int		server = silent_server(&port);
+    opoClient	client = opo_client_connect(&err, "127.0.0.1", port, &options);
+
+    ut_same_int(OPO_ERR_OK, err.code, "error connecting. %s", err.msg);
+
+    uint8_t	query[1024];
+    double	start;
+    double	dt;
+
+    build_query(query, sizeof(query), 1, 1);
+    opo_client_query(&err, client, query, NULL, NULL);
+    opo_client_query(&err, client, query, NULL, NULL);
+    ut_same_int(OPO_ERR_OK, err.code, "error sending. %s", err.msg);
+    // The window is full and nothing answers so the wait must give up.
+    start = dtime();
+    ut_same_int(0, (int)opo_client_query(&err, client, query, NULL, NULL), "window should be full");
+    dt = dtime() - start;
+    ut_same_int(EAGAIN, err.code, "full window error");
+    ut_true(0.15 <= dt && dt < 0.5, "full window wait took %0.3f secs", dt);
+    ut_same_int(2, opo_client_pending_count(client), "pending after full window");
+
+    opo_client_close(client);
+    close(server);
+}
+
+static opoClient		blocker = NULL;
+static opoClient		closer = NULL;
+static opoClient		victim = NULL;
+static atomic_bool		blocked;
+static atomic_bool		victim_closed;
+
+// Closes another client on the same reactor thread from a handler.
+static void
+close_victim_cb(opoClient client, bool connected, opoErrCode code, const char *msg) {
+    if (client == blocker && !connected) {
+	// Hold the reactor thread so the next events arrive as one batch.
+	atomic_store(&blocked, true);
+	usleep(100000);
+    } else if (client == closer && !connected && NULL != victim) {
+	opo_client_close(victim);
+	victim = NULL;
+	atomic_store(&victim_closed, true);
+    }
+}
+
+static void
+reactor_close_test() {
+    struct _opoErr	err = OPO_ERR_INIT;
+    opoReactor		reactor = opo_reactor_create(&err, 1);
+
+    ut_same_int(OPO_ERR_OK, err.code, "error creating reactor. %s", err.msg);
+
+    struct _opoClientOptions	options = {
+	.timeout = 1.0,
+	.pending_max = 16,
+	.reactor = reactor,
+	.status_callback = close_victim_cb,
+    };
+    int		port;
+    int		server = silent_server(&port);
+    int		bs;
+    int		vs;
+    int		cs;
+
+    atomic_init(&blocked, false);
+    atomic_init(&victim_closed, false);
+    // Watches are pushed on the front of the loop's list so the closer is
+    // ahead of the victim.
+    victim = opo_client_connect(&err, "127.0.0.1", port, &options);
+    ut_same_int(OPO_ERR_OK, err.code, "error connecting. %s", err.msg);
+    vs = accept(server, NULL, NULL);
+    closer = opo_client_connect(&err, "127.0.0.1", port, &options);
+    ut_same_int(OPO_ERR_OK, err.code, "error connecting. %s", err.msg);
+    cs = accept(server, NULL, NULL);
+    blocker = opo_client_connect(&err, "127.0.0.1", port, &options);
+    ut_same_int(OPO_ERR_OK, err.code, "error connecting. %s", err.msg);
+    bs = accept(server, NULL, NULL);
+
+    close(bs);
+    while (!atomic_load(&blocked)) {
+	usleep(1000);
+    }
+    // Both see a hangup in the same batch of events with the closer first.
+    close(cs);
+    close(vs);
+    for (double give_up = dtime() + 2.0; !atomic_load(&victim_closed) && dtime() < give_up; ) {
+	usleep(1000);
+    }
+    ut_true(atomic_load(&victim_closed), "victim not closed");
+    // Let a few ticks pass over the shortened list.
+    usleep(300000);
+
+    opo_client_close(closer);
+    closer = NULL;
+    opo_client_close(blocker);
+    blocker = NULL;
+    opo_reactor_destroy(reactor);
+    close(server);
+}
+
+// A query of about 3K that fits in the smallest send buffer.
+static void
+build_wide_query(uint8_t *query, size_t qsize) {
+    struct _opoErr	err = OPO_ERR_INIT;
+    struct _opoBuilder	builder;
+
+    opo_builder_init(&err, &builder, query, qsize);
+    opo_builder_push_object(&err, &builder, NULL, -1);
+    opo_builder_push_array(&err, &builder, "where", 5);
+    opo_builder_push_string(&err, &builder, "IN", 2, NULL, -1);
+    opo_builder_push_string(&err, &builder, "$ref", 4, NULL, -1);
+    for (int i = 0; i < 600; i++) {
+	opo_builder_push_int(&err, &builder, 100000 + i, NULL, -1);
+    }
+    opo_builder_finish(&builder);
+}
+
+typedef struct _Trier {
+    opoClient	client;
+    int		sent;
+    double	longest;
+} *Trier;
+
+static void*
+try_loop(void *ctx) {
+    Trier		t = (Trier)ctx;
+    struct _opoErr	err = OPO_ERR_INIT;
+    uint8_t		query[4096];
+    opoRef		ref;
+
+    build_wide_query(query, sizeof(query));
+    do {
+	double	start = dtime();
+
+	if (0 != (ref = opo_client_try_query(&err, t->client, query, NULL, NULL))) {
+	    t->sent++;
+	}
+	if (t->longest < dtime() - start) {
+	    t->longest = dtime() - start;
+	}
+    } while (0 != ref);
+
+    return NULL;
+}
+
+// Once the socket stops taking data the send buffer fills. Try queries
+// racing each other for the last of the room must get EAGAIN instead of
+// waiting for it.
+static void
+try_full_test() {
+    struct _opoErr		err = OPO_ERR_INIT;
+    struct _opoClientOptions	options = {
+	.timeout = 1.0,
+	.pending_max = 65536,
+	.send_buffer_size = 4096,
+    };
+    int		port;
+    int		server = silent_server(&port);
+    opoClient	client = opo_client_connect(&err, "127.0.0.1", port, &options);
+
+    ut_same_int(OPO_ERR_OK, err.code, "error connecting. %s", err.msg);
+
+    pthread_t		threads[4];
+    struct _Trier	triers[4];
+    int			sent = 0;
+    double		longest = 0.0;
+
+    for (int i = 0; i < 4; i++) {
+	triers[i].client = client;
+	triers[i].sent = 0;
+	triers[i].longest = 0.0;
+	pthread_create(threads + i, NULL, try_loop, triers + i);
+    }
+    for (int i = 0; i < 4; i++) {
+	pthread_join(threads[i], NULL);
+	sent += triers[i].sent;
+	if (longest < triers[i].longest) {
+	    longest = triers[i].longest;
+	}
+    }
+    ut_true(longest < 0.5, "a try query waited %0.3f secs", longest);
+    // Queries that did not fit were given back.
+    ut_same_int(sent, opo_client_pending_count(client), "pending after the buffer filled");
+    opo_client_close(client);
+
+    // An embedded batch does not wait for room either.
+    options.embedded = true;
+    client = opo_client_connect(&err, "127.0.0.1", port, &options);
+    ut_same_int(OPO_ERR_OK, err.code, "error connecting. %s", err.msg);
+
+    uint8_t	queries[8][4096];
+    opoVal	batch[8];
+    int		cnt;
+
+    for (int i = 0; i < 8; i++) {
+	build_wide_query(queries[i], sizeof(queries[i]));
+	batch[i] = queries[i];
+    }
+    sent = 0;
+    do {
+	double	start = dtime();
+
+	sent += (cnt = opo_client_query_batch(&err, client, batch, 8, NULL, NULL));
+	ut_true(dtime() - start < 0.5, "a batch waited %0.3f secs", dtime() - start);
+    } while (8 == cnt);
+    ut_same_int(EAGAIN, err.code, "expected a full buffer. %s", err.msg);
+    ut_same_int(sent, opo_client_pending_count(client), "pending after the buffer filled");
+    opo_client_close(client);
+    close(server);
+}
+
+static void
+unix_test() {
+    struct _opoErr		err = OPO_ERR_INIT;
+    struct _opoClientOptions	options = {
+	.timeout = 0.05,
+	.pending_max = 2,
+    };
+    char	path[64];
+    char	host[80];
+
+    snprintf(path, sizeof(path), "/tmp/opo-test-%d.sock", (int)getpid());
+    snprintf(host, sizeof(host), "unix:%s", path);
+
+    int		server = silent_unix_server(path);
+    opoClient	c1 = opo_client_connect_unix(&err, path, &options);
+
+    ut_same_int(OPO_ERR_OK, err.code, "error connecting. %s", err.msg);
+
+    // The host form goes to the same place.
+    opoClient	c2 = opo_client_connect(&err, host, 0, &options);
+
+    ut_same_int(OPO_ERR_OK, err.code, "error connecting with the host form. %s", err.msg);
+
+    uint8_t		query[1024];
+    struct _Lost	lost = { .cnt = 0 };
+    int			peer = accept(server, NULL, NULL);
+    char		buf[1024];
+
+    ut_true(0 <= peer, "connection not accepted");
+    build_query(query, sizeof(query), 1, 1);
+    opo_client_query(&err, c1, query, lost_cb, &lost);
+    ut_same_int(OPO_ERR_OK, err.code, "error sending. %s", err.msg);
+
+    // The query arrives framed as it would be over TCP.
+    ut_same_int((int)opo_msg_bsize(query), (int)read(peer, buf, sizeof(buf)), "bytes received");
+    ut_same_int(1, opo_client_process(c1, 1, 1.0), "timed out query processed");
+    ut_same_int(OPO_ERR_LOST, (int)lost.code, "timed out response code");
+
+    opo_client_close(c1);
+    opo_client_close(c2);
+    close(peer);
+    close(server);
+    unlink(path);
+
+    char	long_path[200];
+
+    memset(long_path, 'x', sizeof(long_path) - 1);
+    long_path[sizeof(long_path) - 1] = '\0';
+    ut_true(NULL == opo_client_connect_unix(&err, long_path, &options), "connected to a path that is too long");
+    ut_same_int(OPO_ERR_ARG, err.code, "error for a path that is too long");
+}
+
+static void
+cancel_test() {
+    struct _opoErr		err = OPO_ERR_INIT;
+    struct _opoClientOptions	options = {
+	.timeout = 0.2,
+	.pending_max = 2,
+    };
+    int		port;
+    int		server = silent_server(&port);
+    opoClient	client = opo_client_connect(&err, "127.0.0.1", port, &options);
+
+    ut_same_int(OPO_ERR_OK, err.code, "error connecting. %s", err.msg);
+
+    uint8_t		query[1024];
+    struct _Lost	canceled = { .cnt = 0 };
+    struct _Lost	lost = { .cnt = 0 };
+    opoRef		ref;
+
+    build_query(query, sizeof(query), 1, 1);
+    ref = opo_client_query(&err, client, query, lost_cb, &canceled);
+    opo_client_query(&err, client, query, lost_cb, &lost);
+    ut_same_int(OPO_ERR_OK, err.code, "error sending. %s", err.msg);
+
+    // The callback is made right away and the slot freed.
+    ut_true(opo_client_cancel(client, ref), "cancel failed");
+    ut_same_int(1, canceled.cnt, "canceled callbacks");
+    ut_same_int(OPO_ERR_CANCELED, (int)canceled.code, "canceled response code");
+    ut_true(!opo_client_cancel(client, ref), "canceled twice");
+    ut_same_int(1, opo_client_pending_count(client), "pending after cancel");
+    ut_true(0 != opo_client_try_query(&err, client, query, lost_cb, &lost), "no room after cancel. %s", err.msg);
+
+    // Processing in order moves past the canceled query.
+    ut_same_int(2, opo_client_process(client, 2, 1.0), "timed out queries processed");
+    ut_same_int(2, lost.cnt, "timed out callbacks");
+    ut_same_int(1, canceled.cnt, "canceled callbacks after processing");
+
+    opo_client_close(client);
+    close(server);
+}
+
+static atomic_int	status_errors;
+
+static void
+count_status(opoClient client, bool connected, opoErrCode code, const char *msg) {
+    if (OPO_ERR_OK != code) {
+	atomic_fetch_add(&status_errors, 1);
+    }
+}
+
+static void
+cancel_late_test() {
+    struct _opoErr		err = OPO_ERR_INIT;
+    struct _opoClientOptions	options = {
+	.timeout = 1.0,
+	.pending_max = 64,
+	.status_callback = count_status,
+    };
+    opoClient	client = opo_client_connect(&err, opod_host, opod_port, &options);
+
+    ut_same_int(OPO_ERR_OK, err.code, "error connecting. %s", err.msg);
+
+    uint8_t	query[1024];
+    atomic_int	cnt;
+    int		iter = 1000;
+
+    atomic_init(&cnt, 0);
+    atomic_init(&status_errors, 0);
+    build_query(query, sizeof(query), 1, 1);
+    // Most are canceled before the response arrives and the rest are
+    // answered. Either way there is one callback each and the late
+    // responses are dropped quietly.
+    for (int i = iter; 0 < i; i--) {
+	opo_client_cancel(client, opo_client_query(&err, client, query, count_cb, &cnt));
+	opo_client_process(client, 0, 0.0);
+    }
+    ut_same_int(OPO_ERR_OK, err.code, "error sending. %s", err.msg);
+    while (atomic_load(&cnt) < iter && 0 < opo_client_process(client, 0, 0.2)) {
+    }
+    usleep(100000);
+    ut_same_int(iter, atomic_load(&cnt), "callbacks");
+    ut_same_int(0, atomic_load(&status_errors), "status errors");
+
+    opo_client_close(client);
+}
+
+static atomic_int	async_calls[1024];
+
+static void
+async_count_cb(opoRef ref, opoMsg response, void *ctx) {
+    if (ref < sizeof(async_calls) / sizeof(*async_calls)) {
+	atomic_fetch_add(async_calls + ref, 1);
+    }
+}
+
+// Cancels race responses called back inline from the receiving thread.
+// Either way each query gets exactly one callback.
+static void
+async_cancel_test() {
+    struct _opoErr		err = OPO_ERR_INIT;
+    struct _opoClientOptions	options = {
+	.timeout = 1.0,
+	.pending_max = 64,
+	.status_callback = count_status,
+	.query_callback = async_count_cb,
+	.inline_callbacks = true,
+    };
+    opoClient	client = opo_client_connect(&err, opod_host, opod_port, &options);
+
+    ut_same_int(OPO_ERR_OK, err.code, "error connecting. %s", err.msg);
+
+    uint8_t	query[1024];
+    int		iter = 1000;
+    double	give_up;
+    opoRef	ref;
+
+    atomic_init(&status_errors, 0);
+    for (int i = 0; i < (int)(sizeof(async_calls) / sizeof(*async_calls)); i++) {
+	atomic_init(async_calls + i, 0);
+    }
+    build_query(query, sizeof(query), 1, 1);
+    for (int i = 0; i < iter; i++) {
+	ref = opo_client_query(&err, client, query, NULL, NULL);
+	if (0 == i % 3) {
+	    usleep(50);
+	}
+	opo_client_cancel(client, ref);
+    }
+    ut_same_int(OPO_ERR_OK, err.code, "error sending. %s", err.msg);
+    give_up = dtime() + 1.0;
+    while (0 < opo_client_pending_count(client) && dtime() < give_up) {
+	usleep(1000);
+    }
+    usleep(100000);
+    ut_same_int(0, opo_client_pending_count(client), "pending");
+    for (int i = 1; i <= iter; i++) {
+	ut_same_int(1, atomic_load(async_calls + i), "callbacks for query %d", i);
+    }
+    // A query already called back can not be canceled.
+    ref = opo_client_query(&err, client, query, NULL, NULL);
+    give_up = dtime() + 1.0;
+    while (0 == atomic_load(async_calls + ref) && dtime() < give_up) {
+	usleep(1000);
+    }
+    ut_true(!opo_client_cancel(client, ref), "canceled after the callback");
+    ut_same_int(1, atomic_load(async_calls + ref), "callbacks after a late cancel");
+    ut_same_int(0, opo_client_pending_count(client), "pending after a late cancel");
+    ut_same_int(0, atomic_load(&status_errors), "status errors");
+
+    opo_client_close(client);
+}
+
+typedef struct _Caller {
+    opoClient	client;
+    int		base;
+    int		iter;
+    int		matched;
+    double	elapsed;
+} *Caller;
+
+static void*
+call_loop(void *ctx) {
+    Caller	caller = (Caller)ctx;
+    uint8_t	query[1024];
+    double	start = dtime();
+
+    for (int i = 1; i <= caller->iter; i++) {
+	struct _opoErr	err = OPO_ERR_INIT;
+	int64_t		rid = caller->base + i;
+	opoMsg		resp;
+
+	build_query(query, sizeof(query), rid, 1);
+	if (NULL == (resp = opo_client_call(&err, caller->client, query, 1.0))) {
+	    break;
+	}
+	if (rid == opo_val_int(&err, opo_val_get(opo_msg_val(resp), "rid"))) {
+	    caller->matched++;
+	}
+	opo_msg_release_pooled(resp);
+    }
+    caller->elapsed = dtime() - start;
+
+    return NULL;
+}
+
+static void
+call_test() {
+    struct _opoErr		err = OPO_ERR_INIT;
+    struct _opoClientOptions	options = {
+	.timeout = 1.0,
+	.pending_max = 64,
+    };
+    opoClient	client = opo_client_connect(&err, opod_host, opod_port, &options);
+
+    ut_same_int(OPO_ERR_OK, err.code, "error connecting. %s", err.msg);
+
+    // No processing thread, each caller gets its own response back.
+    struct _Caller	callers[4];
+    pthread_t		threads[4];
+    double		sum = 0.0;
+
+    for (int i = 0; i < 4; i++) {
+	callers[i].client = client;
+	callers[i].base = i * 10000;
+	callers[i].iter = 1000;
+	callers[i].matched = 0;
+	pthread_create(&threads[i], NULL, call_loop, &callers[i]);
+    }
+    for (int i = 0; i < 4; i++) {
+	pthread_join(threads[i], NULL);
+	ut_same_int(callers[i].iter, callers[i].matched, "responses matched for caller %d", i);
+	sum += callers[i].elapsed / callers[i].iter;
+    }
+    printf("--- call latency: %d usecs/call\n", (int)((sum / 4) * 1000000.0));
+    ut_same_int(0, opo_client_pending_count(client), "pending after calls");
+    opo_client_close(client);
+
+    // An embedded client is pumped by the caller.
+    options.embedded = true;
+    client = opo_client_connect(&err, opod_host, opod_port, &options);
+    ut_same_int(OPO_ERR_OK, err.code, "error connecting. %s", err.msg);
+    callers[0].client = client;
+    callers[0].iter = 10;
+    callers[0].matched = 0;
+    call_loop(&callers[0]);
+    ut_same_int(10, callers[0].matched, "embedded responses matched");
+    opo_client_close(client);
+}
+
+static void
+call_timeout_test() {
+    struct _opoErr		err = OPO_ERR_INIT;
+    struct _opoClientOptions	options = {
+	.timeout = 1.0,
+	.pending_max = 2,
+    };
+    int		port;
+    int		server = silent_server(&port);
+    opoClient	client = opo_client_connect(&err, "127.0.0.1", port, &options);
+
+    ut_same_int(OPO_ERR_OK, err.code, "error connecting. %s", err.msg);
+
+    uint8_t	query[1024];
+    double	start = dtime();
+
+    build_query(query, sizeof(query), 1, 1);
+    ut_true(NULL == opo_client_call(&err, client, query, 0.1), "expected no response");
+    ut_same_int(OPO_ERR_LOST, err.code, "timed out call error");
+    ut_true(dtime() - start < 0.5, "call took too long to time out");
+    ut_same_int(0, opo_client_pending_count(client), "pending after timeout");
+
+    opo_client_close(client);
+    close(server);
+}
+
+typedef struct _Batch {
+    atomic_int	cnt;
+    atomic_int	matched;
+} *Batch;
+
+static Batch	batch_ctx = NULL;
+
+static void
+batch_cb(opoRef ref, opoMsg response, void *ctx) {
+    struct _opoErr	err = OPO_ERR_INIT;
+
+    if (*(int64_t*)ctx == opo_val_int(&err, opo_val_get(opo_msg_val(response), "rid"))) {
+	atomic_fetch_add(&batch_ctx->matched, 1);
+    }
+    atomic_fetch_add(&batch_ctx->cnt, 1);
+}
+
+static void
+batch_async_cb(opoRef ref, opoMsg response, void *ctx) {
+    atomic_fetch_add(&((Batch)ctx)->cnt, 1);
+}
+
+static void
+batch_wait(Batch batch, int cnt) {
+    for (double give_up = dtime() + 5.0; atomic_load(&batch->cnt) < cnt && dtime() < give_up; ) {
+	usleep(100);
+    }
+}
+
+static void
+batch_test() {
+    struct _opoErr		err = OPO_ERR_INIT;
+    struct _opoClientOptions	options = {
+	.timeout = 2.0,
+	.pending_max = 4096,
+    };
+    opoClient	client = opo_client_connect(&err, opod_host, opod_port, &options);
+
+    ut_same_int(OPO_ERR_OK, err.code, "error connecting. %s", err.msg);
+
+    int			iter = 4096;
+    uint8_t		*buf = (uint8_t*)malloc(iter * 128);
+    opoVal		*queries = (opoVal*)malloc(iter * sizeof(opoVal));
+    void		**ctxs = (void**)malloc(iter * sizeof(void*));
+    int64_t		*rids = (int64_t*)malloc(iter * sizeof(int64_t));
+    struct _Batch	batch;
+    pthread_t		thread;
+    double		start;
+    double		single;
+    double		batched;
+
+    for (int i = 0; i < iter; i++) {
+	rids[i] = i + 1;
+	build_query(buf + i * 128, 128, rids[i], 1);
+	queries[i] = buf + i * 128;
+	ctxs[i] = rids + i;
+    }
+    batch_ctx = &batch;
+    pthread_create(&thread, NULL, process_loop, client);
+
+    atomic_init(&batch.cnt, 0);
+    atomic_init(&batch.matched, 0);
+    start = dtime();
+    for (int i = 0; i < iter; i++) {
+	opo_client_query(&err, client, queries[i], batch_cb, ctxs[i]);
+    }
+    single = dtime() - start;
+    batch_wait(&batch, iter);
+    ut_same_int(iter, atomic_load(&batch.matched), "single responses matched");
+
+    atomic_init(&batch.cnt, 0);
+    atomic_init(&batch.matched, 0);
+    start = dtime();
+    ut_same_int(iter, opo_client_query_batch(&err, client, queries, iter, batch_cb, ctxs), "batch sent. %s", err.msg);
+    batched = dtime() - start;
+    batch_wait(&batch, iter);
+    ut_same_int(iter, atomic_load(&batch.matched), "batch responses matched");
+    printf("--- single: %d submissions/sec, batch: %d submissions/sec\n",
+	   (int)((double)iter / single), (int)((double)iter / batched));
+
+    pthread_join(thread, NULL);
+    opo_client_close(client);
+
+    // Batches work the same with a query_callback.
+    atomic_init(&batch.cnt, 0);
+    options.query_callback = batch_async_cb;
+    options.query_ctx = &batch;
+    client = opo_client_connect(&err, opod_host, opod_port, &options);
+    ut_same_int(OPO_ERR_OK, err.code, "error connecting. %s", err.msg);
+    pthread_create(&thread, NULL, process_loop, client);
+    ut_same_int(iter, opo_client_query_batch(&err, client, queries, iter, NULL, NULL), "async batch sent. %s", err.msg);
+    batch_wait(&batch, iter);
+    ut_same_int(iter, atomic_load(&batch.cnt), "async batch responses");
+    pthread_join(thread, NULL);
+    opo_client_close(client);
+
+    free(buf);
+    free(queries);
+    free(ctxs);
+    free(rids);
+}
+
+static void
+build_update(uint8_t *query, size_t qsize, uint64_t ref) {
+    struct _opoErr	err = OPO_ERR_INIT;
+    struct _opoBuilder	builder;
+
+    opo_builder_init(&err, &builder, query, qsize);
+    opo_builder_push_object(&err, &builder, NULL, -1);
+    opo_builder_push_int(&err, &builder, (int64_t)ref, "where", 5);
+    opo_builder_push_object(&err, &builder, "update", 6);
+    opo_builder_push_int(&err, &builder, 101, "price", 5);
+    opo_builder_pop(&err, &builder);
+    opo_builder_finish(&builder);
+}
+
+// Sends a query and returns true if it was answered from the cache.
+static bool
+cached_query(opoClient client, uint8_t *query) {
+    struct _opoErr	err = OPO_ERR_INIT;
+    atomic_int		cnt;
+    opoRef		ref;
+
+    atomic_init(&cnt, 0);
+    ref = opo_client_query(&err, client, query, count_cb, &cnt);
+    if (1 == atomic_load(&cnt)) {
+	return 0 != (ref & 0x8000000000000000ULL);
+    }
+    opo_client_process(client, 1, 1.0);
+
+    return false;
+}
+
+static void
+cache_test() {
+    struct _opoErr		err = OPO_ERR_INIT;
+    struct _opoClientOptions	options = {
+	.timeout = 1.0,
+	.pending_max = 64,
+	.cache_size = 1000000,
+	.cache_ttl = 0.3,
+    };
+    opoClient	client = opo_client_connect(&err, opod_host, opod_port, &options);
+
+    ut_same_int(OPO_ERR_OK, err.code, "error connecting. %s", err.msg);
+
+    uint8_t			q1[1024];
+    uint8_t			q2[1024];
+    uint8_t			write[1024];
+    struct _opoClientStats	stats;
+
+    build_query(q1, sizeof(q1), 0, 1);
+    build_query(q2, sizeof(q2), 0, 2);
+    ut_true(!cached_query(client, q1), "first query should not be cached");
+    ut_true(!cached_query(client, q2), "first query should not be cached");
+    ut_true(cached_query(client, q1), "repeat should be cached");
+    ut_true(cached_query(client, q2), "repeat should be cached");
+    ut_same_int(0, opo_client_pending_count(client), "cache hits should not be pending");
+
+    // A write to record 1 only drops the entries for record 1.
+    build_update(write, sizeof(write), 1);
+    cached_query(client, write);
+    ut_true(!cached_query(client, q1), "write should invalidate");
+    ut_true(cached_query(client, q2), "write to another record should not invalidate");
+    ut_true(cached_query(client, q1), "refilled after write");
+
+    opo_client_stats(client, &stats);
+    ut_same_int(4, (int)stats.cache_hits, "cache hits");
+
+    usleep(350000);
+    ut_true(!cached_query(client, q1), "expired entry should not be served");
+    opo_client_close(client);
+
+    // Older entries are evicted to stay in budget.
+    options.cache_size = 4000;
+    client = opo_client_connect(&err, opod_host, opod_port, &options);
+    ut_same_int(OPO_ERR_OK, err.code, "error connecting. %s", err.msg);
+    cached_query(client, q1);
+    ut_true(cached_query(client, q1), "repeat should be cached");
+    for (int i = 100; i < 200; i++) {
+	build_query(q2, sizeof(q2), 0, i);
+	cached_query(client, q2);
+    }
+    ut_true(!cached_query(client, q1), "entry should have been evicted");
+    opo_client_close(client);
+
+    // A budget smaller than one entry still answers every query.
+    options.cache_size = 1;
+    client = opo_client_connect(&err, opod_host, opod_port, &options);
+    ut_same_int(OPO_ERR_OK, err.code, "error connecting. %s", err.msg);
+    for (int i = 0; i < 3; i++) {
+	ut_true(!cached_query(client, q1), "nothing fits in the budget");
+    }
+    opo_client_close(client);
+}
+
+typedef struct _Flock {
+    int		cnt;
+    int		canceled;
+    opoMsg	resp;
+    bool	shared; // all responses were the same buffer
+} *Flock;
+
+static void
+flock_cb(opoRef ref, opoMsg response, void *ctx) {
+    Flock		flock = (Flock)ctx;
+    struct _opoErr	err = OPO_ERR_INIT;
+
+    if (OPO_ERR_CANCELED == opo_val_int(&err, opo_val_get(opo_msg_val(response), "code"))) {
+	flock->canceled++;
+	return;
+    }
+    if (NULL == flock->resp) {
+	flock->resp = response;
+    } else if (response != flock->resp) {
+	flock->shared = false;
+    }
+    flock->cnt++;
+}
+
+// Flights whose sent query gets no response are dropped once the queries
+// that joined them time out as well.
+static void
+coalesce_lost_test() {
+    struct _opoErr		err = OPO_ERR_INIT;
+    struct _opoClientOptions	options = {
+	.timeout = 0.1,
+	.pending_max = 64,
+	.embedded = true,
+	.coalesce = true,
+    };
+    int		port;
+    int		server = silent_server(&port);
+    opoClient	client = opo_client_connect(&err, "127.0.0.1", port, &options);
+
+    ut_same_int(OPO_ERR_OK, err.code, "error connecting. %s", err.msg);
+
+    uint8_t			query[1024];
+    struct _opoClientStats	stats;
+    struct _Lost		lost = { .cnt = 0 };
+    double			give_up = dtime() + 2.0;
+
+    build_query(query, sizeof(query), 0, 1);
+    for (int round = 1; round <= 3; round++) {
+	for (int i = 0; i < 3; i++) {
+	    opo_client_query(&err, client, query, lost_cb, &lost);
+	    ut_same_int(OPO_ERR_OK, err.code, "error sending. %s", err.msg);
+	}
+	while (lost.cnt < round * 3 && dtime() < give_up) {
+	    opo_client_pump(client, 100);
+	    usleep(1000);
+	}
+	ut_same_int(round * 3, lost.cnt, "timed out queries");
+	ut_same_int(0, opo_client_pending_count(client), "pending after time out");
+	// Each round starts a new flight rather than joining a lost one.
+	opo_client_stats(client, &stats);
+	ut_same_int(round * 2, (int)stats.coalesced, "queries coalesced");
+    }
+    opo_client_close(client);
+    close(server);
+}
+
+static void
+coalesce_test() {
+    struct _opoErr		err = OPO_ERR_INIT;
+    struct _opoClientOptions	options = {
+	.timeout = 1.0,
+	.pending_max = 64,
+	.embedded = true,
+	.coalesce = true,
+    };
+    opoClient	client = opo_client_connect(&err, opod_host, opod_port, &options);
+
+    ut_same_int(OPO_ERR_OK, err.code, "error connecting. %s", err.msg);
+
+    uint8_t			query[1024];
+    uint8_t			write[1024];
+    opoRef			refs[10];
+    struct _Flock		flock = { .cnt = 0, .canceled = 0, .resp = NULL, .shared = true };
+    struct _opoClientStats	stats;
+    atomic_int			wcnt;
+    double			give_up = dtime() + 2.0;
+
+    atomic_init(&wcnt, 0);
+    // Nothing is read until pumped so all but the first join it.
+    build_query(query, sizeof(query), 0, 1);
+    for (int i = 0; i < 10; i++) {
+	refs[i] = opo_client_query(&err, client, query, flock_cb, &flock);
+	ut_same_int(OPO_ERR_OK, err.code, "error sending. %s", err.msg);
+    }
+    opo_client_stats(client, &stats);
+    ut_same_int(9, (int)stats.coalesced, "queries coalesced");
+    ut_same_int(10, opo_client_pending_count(client), "each query is pending");
+
+    // Canceling the one sent does not cancel those that joined it.
+    ut_true(opo_client_cancel(client, refs[0]), "cancel sent query");
+    ut_true(opo_client_cancel(client, refs[5]), "cancel joined query");
+    while (flock.cnt < 8 && dtime() < give_up) {
+	opo_client_pump(client, 100);
+    }
+    ut_same_int(8, flock.cnt, "responses");
+    ut_same_int(2, flock.canceled, "canceled");
+    ut_true(flock.shared, "response should be shared");
+    ut_same_int(0, opo_client_pending_count(client), "pending after responses");
+
+    // A read after a write does not join one sent before it.
+    flock.cnt = 0;
+    flock.resp = NULL;
+    opo_client_query(&err, client, query, flock_cb, &flock);
+    build_update(write, sizeof(write), 1);
+    opo_client_query(&err, client, write, count_cb, &wcnt);
+    opo_client_query(&err, client, query, flock_cb, &flock);
+    opo_client_stats(client, &stats);
+    ut_same_int(9, (int)stats.coalesced, "queries coalesced across a write");
+    while ((flock.cnt < 2 || atomic_load(&wcnt) < 1) && dtime() < give_up) {
+	opo_client_pump(client, 100);
+    }
+    ut_same_int(2, flock.cnt, "responses after write");
+
+    // Futures get a copy of the shared response with their own id.
+    opoFuture	futures[2] = { opo_future_create(&err), opo_future_create(&err) };
+
+    for (int i = 0; i < 2; i++) {
+	refs[i] = opo_client_query_future(&err, client, query, futures[i]);
+	ut_same_int(OPO_ERR_OK, err.code, "error sending. %s", err.msg);
+    }
+    opo_client_stats(client, &stats);
+    ut_same_int(10, (int)stats.coalesced, "future coalesced");
+    for (int i = 0; i < 2; i++) {
+	opoMsg	resp = opo_future_wait(&err, futures[i], 2.0);
+
+	ut_same_int(OPO_ERR_OK, err.code, "future response. %s", err.msg);
+	ut_same_int(refs[i], opo_msg_id(resp), "future response id");
+	opo_future_destroy(futures[i]);
+    }
+    opo_client_close(client);
+
+    // A stampede of the same query from several threads.
+    options.embedded = false;
+    options.pending_max = 4096;
+    client = opo_client_connect(&err, opod_host, opod_port, &options);
+    ut_same_int(OPO_ERR_OK, err.code, "error connecting. %s", err.msg);
+
+    pthread_t		thread;
+    pthread_t		threads[8];
+    struct _Submitter	subs[8];
+    atomic_int		cnt;
+    int			iter = 80000;
+
+    atomic_init(&cnt, 0);
+    pthread_create(&thread, NULL, process_loop, client);
+    for (int t = 0; t < 8; t++) {
+	subs[t].client = client;
+	subs[t].ref = 1;
+	subs[t].iter = iter / 8;
+	subs[t].cntp = &cnt;
+	pthread_create(threads + t, NULL, submit_loop, subs + t);
+    }
+    for (int t = 0; t < 8; t++) {
+	pthread_join(threads[t], NULL);
+    }
+    for (give_up = dtime() + 5.0; atomic_load(&cnt) < iter && dtime() < give_up; ) {
+	usleep(100);
+    }
+    ut_same_int(iter, atomic_load(&cnt), "stampede responses");
+    opo_client_stats(client, &stats);
+    printf("--- %d of %d queries coalesced\n", (int)stats.coalesced, iter);
+    pthread_join(thread, NULL);
+    opo_client_close(client);
+}
+
+typedef struct _Fetch {
+    int64_t	ref;
+    int64_t	got; // ref of the record in the response, zero if none
+    int		done;
+} *Fetch;
+
+static void
+fetch_cb(opoRef ref, opoMsg response, void *ctx) {
+    Fetch		f = (Fetch)ctx;
+    struct _opoErr	err = OPO_ERR_INIT;
+    opoVal		results = opo_val_get(opo_msg_val(response), "results");
+
+    if (NULL != results && 1 == opo_val_member_count(&err, results)) {
+	f->got = opo_val_int(&err, opo_val_get(opo_val_members(&err, results), "ref"));
+    }
+    f->done++;
+}
+
+static void
+multiget_test() {
+    struct _opoErr		err = OPO_ERR_INIT;
+    struct _opoClientOptions	options = {
+	.timeout = 1.0,
+	.pending_max = 64,
+	.multiget_window = 0.05,
+	.multiget_max = 8,
+    };
+    opoClient	client = opo_client_connect(&err, opod_host, opod_port, &options);
+
+    ut_same_int(OPO_ERR_OK, err.code, "error connecting. %s", err.msg);
+
+    uint8_t			query[1024];
+    struct _Fetch		fetches[11];
+    struct _opoClientStats	stats;
+    int				cnt = 0;
+    double			start = dtime();
+
+    // The first eight fill a gather and are sent at once. The rest wait
+    // out the window. Records over 1000 do not exist.
+    for (int i = 0; i < 11; i++) {
+	fetches[i].ref = (10 == i) ? 2000 : i + 1;
+	fetches[i].got = 0;
+	fetches[i].done = 0;
+	build_query(query, sizeof(query), 0, fetches[i].ref);
+	opo_client_query(&err, client, query, fetch_cb, fetches + i);
+	ut_same_int(OPO_ERR_OK, err.code, "error sending. %s", err.msg);
+    }
+    while (cnt < 8 && dtime() < start + 1.0) {
+	cnt += opo_client_process(client, 8 - cnt, 0.1);
+    }
+    ut_true(dtime() - start < options.multiget_window, "full gather should not wait");
+    while (cnt < 11 && dtime() < start + 1.0) {
+	cnt += opo_client_process(client, 11 - cnt, 0.1);
+    }
+    ut_true(options.multiget_window <= dtime() - start, "partial gather should wait");
+    ut_same_int(11, cnt, "fetches");
+    for (int i = 0; i < 11; i++) {
+	ut_same_int(1, fetches[i].done, "fetch %d callbacks", i);
+	ut_same_int((10 == i) ? 0 : (int)fetches[i].ref, (int)fetches[i].got, "fetch %d record", i);
+    }
+    opo_client_stats(client, &stats);
+    ut_same_int(2, (int)stats.multigets, "gathered queries sent");
+
+    // Anything but a plain fetch is sent on its own.
+    atomic_int	other;
+
+    atomic_init(&other, 0);
+    build_query(query, sizeof(query), 3, 1);
+    opo_client_query(&err, client, query, count_cb, &other);
+    opo_client_process(client, 1, 1.0);
+    ut_same_int(1, atomic_load(&other), "other query");
+    opo_client_stats(client, &stats);
+    ut_same_int(2, (int)stats.multigets, "gathered queries sent");
+    opo_client_close(client);
+
+    // A burst from several threads with a short window.
+    options.pending_max = 4096;
+    options.multiget_window = 0.001;
+    options.multiget_max = 0;
+    client = opo_client_connect(&err, opod_host, opod_port, &options);
+    ut_same_int(OPO_ERR_OK, err.code, "error connecting. %s", err.msg);
+
+    pthread_t		thread;
+    pthread_t		threads[4];
+    struct _Submitter	subs[4];
+    atomic_int		acnt;
+    int			iter = 40000;
+
+    atomic_init(&acnt, 0);
+    pthread_create(&thread, NULL, process_loop, client);
+    for (int t = 0; t < 4; t++) {
+	subs[t].client = client;
+	subs[t].ref = t + 1;
+	subs[t].iter = iter / 4;
+	subs[t].cntp = &acnt;
+	pthread_create(threads + t, NULL, submit_loop, subs + t);
+    }
+    for (int t = 0; t < 4; t++) {
+	pthread_join(threads[t], NULL);
+    }
+    for (double give_up = dtime() + 5.0; atomic_load(&acnt) < iter && dtime() < give_up; ) {
+	usleep(100);
+    }
+    ut_same_int(iter, atomic_load(&acnt), "burst responses");
+    opo_client_stats(client, &stats);
+    printf("--- %d fetches in %d queries\n", iter, (int)stats.multigets);
+    pthread_join(thread, NULL);
+    opo_client_close(client);
+}
+
+static void
+build_insert(uint8_t *query, size_t qsize, int i) {
+    struct _opoErr	err = OPO_ERR_INIT;
+    struct _opoBuilder	builder;
+
+    opo_builder_init(&err, &builder, query, qsize);
+    opo_builder_push_object(&err, &builder, NULL, -1);
+    opo_builder_push_object(&err, &builder, "insert", -1);
+    opo_builder_push_string(&err, &builder, "Trade", 5, "kind", 4);
+    opo_builder_push_int(&err, &builder, 1512247371000000000LL + i, "when", 4);
+    opo_builder_push_string(&err, &builder, "OPO", 3, "symbol", 6);
+    opo_builder_push_int(&err, &builder, 100 + i, "price", 5);
+    opo_builder_finish(&builder);
+}
+
+// Inserts ten records and checks they were given refs in order. Returns
+// the number of callbacks.
+static int
+insert_ten(opoClient client, double wait) {
+    struct _opoErr	err = OPO_ERR_INIT;
+    uint8_t		query[1024];
+    uint64_t		refs[10];
+    int			cnt = 0;
+    double		give_up = dtime() + wait;
+
+    for (int i = 0; i < 10; i++) {
+	refs[i] = 0;
+	build_insert(query, sizeof(query), i);
+	opo_client_query(&err, client, query, add_cb, refs + i);
+	ut_same_int(OPO_ERR_OK, err.code, "error sending. %s", err.msg);
+    }
+    while (cnt < 10 && dtime() < give_up) {
+	cnt += opo_client_process(client, 10 - cnt, 0.1);
+    }
+    for (int i = 1; i < 10; i++) {
+	ut_same_int((int)(refs[0] + i), (int)refs[i], "ref of insert %d", i);
+    }
+    return cnt;
+}
+
+// A reactor client sends a lone fetch when its window ends rather than on
+// the next reactor tick.
+static void
+multiget_reactor_test() {
+    struct _opoErr	err = OPO_ERR_INIT;
+    opoReactor		reactor = opo_reactor_create(&err, 1);
+
+    ut_same_int(OPO_ERR_OK, err.code, "error creating reactor. %s", err.msg);
+
+    struct _opoClientOptions	options = {
+	.timeout = 1.0,
+	.pending_max = 64,
+	.multiget_window = 0.002,
+	.multiget_max = 8,
+	.reactor = reactor,
+    };
+    opoClient	client = opo_client_connect(&err, opod_host, opod_port, &options);
+
+    ut_same_int(OPO_ERR_OK, err.code, "error connecting. %s", err.msg);
+
+    uint8_t			query[1024];
+    struct _Fetch		fetch;
+    struct _opoClientStats	stats;
+    double			worst = 0.0;
+
+    for (int i = 0; i < 10; i++) {
+	double	start = dtime();
+	double	dt;
+
+	fetch.ref = i + 1;
+	fetch.got = 0;
+	fetch.done = 0;
+	build_query(query, sizeof(query), 0, fetch.ref);
+	opo_client_query(&err, client, query, fetch_cb, &fetch);
+	ut_same_int(OPO_ERR_OK, err.code, "error sending. %s", err.msg);
+	opo_client_process(client, 1, 1.0);
+	ut_same_int(1, fetch.done, "fetch %d callbacks", i);
+	if (worst < (dt = dtime() - start)) {
+	    worst = dt;
+	}
+    }
+    ut_true(worst < 0.05, "lone fetch took %0.3f secs", worst);
+    opo_client_stats(client, &stats);
+    ut_same_int(10, (int)stats.multigets, "gathered queries sent");
+    opo_client_close(client);
+    opo_reactor_destroy(reactor);
+}
+
+static void
+multiput_test() {
+    struct _opoErr		err = OPO_ERR_INIT;
+    struct _opoClientOptions	options = {
+	.timeout = 1.0,
+	.pending_max = 64,
+	.multiput_window = 0.5,
+    };
+    opoClient	client = opo_client_connect(&err, opod_host, opod_port, &options);
+
+    ut_same_int(OPO_ERR_OK, err.code, "error connecting. %s", err.msg);
+
+    uint8_t			query[1024];
+    struct _opoClientStats	stats;
+    atomic_int			cnt;
+    double			start = dtime();
+
+    atomic_init(&cnt, 0);
+    // Any other query sends the inserts before it.
+    for (int i = 0; i < 3; i++) {
+	build_insert(query, sizeof(query), i);
+	opo_client_query(&err, client, query, count_cb, &cnt);
+    }
+    opo_client_stats(client, &stats);
+    ut_same_int(0, (int)stats.multiputs, "inserts should wait");
+    build_query(query, sizeof(query), 0, 1);
+    opo_client_query(&err, client, query, count_cb, &cnt);
+    opo_client_stats(client, &stats);
+    ut_same_int(1, (int)stats.multiputs, "inserts should be sent before the query");
+    opo_client_process(client, 4, 1.0);
+    ut_same_int(4, atomic_load(&cnt), "responses");
+    ut_true(dtime() - start < options.multiput_window, "should not have waited");
+
+    // Otherwise the inserts wait out the window.
+    ut_same_int(10, insert_ten(client, 1.0), "inserts");
+    ut_true(options.multiput_window <= dtime() - start, "should have waited");
+    opo_client_stats(client, &stats);
+    ut_same_int(2, (int)stats.multiputs, "bundles");
+    opo_client_close(client);
+
+    // A bundle that reaches the size is sent at once. Each record fills one
+    // on its own here.
+    options.multiput_max = 1;
+    client = opo_client_connect(&err, opod_host, opod_port, &options);
+    ut_same_int(OPO_ERR_OK, err.code, "error connecting. %s", err.msg);
+    start = dtime();
+    ut_same_int(10, insert_ten(client, 1.0), "inserts");
+    ut_true(dtime() - start < options.multiput_window, "should not have waited");
+    opo_client_stats(client, &stats);
+    ut_same_int(10, (int)stats.multiputs, "bundles");
+    opo_client_close(client);
+}
+
+// A reactor client sends a lone insert when its window ends rather than on
+// the next reactor tick.
+static void
+multiput_reactor_test() {
+    struct _opoErr	err = OPO_ERR_INIT;
+    opoReactor		reactor = opo_reactor_create(&err, 1);
+
+    ut_same_int(OPO_ERR_OK, err.code, "error creating reactor. %s", err.msg);
+
+    struct _opoClientOptions	options = {
+	.timeout = 1.0,
+	.pending_max = 64,
+	.multiput_window = 0.002,
+	.reactor = reactor,
+    };
+    opoClient	client = opo_client_connect(&err, opod_host, opod_port, &options);
+
+    ut_same_int(OPO_ERR_OK, err.code, "error connecting. %s", err.msg);
+
+    uint8_t			query[1024];
+    struct _opoClientStats	stats;
+    double			worst = 0.0;
+
+    for (int i = 0; i < 10; i++) {
+	double		start = dtime();
+	double		dt;
+	atomic_int	cnt;
+
+	atomic_init(&cnt, 0);
+	build_insert(query, sizeof(query), i);
+	opo_client_query(&err, client, query, count_cb, &cnt);
+	ut_same_int(OPO_ERR_OK, err.code, "error sending. %s", err.msg);
+	opo_client_process(client, 1, 1.0);
+	ut_same_int(1, atomic_load(&cnt), "insert %d callbacks", i);
+	if (worst < (dt = dtime() - start)) {
+	    worst = dt;
+	}
+    }
+    ut_true(worst < 0.05, "lone insert took %0.3f secs", worst);
+    opo_client_stats(client, &stats);
+    ut_same_int(10, (int)stats.multiputs, "bundles");
+    opo_client_close(client);
+    opo_reactor_destroy(reactor);
+}
+
 void
 append_client_tests(utTest tests) {
     ut_appenda(tests, "opo.client.connect", connect_test, NULL);
@@ -486,5 +2223,32 @@ append_client_tests(utTest tests) {
     ut_appenda(tests, "opo.client.async.query", async_query_test, NULL);
     ut_appenda(tests, "opo.client.dual.query", dual_query_test, NULL);
     ut_appenda(tests, "opo.client.dual.async", dual_async_test, NULL);
+    ut_appenda(tests, "opo.client.try.query", try_query_test, NULL);
+    ut_appenda(tests, "opo.client.try.full", try_full_test, NULL);
+    ut_appenda(tests, "opo.client.reactor", reactor_test, NULL);
+    ut_appenda(tests, "opo.client.reactor.close", reactor_close_test, NULL);
+    ut_appenda(tests, "opo.client.embedded", embedded_test, NULL);
     ut_appenda(tests, "opo.client.latency", latency_test, NULL);
+    ut_appenda(tests, "opo.client.inline.latency", inline_latency_test, NULL);
+    ut_appenda(tests, "opo.client.scaling", scaling_test, NULL);
+    ut_appenda(tests, "opo.client.oversize", oversize_test, NULL);
+    ut_appenda(tests, "opo.client.multi.process", multi_process_test, NULL);
+    ut_appenda(tests, "opo.client.deadline", deadline_test, NULL);
+    ut_appenda(tests, "opo.client.deadline.reactor", deadline_reactor_test, NULL);
+    ut_appenda(tests, "opo.client.deadline.async", deadline_async_test, NULL);
+    ut_appenda(tests, "opo.client.async.full", async_full_test, NULL);
+    ut_appenda(tests, "opo.client.cancel", cancel_test, NULL);
+    ut_appenda(tests, "opo.client.cancel.late", cancel_late_test, NULL);
+    ut_appenda(tests, "opo.client.async.cancel", async_cancel_test, NULL);
+    ut_appenda(tests, "opo.client.call", call_test, NULL);
+    ut_appenda(tests, "opo.client.call.timeout", call_timeout_test, NULL);
+    ut_appenda(tests, "opo.client.batch", batch_test, NULL);
+    ut_appenda(tests, "opo.client.cache", cache_test, NULL);
+    ut_appenda(tests, "opo.client.coalesce", coalesce_test, NULL);
+    ut_appenda(tests, "opo.client.coalesce.lost", coalesce_lost_test, NULL);
+    ut_appenda(tests, "opo.client.multiget", multiget_test, NULL);
+    ut_appenda(tests, "opo.client.multiget.reactor", multiget_reactor_test, NULL);
+    ut_appenda(tests, "opo.client.multiput", multiput_test, NULL);
+    ut_appenda(tests, "opo.client.multiput.reactor", multiput_reactor_test, NULL);
+    ut_appenda(tests, "opo.client.unix", unix_test, NULL);
 }
@@ -0,0 +1,176 @@
+// Copyright 2017 by Peter Ohler, All Rights Reserved
+
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <opo/opo.h>
+
+#include "helper.h"
+#include "ut.h"
+
+static const char	*key_paths[] = { "where", "insert.kind", NULL };
+
+static void
+cluster_route_test() {
+    struct _opoErr		err = OPO_ERR_INIT;
+    struct _opoClientOptions	options = {
+	.timeout = 2.0,
+	.pending_max = 1024,
+    };
+    opoCluster	cluster = opo_cluster_connect(&err, opod_nodes, 2, key_paths, &options);
+
+    ut_same_int(OPO_ERR_OK, err.code, "error connecting. %s", err.msg);
+
+    uint8_t	query[1024];
+    opoClient	first = NULL;
+    opoClient	owners[100];
+    int		moved = 0;
+    atomic_int	cnt;
+
+    for (int i = 0; i < 100; i++) {
+	build_ref_query(query, sizeof(query), i + 1);
+	owners[i] = opo_cluster_client(cluster, query);
+	if (NULL == first) {
+	    first = owners[i];
+	} else if (first != owners[i]) {
+	    moved++;
+	}
+    }
+    ut_true(0 < moved && moved < 100, "keys not spread over both nodes, %d of 100 on one", 100 - moved);
+
+    // Removing a node only moves the keys it owned.
+    opoClient	remaining = NULL;
+
+    opo_cluster_remove_node(&err, cluster, opod_nodes[1]);
+    ut_same_int(OPO_ERR_OK, err.code, "error removing node. %s", err.msg);
+    for (int i = 0; i < 100; i++) {
+	build_ref_query(query, sizeof(query), i + 1);
+	opoClient	c = opo_cluster_client(cluster, query);
+
+	if (NULL == remaining) {
+	    remaining = c;
+	}
+	ut_true(c == remaining, "key %d not on the remaining node", i + 1);
+    }
+    // Adding it back restores the original placement.
+    opo_cluster_add_node(&err, cluster, opod_nodes[1]);
+    ut_same_int(OPO_ERR_OK, err.code, "error adding node. %s", err.msg);
+    for (int i = 0; i < 100; i++) {
+	build_ref_query(query, sizeof(query), i + 1);
+	ut_true(owners[i] == opo_cluster_client(cluster, query), "key %d not restored", i + 1);
+    }
+    atomic_init(&cnt, 0);
+    for (int i = 0; i < 100; i++) {
+	build_ref_query(query, sizeof(query), i + 1);
+	opo_cluster_query(&err, cluster, query, count_cb, &cnt);
+    }
+    ut_same_int(OPO_ERR_OK, err.code, "error sending. %s", err.msg);
+    ut_same_int(100, opo_cluster_process(cluster, 100, 1.0), "responses processed");
+    ut_same_int(100, atomic_load(&cnt), "callbacks");
+
+    // A query without a routing key is rejected.
+    struct _opoBuilder	builder;
+
+    opo_builder_init(&err, &builder, query, sizeof(query));
+    opo_builder_push_object(&err, &builder, NULL, -1);
+    opo_builder_push_string(&err, &builder, "$", 1, "select", 6);
+    opo_builder_finish(&builder);
+    ut_same_int(0, (int)opo_cluster_query(&err, cluster, query, count_cb, &cnt), "query without key");
+    ut_same_int(OPO_ERR_ARG, err.code, "error for query without key");
+    opo_cluster_close(cluster);
+
+    // A cluster with no nodes has nothing to route to or process.
+    opo_err_clear(&err);
+    cluster = opo_cluster_connect(&err, opod_nodes, 0, key_paths, &options);
+    ut_same_int(OPO_ERR_OK, err.code, "error connecting. %s", err.msg);
+    build_ref_query(query, sizeof(query), 1);
+    ut_same_int(0, (int)opo_cluster_query(&err, cluster, query, count_cb, &cnt), "query with no nodes");
+    ut_same_int(OPO_ERR_NOT_FOUND, err.code, "error for query with no nodes");
+    ut_same_int(0, opo_cluster_process(cluster, 1, 0.01), "empty cluster processed");
+    opo_cluster_close(cluster);
+}
+
+typedef struct _Merged {
+    int		cnt; // entries in the merged response
+    int		errors; // entries with a non-zero code
+    opoRef	ref;
+} *Merged;
+
+static void
+gather_cb(opoRef ref, opoMsg response, void *ctx) {
+    struct _opoErr	err = OPO_ERR_INIT;
+    Merged		m = (Merged)ctx;
+    opoVal		v = opo_msg_val(response);
+    opoVal		e;
+    opoVal		code;
+
+    m->ref = ref;
+    if (OPO_VAL_ARRAY == opo_val_type(v)) {
+	m->cnt = opo_val_member_count(&err, v);
+	e = opo_val_members(&err, v);
+	for (int i = 0; i < m->cnt; i++, e = opo_val_next(e)) {
+	    if (NULL != (code = opo_val_get(e, "code")) && 0 != opo_val_int(&err, code)) {
+		m->errors++;
+	    }
+	}
+    }
+}
+
+static void
+cluster_scatter_test() {
+    struct _opoErr		err = OPO_ERR_INIT;
+    struct _opoClientOptions	options = {
+	.timeout = 0.05,
+	.pending_max = 1,
+    };
+    opoCluster	cluster = opo_cluster_connect(&err, opod_nodes, 2, key_paths, &options);
+
+    ut_same_int(OPO_ERR_OK, err.code, "error connecting. %s", err.msg);
+
+    uint8_t		query[1024];
+    struct _Merged	merged = { .cnt = -1, .errors = 0 };
+    struct _Merged	full = { .cnt = -1, .errors = 0 };
+    opoRef		ref;
+    opoRef		node_ref;
+
+    build_ref_query(query, sizeof(query), 1);
+    ref = opo_cluster_scatter(&err, cluster, query, gather_cb, &merged);
+    ut_true(0 != ref, "scatter failed. %s", err.msg);
+
+    // Each node only has room for the one query so the next scatter can
+    // not be sent anywhere. It still completes, with an error for each
+    // node, and err is left clear.
+    ut_true(0 != opo_cluster_scatter(&err, cluster, query, gather_cb, &full), "second scatter failed. %s", err.msg);
+    ut_same_int(OPO_ERR_OK, err.code, "error on second scatter. %s", err.msg);
+    ut_same_int(2, full.cnt, "entries when not sent");
+    ut_same_int(2, full.errors, "error entries when not sent");
+
+    ut_same_int(2, opo_cluster_process(cluster, 2, 1.0), "responses processed");
+    ut_same_int(2, merged.cnt, "merged responses");
+    ut_same_int(0, merged.errors, "merged errors");
+    ut_true(ref == merged.ref, "merged ref");
+
+    // Scatter refs never match those of single node queries.
+    node_ref = opo_cluster_query(&err, cluster, query, NULL, NULL);
+    ut_true(0 != node_ref && node_ref != ref, "scatter ref matches a query ref");
+    opo_cluster_process(cluster, 1, 1.0);
+    opo_cluster_close(cluster);
+
+    // Parts are completed by per-query callbacks which a query_callback
+    // replaces.
+    options.query_callback = gather_cb;
+    options.query_ctx = &merged;
+    options.pending_max = 16;
+    cluster = opo_cluster_connect(&err, opod_nodes, 2, key_paths, &options);
+    ut_same_int(OPO_ERR_OK, err.code, "error connecting. %s", err.msg);
+    ut_same_int(0, (int)opo_cluster_scatter(&err, cluster, query, gather_cb, &merged), "scatter with a query_callback");
+    ut_same_int(OPO_ERR_ARG, err.code, "error for scatter with a query_callback");
+    opo_cluster_close(cluster);
+}
+
+void
+append_cluster_tests(utTest tests) {
+    ut_appenda(tests, "opo.cluster.route", cluster_route_test, NULL);
+    ut_appenda(tests, "opo.cluster.scatter", cluster_scatter_test, NULL);
+}
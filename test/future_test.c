@@ -0,0 +1,221 @@
+// Copyright 2017 by Peter Ohler, All Rights Reserved
+
+#include <errno.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <opo/opo.h>
+
+#include "helper.h"
+#include "ut.h"
+
+static void
+build_query(uint8_t *query, size_t qsize, int64_t rid) {
+    struct _opoErr	err = OPO_ERR_INIT;
+    struct _opoBuilder	builder;
+
+    opo_builder_init(&err, &builder, query, qsize);
+    opo_builder_push_object(&err, &builder, NULL, -1);
+    opo_builder_push_int(&err, &builder, rid, "rid", 3);
+    opo_builder_push_int(&err, &builder, 1, "where", 5);
+    opo_builder_push_string(&err, &builder, "$", 1, "select", 6);
+    opo_builder_finish(&builder);
+}
+
+static int64_t
+response_rid(opoMsg resp) {
+    struct _opoErr	err = OPO_ERR_INIT;
+
+    return opo_val_int(&err, opo_val_get(opo_msg_val(resp), "rid"));
+}
+
+static void
+wait_all_test() {
+    struct _opoErr		err = OPO_ERR_INIT;
+    struct _opoClientOptions	options = {
+	.timeout = 1.0,
+	.pending_max = 64,
+    };
+    opoClient	client = opo_client_connect(&err, opod_host, opod_port, &options);
+
+    ut_same_int(OPO_ERR_OK, err.code, "error connecting. %s", err.msg);
+
+    opoFuture	futures[16];
+    uint8_t	query[1024];
+    int		matched = 0;
+
+    for (int i = 0; i < 16; i++) {
+	futures[i] = opo_future_create(&err);
+    }
+    // The same futures are used for every round without a reset.
+    for (int round = 0; round < 100; round++) {
+	for (int i = 0; i < 16; i++) {
+	    build_query(query, sizeof(query), round * 16 + i + 1);
+	    opo_client_query_future(&err, client, query, futures[i]);
+	}
+	ut_same_int(OPO_ERR_OK, err.code, "error sending. %s", err.msg);
+	ut_same_int(16, opo_future_wait_all(&err, futures, 16, 2.0), "futures done. %s", err.msg);
+	for (int i = 0; i < 16; i++) {
+	    opoMsg	resp = opo_future_wait(&err, futures[i], 0.0);
+
+	    if (NULL != resp && round * 16 + i + 1 == response_rid(resp)) {
+		matched++;
+	    }
+	}
+    }
+    ut_same_int(1600, matched, "responses matched");
+
+    for (int i = 0; i < 16; i++) {
+	opo_future_destroy(futures[i]);
+    }
+    opo_client_close(client);
+}
+
+static void
+build_fetch(uint8_t *query, size_t qsize, int64_t ref) {
+    struct _opoErr	err = OPO_ERR_INIT;
+    struct _opoBuilder	builder;
+
+    opo_builder_init(&err, &builder, query, qsize);
+    opo_builder_push_object(&err, &builder, NULL, -1);
+    opo_builder_push_int(&err, &builder, ref, "where", 5);
+    opo_builder_push_string(&err, &builder, "$", 1, "select", 6);
+    opo_builder_finish(&builder);
+}
+
+// Gathered fetches get responses built on the heap which are handed to the
+// futures instead of being copied.
+static void
+multiget_test() {
+    struct _opoErr		err = OPO_ERR_INIT;
+    struct _opoClientOptions	options = {
+	.timeout = 1.0,
+	.pending_max = 64,
+	.multiget_window = 0.01,
+	.multiget_max = 4,
+    };
+    opoClient	client = opo_client_connect(&err, opod_host, opod_port, &options);
+
+    ut_same_int(OPO_ERR_OK, err.code, "error connecting. %s", err.msg);
+
+    opoFuture			futures[4];
+    uint8_t			query[1024];
+    struct _opoClientStats	stats;
+
+    for (int i = 0; i < 4; i++) {
+	futures[i] = opo_future_create(&err);
+    }
+    for (int round = 0; round < 10; round++) {
+	for (int i = 0; i < 4; i++) {
+	    build_fetch(query, sizeof(query), i + 1);
+	    opo_client_query_future(&err, client, query, futures[i]);
+	}
+	ut_same_int(OPO_ERR_OK, err.code, "error sending. %s", err.msg);
+	ut_same_int(4, opo_future_wait_all(&err, futures, 4, 2.0), "futures done. %s", err.msg);
+	for (int i = 0; i < 4; i++) {
+	    ut_true(NULL != opo_future_wait(&err, futures[i], 0.0), "no response. %s", err.msg);
+	}
+    }
+    opo_client_stats(client, &stats);
+    ut_same_int(10, (int)stats.multigets, "gathered queries sent");
+
+    for (int i = 0; i < 4; i++) {
+	opo_future_destroy(futures[i]);
+    }
+    opo_client_close(client);
+}
+
+typedef struct _Then {
+    atomic_int	cnt;
+    opoErrCode	code;
+    int64_t	rid;
+} *Then;
+
+static void
+then_cb(opoFuture future, opoMsg response, opoErrCode code, void *ctx) {
+    Then	then = (Then)ctx;
+
+    then->code = code;
+    then->rid = (NULL == response) ? 0 : response_rid(response);
+    atomic_fetch_add(&then->cnt, 1);
+}
+
+static void
+wait_any_test() {
+    struct _opoErr		err = OPO_ERR_INIT;
+    struct _opoClientOptions	options = {
+	.timeout = 5.0,
+	.pending_max = 16,
+    };
+    int		port;
+    int		server = silent_server(&port);
+    opoClient	silent = opo_client_connect(&err, "127.0.0.1", port, &options);
+    opoClient	client = opo_client_connect(&err, opod_host, opod_port, &options);
+
+    ut_same_int(OPO_ERR_OK, err.code, "error connecting. %s", err.msg);
+
+    opoFuture		futures[2] = { opo_future_create(&err), opo_future_create(&err) };
+    uint8_t		query[1024];
+    opoRef		ref;
+    struct _Then	then = { .code = OPO_ERR_OK, .rid = 0 };
+
+    atomic_init(&then.cnt, 0);
+    build_query(query, sizeof(query), 1);
+    ref = opo_client_query_future(&err, silent, query, futures[0]);
+    opo_future_then(futures[0], then_cb, &then);
+    build_query(query, sizeof(query), 2);
+    opo_client_query_future(&err, client, query, futures[1]);
+    ut_same_int(OPO_ERR_OK, err.code, "error sending. %s", err.msg);
+
+    ut_same_int(1, opo_future_wait_any(&err, futures, 2, 2.0), "first future done. %s", err.msg);
+    ut_same_int(2, (int)response_rid(opo_future_response(futures[1])), "response rid");
+    ut_true(!opo_future_ready(futures[0]), "silent future should be pending");
+
+    // A pending future can not be reused.
+    opo_client_query_future(&err, silent, query, futures[0]);
+    ut_same_int(OPO_ERR_IN_USE, err.code, "reusing a pending future");
+    opo_err_clear(&err);
+
+    // Waiting can time out without giving up on the query.
+    ut_true(NULL == opo_future_wait(&err, futures[0], 0.05), "expected a timeout");
+    ut_same_int(ETIMEDOUT, err.code, "wait timeout");
+    opo_err_clear(&err);
+
+    ut_true(opo_client_cancel(silent, ref), "cancel failed");
+    ut_true(NULL == opo_future_wait(&err, futures[0], 0.0), "canceled future has no response");
+    ut_same_int(OPO_ERR_CANCELED, err.code, "canceled future");
+    ut_same_int(1, atomic_load(&then.cnt), "then callbacks");
+    ut_same_int(OPO_ERR_CANCELED, then.code, "then code");
+    opo_err_clear(&err);
+
+    // A then on a completed future is called right away.
+    opo_future_then(futures[1], then_cb, &then);
+    ut_same_int(2, atomic_load(&then.cnt), "then callbacks on completed future");
+    ut_same_int(2, (int)then.rid, "then response");
+
+    // Futures without a query are not taken as done.
+    opoFuture	idle[2] = { opo_future_create(&err), futures[1] };
+
+    ut_same_int(1, opo_future_wait_any(&err, idle, 2, 1.0), "idle future skipped. %s", err.msg);
+    ut_same_int(-1, opo_future_wait_any(&err, idle, 1, 1.0), "only an idle future");
+    ut_same_int(OPO_ERR_ARG, err.code, "only an idle future");
+    opo_err_clear(&err);
+    opo_future_destroy(idle[0]);
+
+    opo_future_destroy(futures[0]);
+    opo_future_destroy(futures[1]);
+    opo_client_close(client);
+    opo_client_close(silent);
+    close(server);
+}
+
+void
+append_future_tests(utTest tests) {
+    ut_appenda(tests, "opo.future.wait.all", wait_all_test, NULL);
+    ut_appenda(tests, "opo.future.wait.any", wait_any_test, NULL);
+    ut_appenda(tests, "opo.future.multiget", multiget_test, NULL);
+}
@@ -0,0 +1,52 @@
+// Copyright 2017 by Peter Ohler, All Rights Reserved
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#include "helper.h"
+
+const char	*opod_host = "127.0.0.1";
+//const char	*opod_host = "192.168.1.10";
+//const char	*opod_host = "192.168.1.11";
+
+int		opod_port = 6364;
+
+const char	*opod_nodes[2] = { "127.0.0.1:6364", "localhost:6364" };
+
+void
+build_ref_query(uint8_t *query, size_t qsize, uint64_t ref) {
+    struct _opoErr	err = OPO_ERR_INIT;
+    struct _opoBuilder	builder;
+
+    opo_builder_init(&err, &builder, query, qsize);
+    opo_builder_push_object(&err, &builder, NULL, -1);
+    opo_builder_push_int(&err, &builder, (int64_t)ref, "where", 5);
+    opo_builder_push_string(&err, &builder, "$", 1, "select", 6);
+    opo_builder_finish(&builder);
+}
+
+void
+count_cb(opoRef ref, opoMsg response, void *ctx) {
+    atomic_fetch_add((atomic_int*)ctx, 1);
+}
+
+int
+silent_server(int *portp) {
+    struct sockaddr_in	addr;
+    socklen_t		len = sizeof(addr);
+    int			sock = socket(AF_INET, SOCK_STREAM, 0);
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = 0;
+    bind(sock, (struct sockaddr*)&addr, sizeof(addr));
+    listen(sock, 4);
+    getsockname(sock, (struct sockaddr*)&addr, &len);
+    *portp = ntohs(addr.sin_port);
+
+    return sock;
+}
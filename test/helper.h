@@ -0,0 +1,28 @@
+// Copyright 2017 by Peter Ohler, All Rights Reserved
+
+#ifndef __OPO_HELPER_H__
+#define __OPO_HELPER_H__
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <opo/opo.h>
+
+// Helpers shared by the tests that talk to an opod server.
+
+extern const char	*opod_host;
+extern int		opod_port;
+// The same server under two names acts as two nodes or replicas.
+extern const char	*opod_nodes[2];
+
+// Builds a fetch of the record with the ref.
+extern void	build_ref_query(uint8_t *query, size_t qsize, uint64_t ref);
+
+// Adds one to the atomic_int ctx.
+extern void	count_cb(opoRef ref, opoMsg response, void *ctx);
+
+// Returns a listening socket on a loopback port that accepts connections
+// but never answers.
+extern int	silent_server(int *portp);
+
+#endif /* __OPO_HELPER_H__ */
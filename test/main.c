@@ -11,6 +11,10 @@ extern void	append_builder_tests(utTest tests);
 extern void	append_val_tests(utTest tests);
 extern void	append_opo_tests(utTest tests);
 extern void	append_client_tests(utTest tests);
+extern void	append_cluster_tests(utTest tests);
+extern void	append_future_tests(utTest tests);
+extern void	append_pool_tests(utTest tests);
+extern void	append_replica_tests(utTest tests);
 
 int
 main(int argc, char **argv) {
@@ -20,6 +24,10 @@ main(int argc, char **argv) {
     append_val_tests(tests);
     append_opo_tests(tests);
     append_client_tests(tests);
+    append_cluster_tests(tests);
+    append_future_tests(tests);
+    append_pool_tests(tests);
+    append_replica_tests(tests);
 
     ut_init(argc, argv, "OpO", tests);
 
@@ -0,0 +1,131 @@
+// Copyright 2017 by Peter Ohler, All Rights Reserved
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <opo/opo.h>
+
+#include "helper.h"
+#include "ut.h"
+
+static void*
+process_loop(void *ctx) {
+    opo_pool_process((opoPool)ctx, 0, 0.5);
+    return NULL;
+}
+
+// Sends iter queries over the pool while another thread processes the
+// responses. Returns the number of responses processed before all came back
+// or the wait ran out.
+static int
+run_queries(opoPool pool, int iter, double wait) {
+    struct _opoErr	err = OPO_ERR_INIT;
+    uint8_t		query[1024];
+    atomic_int		cnt;
+    pthread_t		thread;
+    double		give_up = dtime() + wait;
+
+    atomic_init(&cnt, 0);
+    build_ref_query(query, sizeof(query), 1);
+    pthread_create(&thread, NULL, process_loop, pool);
+    for (int i = iter; 0 < i; i--) {
+	opo_pool_query(&err, pool, query, count_cb, &cnt);
+	if (OPO_ERR_OK != err.code) {
+	    printf("*** error sending %s\n", err.msg);
+	    opo_err_clear(&err);
+	}
+    }
+    while (atomic_load(&cnt) < iter && dtime() < give_up) {
+	usleep(100);
+    }
+    pthread_join(thread, NULL);
+
+    return atomic_load(&cnt);
+}
+
+static void
+pool_query_test() {
+    struct _opoErr		err = OPO_ERR_INIT;
+    struct _opoClientOptions	options = {
+	.timeout = 2.0,
+	.pending_max = 1024,
+    };
+    opoPool	pool = opo_pool_connect(&err, opod_host, opod_port, 4, &options);
+
+    ut_same_int(OPO_ERR_OK, err.code, "error connecting. %s", err.msg);
+    ut_same_int(4, opo_pool_size(pool), "pool size");
+    ut_same_int(1000, run_queries(pool, 1000, 10.0), "responses processed");
+    // Least pending should have spread the queries over all connections.
+    for (int i = 0; i < 4; i++) {
+	struct _opoClientStats	stats;
+
+	opo_client_stats(opo_pool_client(pool, i), &stats);
+	ut_true(0 < stats.sent_bytes, "connection %d not used", i);
+    }
+    opo_pool_close(pool);
+}
+
+static void
+bench_pool_query_test() {
+    struct _opoErr		err = OPO_ERR_INIT;
+    struct _opoClientOptions	options = {
+	.timeout = 2.0,
+	.pending_max = 1024,
+    };
+    opoPool	pool = opo_pool_connect(&err, opod_host, opod_port, 4, &options);
+
+    ut_same_int(OPO_ERR_OK, err.code, "error connecting. %s", err.msg);
+
+    int		iter = 100000;
+    double	start = dtime();
+    int		cnt = run_queries(pool, iter, 60.0);
+    double	dt = dtime() - start;
+
+    printf("--- pool of 4: %d of %d in %0.3f secs  %d queries/sec\n", cnt, iter, dt, (int)((double)cnt / dt));
+    opo_pool_close(pool);
+}
+
+static void
+pool_affinity_test() {
+    struct _opoErr		err = OPO_ERR_INIT;
+    struct _opoClientOptions	options = {
+	.timeout = 2.0,
+	.pending_max = 1024,
+    };
+    opoPool	pool = opo_pool_connect(&err, opod_host, opod_port, 4, &options);
+
+    ut_same_int(OPO_ERR_OK, err.code, "error connecting. %s", err.msg);
+    opo_pool_set_affinity(pool, true);
+
+    uint8_t	query[1024];
+    atomic_int	cnt;
+    int		used = 0;
+
+    atomic_init(&cnt, 0);
+    build_ref_query(query, sizeof(query), 1);
+    for (int i = 100; 0 < i; i--) {
+	opo_pool_query(&err, pool, query, count_cb, &cnt);
+    }
+    ut_same_int(100, opo_pool_process(pool, 100, 1.0), "responses processed");
+    // All the queries from this thread go to one connection.
+    for (int i = 0; i < 4; i++) {
+	struct _opoClientStats	stats;
+
+	opo_client_stats(opo_pool_client(pool, i), &stats);
+	if (0 < stats.sent_bytes) {
+	    used++;
+	}
+    }
+    ut_same_int(1, used, "connections used");
+    opo_pool_close(pool);
+}
+
+void
+append_pool_tests(utTest tests) {
+    ut_appenda(tests, "opo.pool.query", pool_query_test, NULL);
+    ut_appenda(tests, "opo.pool.affinity", pool_affinity_test, NULL);
+    ut_appenda(tests, "opo.bench.pool_query", bench_pool_query_test, NULL);
+}
@@ -0,0 +1,310 @@
+// Copyright 2017 by Peter Ohler, All Rights Reserved
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <opo/opo.h>
+
+#include "helper.h"
+#include "ut.h"
+
+static void
+replica_query_test() {
+    struct _opoErr		err = OPO_ERR_INIT;
+    struct _opoClientOptions	options = {
+	.timeout = 2.0,
+	.pending_max = 1024,
+    };
+    opoReplicaSet	set = opo_replica_connect(&err, opod_nodes, 2, &options);
+
+    ut_same_int(OPO_ERR_OK, err.code, "error connecting. %s", err.msg);
+    ut_same_int(2, opo_replica_size(set), "replica set size");
+
+    uint8_t	query[1024];
+    atomic_int	cnt;
+    int		iter = 1000;
+
+    atomic_init(&cnt, 0);
+    build_ref_query(query, sizeof(query), 1);
+    for (int i = iter; 0 < i; i--) {
+	opo_replica_query(&err, set, query, count_cb, &cnt);
+	if (0 == i % 10) {
+	    opo_replica_process(set, 0, 0.0);
+	}
+    }
+    ut_same_int(OPO_ERR_OK, err.code, "error sending. %s", err.msg);
+    while (atomic_load(&cnt) < iter && 0 < opo_replica_process(set, 0, 1.0)) {
+    }
+    ut_same_int(iter, atomic_load(&cnt), "responses processed");
+    // Both replicas should have answered and so have a response time.
+    for (int i = 0; i < 2; i++) {
+	struct _opoClientStats	stats;
+
+	opo_client_stats(opo_replica_client(set, i), &stats);
+	ut_true(0.0 < stats.rtt && stats.rtt < 2.0, "replica %d response time %f", i, stats.rtt);
+    }
+    opo_replica_close(set);
+}
+
+static atomic_int	status_errors;
+
+static void
+status_cb(opoClient client, bool connected, opoErrCode code, const char *msg) {
+    if (OPO_ERR_OK != code) {
+	atomic_fetch_add(&status_errors, 1);
+    }
+}
+
+static void
+replica_hedge_test() {
+    struct _opoErr		err = OPO_ERR_INIT;
+    struct _opoClientOptions	options = {
+	.timeout = 2.0,
+	.pending_max = 1024,
+	.status_callback = status_cb,
+    };
+    opoReplicaSet	set = opo_replica_connect(&err, opod_nodes, 2, &options);
+
+    ut_same_int(OPO_ERR_OK, err.code, "error connecting. %s", err.msg);
+    // A short delay so some queries are sent to both replicas.
+    opo_replica_set_hedge(&err, set, 0.0001);
+    ut_same_int(OPO_ERR_OK, err.code, "error setting hedge. %s", err.msg);
+
+    uint8_t	query[1024];
+    atomic_int	cnt;
+    int		iter = 1000;
+    double	give_up = dtime() + 5.0;
+
+    atomic_init(&cnt, 0);
+    atomic_init(&status_errors, 0);
+    build_ref_query(query, sizeof(query), 1);
+    for (int i = iter; 0 < i; i--) {
+	opo_replica_query(&err, set, query, count_cb, &cnt);
+	if (0 == i % 10) {
+	    opo_replica_process(set, 0, 0.0);
+	}
+    }
+    ut_same_int(OPO_ERR_OK, err.code, "error sending. %s", err.msg);
+    // Wait for the slower copies as well.
+    while ((atomic_load(&cnt) < iter || 0 < opo_replica_pending_count(set)) && dtime() < give_up) {
+	opo_replica_process(set, 0, 0.01);
+    }
+    opo_replica_process(set, 0, 0.1);
+    ut_same_int(iter, atomic_load(&cnt), "each query called back once");
+    ut_same_int(0, atomic_load(&status_errors), "status errors");
+    opo_replica_close(set);
+}
+
+static void
+ref_cb(opoRef ref, opoMsg response, void *ctx) {
+    *(opoRef*)ctx = ref;
+}
+
+static void
+replica_hedge_cancel_test() {
+    struct _opoErr		err = OPO_ERR_INIT;
+    struct _opoClientOptions	options = {
+	.timeout = 2.0,
+	.pending_max = 1024,
+    };
+    int		port;
+    int		server = silent_server(&port);
+    char	silent[64];
+    const char	*pair[] = { silent, opod_nodes[0] };
+
+    snprintf(silent, sizeof(silent), "127.0.0.1:%d", port);
+
+    opoReplicaSet	set = opo_replica_connect(&err, pair, 2, &options);
+
+    ut_same_int(OPO_ERR_OK, err.code, "error connecting. %s", err.msg);
+    opo_replica_set_hedge(&err, set, 0.01);
+
+    uint8_t	query[1024];
+    opoRef	sent[20];
+    opoRef	got[20];
+    int		iter = 20;
+    double	give_up = dtime() + 1.0;
+
+    build_ref_query(query, sizeof(query), 1);
+    for (int i = 0; i < iter; i++) {
+	got[i] = 0;
+	sent[i] = opo_replica_query(&err, set, query, ref_cb, got + i);
+	ut_true(0 != sent[i], "query failed. %s", err.msg);
+    }
+    // Copies to the silent replica are answered by the other and then
+    // canceled well before they would time out.
+    while (0 < opo_replica_pending_count(set) && dtime() < give_up) {
+	opo_replica_process(set, 0, 0.01);
+    }
+    ut_same_int(0, opo_replica_pending_count(set), "losing copies not canceled");
+    for (int i = 0; i < iter; i++) {
+	ut_same_int(sent[i], got[i], "ref passed to the callback");
+    }
+    opo_replica_close(set);
+    close(server);
+}
+
+typedef struct _Slow {
+    int		sock;
+    useconds_t	delay;
+    pthread_t	thread;
+} *Slow;
+
+// Answers each query on the first connection with {code:0} after a delay,
+// one at a time, until the connection is closed.
+static void*
+slow_loop(void *ctx) {
+    struct _opoErr	err = OPO_ERR_INIT;
+    struct _opoBuilder	builder;
+    Slow		slow = (Slow)ctx;
+    int			conn = accept(slow->sock, NULL, NULL);
+    uint8_t		buf[1024];
+    uint8_t		resp[64];
+    size_t		size;
+
+    opo_builder_init(&err, &builder, resp, sizeof(resp));
+    opo_builder_push_object(&err, &builder, NULL, -1);
+    opo_builder_push_int(&err, &builder, 0, "code", 4);
+    opo_builder_finish(&builder);
+    while (0 <= conn) {
+	// The id, the value type, and the value length.
+	if (13 != recv(conn, buf, 13, MSG_WAITALL)) {
+	    break;
+	}
+	if (sizeof(buf) < (size = opo_msg_bsize(buf)) ||
+	    (ssize_t)(size - 13) != recv(conn, buf + 13, size - 13, MSG_WAITALL)) {
+	    break;
+	}
+	usleep(slow->delay);
+	opo_msg_set_id(resp, opo_msg_id(buf));
+	send(conn, resp, opo_msg_bsize(resp), 0);
+    }
+    if (0 <= conn) {
+	close(conn);
+    }
+    return NULL;
+}
+
+static void
+code_cb(opoRef ref, opoMsg response, void *ctx) {
+    struct _opoErr	err = OPO_ERR_INIT;
+
+    *(int64_t*)ctx = opo_val_int(&err, opo_val_get(opo_msg_val(response), "code"));
+}
+
+// A copy that times out does not win over the other copy that is still
+// waiting on its response.
+static void
+replica_hedge_lost_test() {
+    struct _opoErr		err = OPO_ERR_INIT;
+    struct _opoClientOptions	options = {
+	.timeout = 0.1,
+	.pending_max = 16,
+    };
+    int			port;
+    int			server = silent_server(&port);
+    struct _Slow	slow = { .delay = 80000 };
+    int			slow_port;
+    char		silent[64];
+    char		slower[64];
+    const char		*pair[] = { silent, slower };
+
+    slow.sock = silent_server(&slow_port);
+    pthread_create(&slow.thread, NULL, slow_loop, &slow);
+    snprintf(silent, sizeof(silent), "127.0.0.1:%d", port);
+    snprintf(slower, sizeof(slower), "127.0.0.1:%d", slow_port);
+
+    opoReplicaSet	set = opo_replica_connect(&err, pair, 2, &options);
+
+    ut_same_int(OPO_ERR_OK, err.code, "error connecting. %s", err.msg);
+    // The copy goes out after the delay and is answered before it times
+    // out but after the first copy sent to the silent replica does.
+    opo_replica_set_hedge(&err, set, 0.05);
+
+    uint8_t	query[1024];
+
+    build_ref_query(query, sizeof(query), 1);
+    for (int i = 0; i < 6; i++) {
+	int64_t	code = -1;
+	double	give_up = dtime() + 1.0;
+
+	opo_replica_query(&err, set, query, code_cb, &code);
+	ut_same_int(OPO_ERR_OK, err.code, "error sending. %s", err.msg);
+	while (-1 == code && dtime() < give_up) {
+	    opo_replica_process(set, 0, 0.01);
+	}
+	ut_same_int(OPO_ERR_OK, code, "query %d response code", i);
+	give_up = dtime() + 1.0;
+	while (0 < opo_replica_pending_count(set) && dtime() < give_up) {
+	    opo_replica_process(set, 0, 0.01);
+	}
+    }
+    opo_replica_close(set);
+    close(server);
+    shutdown(slow.sock, SHUT_RDWR);
+    pthread_join(slow.thread, NULL);
+    close(slow.sock);
+}
+
+// Hedged queries still waiting when the set is closed are canceled.
+static void
+replica_hedge_close_test() {
+    struct _opoErr		err = OPO_ERR_INIT;
+    struct _opoClientOptions	options = {
+	.timeout = 2.0,
+	.pending_max = 16,
+    };
+    int		ports[2];
+    int		servers[2] = { silent_server(ports), silent_server(ports + 1) };
+    char	names[2][64];
+    const char	*pair[] = { names[0], names[1] };
+
+    snprintf(names[0], sizeof(names[0]), "127.0.0.1:%d", ports[0]);
+    snprintf(names[1], sizeof(names[1]), "127.0.0.1:%d", ports[1]);
+
+    opoReplicaSet	set = opo_replica_connect(&err, pair, 2, &options);
+
+    ut_same_int(OPO_ERR_OK, err.code, "error connecting. %s", err.msg);
+    opo_replica_set_hedge(&err, set, 0.01);
+
+    uint8_t	query[1024];
+    int64_t	codes[5];
+
+    build_ref_query(query, sizeof(query), 1);
+    for (int i = 0; i < 5; i++) {
+	codes[i] = -1;
+	opo_replica_query(&err, set, query, code_cb, codes + i);
+    }
+    ut_same_int(OPO_ERR_OK, err.code, "error sending. %s", err.msg);
+    // Long enough for the copies to be sent.
+    usleep(50000);
+    opo_replica_close(set);
+    for (int i = 0; i < 5; i++) {
+	ut_same_int(OPO_ERR_CANCELED, codes[i], "query %d response code", i);
+    }
+    close(servers[0]);
+    close(servers[1]);
+
+    // Copies are completed by per-query callbacks so hedging is refused
+    // with a query_callback.
+    options.query_callback = count_cb;
+    set = opo_replica_connect(&err, opod_nodes, 2, &options);
+    ut_same_int(OPO_ERR_OK, err.code, "error connecting. %s", err.msg);
+    ut_same_int(OPO_ERR_ARG, opo_replica_set_hedge(&err, set, 0.01), "hedge with a query_callback");
+    opo_replica_close(set);
+}
+
+void
+append_replica_tests(utTest tests) {
+    ut_appenda(tests, "opo.replica.query", replica_query_test, NULL);
+    ut_appenda(tests, "opo.replica.hedge", replica_hedge_test, NULL);
+    ut_appenda(tests, "opo.replica.hedge.cancel", replica_hedge_cancel_test, NULL);
+    ut_appenda(tests, "opo.replica.hedge.lost", replica_hedge_lost_test, NULL);
+    ut_appenda(tests, "opo.replica.hedge.close", replica_hedge_close_test, NULL);
+}